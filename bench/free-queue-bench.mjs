@@ -0,0 +1,340 @@
+/**
+ * Headless Node.js benchmark for the wasm build and the JS FreeQueue.
+ *
+ *   node bench/free-queue-bench.mjs [--build <dir>] [--quick]
+ *
+ * Loads free-queue.wasm.js and free-queue.js from |dir| (build/ by default,
+ * so both come from the same build.sh run) and measures:
+ *   - cwrap/ccall call overhead against the raw wasm export,
+ *   - typed-array |subarray().set()| copies against a plain loop,
+ *   - JS->JS, C->JS and JS->C transfers through one queue shared between
+ *     worker_threads (the C side always runs on the main thread, which owns
+ *     the wasm instance).
+ * Only the constructor, |fromPointers|, |push| and |pull| are used, so any
+ * matching pair of build artifacts can be measured.
+ */
+
+import fs from 'fs';
+import path from 'path';
+import { createRequire } from 'module';
+import { fileURLToPath } from 'url';
+import { Worker, isMainThread, parentPort, workerData } from 'worker_threads';
+
+const CHANNEL_COUNT = 2;
+/** Ring capacity in blocks. */
+const CAPACITY_BLOCKS = 16;
+/** Failed attempts before a side sleeps for |BACKOFF_MS|. */
+const SPIN = 64;
+const BACKOFF_MS = 0.05;
+
+/**
+ * Loads the FreeQueue class. free-queue.js is a plain script without an
+ * export, so it is evaluated in a function scope.
+ */
+function loadFreeQueue(buildDir) {
+  const source = fs.readFileSync(path.join(buildDir, 'free-queue.js'), 'utf8');
+  return new Function(source + '\nreturn FreeQueue;')();
+}
+
+/**
+ * Instantiates free-queue.wasm.js. The build is not MODULARIZE'd and keeps
+ * its runtime in a |var Module|, so the script is evaluated with |Module|
+ * passed in, as a browser <script> would see it.
+ */
+function loadModule(buildDir) {
+  const file = path.resolve(buildDir, 'free-queue.wasm.js');
+  const source = fs.readFileSync(file, 'utf8');
+  return new Promise((resolve, reject) => {
+    const Module = {
+      print: console.log,
+      printErr: console.error,
+      onAbort: reject,
+      onRuntimeInitialized: () => resolve(Module),
+    };
+    new Function('Module', 'require', '__filename', '__dirname', source)(
+        Module, createRequire(file), file, path.dirname(file));
+  });
+}
+
+/** Sleeps for |ms| without leaving the thread (Atomics.wait on a private cell). */
+const sleepCell = new Int32Array(new SharedArrayBuffer(4));
+function backoff(ms) {
+  Atomics.wait(sleepCell, 0, 0, ms);
+}
+
+/**
+ * Two-party start barrier on a shared Int32Array: each side increments and
+ * spins until both have arrived, so neither timer includes thread startup.
+ */
+function arrive(barrier) {
+  Atomics.add(barrier, 0, 1);
+  while (Atomics.load(barrier, 0) < 2) {}
+}
+
+/**
+ * Runs |blocks| JS pushes of |blockLength| frames. Sample 0 of channel 0
+ * carries the block number so the consumer can verify ordering.
+ */
+function jsProduce(queue, blockLength, blocks) {
+  const input = [];
+  for (let channel = 0; channel < queue.channelCount; channel++) {
+    input.push(new Float64Array(blockLength));
+  }
+  for (let block = 0; block < blocks; block++) {
+    input[0][0] = block;
+    let misses = 0;
+    while (!queue.push(input, blockLength)) {
+      if (++misses === SPIN) {
+        misses = 0;
+        backoff(BACKOFF_MS);
+      }
+    }
+  }
+  return true;
+}
+
+/** Counterpart of |jsProduce|. @return {boolean} True if the order held. */
+function jsConsume(queue, blockLength, blocks) {
+  const output = [];
+  for (let channel = 0; channel < queue.channelCount; channel++) {
+    output.push(new Float64Array(blockLength));
+  }
+  let ordered = true;
+  for (let block = 0; block < blocks; block++) {
+    let misses = 0;
+    while (!queue.pull(output, blockLength)) {
+      if (++misses === SPIN) {
+        misses = 0;
+        backoff(BACKOFF_MS);
+      }
+    }
+    if (output[0][0] !== block) ordered = false;
+  }
+  return ordered;
+}
+
+/**
+ * C side of a transfer: |call| is the cwrap'ed FreeQueuePush or
+ * FreeQueuePull, |channels| a double** in the wasm heap.
+ */
+function cTransfer(Module, call, queuePointer, channels, marker, produce,
+    blockLength, blocks) {
+  const HEAPF64 = new Float64Array(Module.HEAPU8.buffer);
+  let ordered = true;
+  for (let block = 0; block < blocks; block++) {
+    if (produce) HEAPF64[marker / 8] = block;
+    let misses = 0;
+    while (!call(queuePointer, channels, blockLength)) {
+      if (++misses === SPIN) {
+        misses = 0;
+        backoff(BACKOFF_MS);
+      }
+    }
+    if (!produce && HEAPF64[marker / 8] !== block) ordered = false;
+  }
+  return ordered;
+}
+
+/** Allocates a double** of |channelCount| blocks in the wasm heap. */
+function allocChannels(Module, channelCount, blockLength) {
+  const channels = Module._malloc(channelCount * 4);
+  const HEAPU32 = new Uint32Array(Module.HEAPU8.buffer);
+  for (let channel = 0; channel < channelCount; channel++) {
+    HEAPU32[channels / 4 + channel] = Module._malloc(blockLength * 8);
+  }
+  return {channels, marker: HEAPU32[channels / 4]};
+}
+
+function freeChannels(Module, channels, channelCount) {
+  const HEAPU32 = new Uint32Array(Module.HEAPU8.buffer);
+  for (let channel = 0; channel < channelCount; channel++) {
+    Module._free(HEAPU32[channels / 4 + channel]);
+  }
+  Module._free(channels);
+}
+
+/**
+ * Reattaches a queue inside a worker: a structured clone keeps the
+ * SharedArrayBuffer views but drops the prototype.
+ */
+function attachQueue(FreeQueue, data) {
+  if (data.pointers) {
+    return FreeQueue.fromPointers(
+        Object.assign({memory: {buffer: data.memory}}, data.pointers));
+  }
+  return Object.setPrototypeOf(data.queue, FreeQueue.prototype);
+}
+
+function runWorker() {
+  const data = workerData;
+  const FreeQueue = loadFreeQueue(data.buildDir);
+  const queue = attachQueue(FreeQueue, data);
+  arrive(data.barrier);
+  const start = performance.now();
+  const ordered = data.produce
+      ? jsProduce(queue, data.blockLength, data.blocks)
+      : jsConsume(queue, data.blockLength, data.blocks);
+  parentPort.postMessage({elapsed: performance.now() - start, ordered});
+}
+
+function startWorker(data) {
+  const worker = new Worker(fileURLToPath(import.meta.url), {workerData: data});
+  return new Promise((resolve, reject) => {
+    worker.once('message', resolve);
+    worker.once('error', reject);
+  });
+}
+
+function report(name, blockLength, blocks, elapsed, ordered) {
+  const frames = blockLength * blocks;
+  console.log(
+      name.padEnd(9) +
+      String(blockLength).padStart(7) +
+      (frames / elapsed / 1000).toFixed(2).padStart(12) +
+      (elapsed * 1e6 / blocks).toFixed(1).padStart(12) +
+      (elapsed * 1e6 / frames).toFixed(2).padStart(10) +
+      (ordered ? '' : '  OUT OF ORDER'));
+}
+
+/** Times |fn| over |count| calls. @return {number} ns per call. */
+function timeCalls(fn, count) {
+  for (let i = 0; i < 1000; i++) fn();
+  const start = performance.now();
+  for (let i = 0; i < count; i++) fn();
+  return (performance.now() - start) * 1e6 / count;
+}
+
+function benchCallOverhead(Module, calls) {
+  const CreateFreeQueue = Module.cwrap('CreateFreeQueue', 'number', ['number', 'number']);
+  const FreeQueuePush = Module.cwrap('FreeQueuePush', 'number', ['number', 'number', 'number']);
+  const GetFreeQueuePointers = Module.cwrap('GetFreeQueuePointers', 'number', ['number', 'string']);
+  const queuePointer = CreateFreeQueue(1024, 1);
+  const {channels} = allocChannels(Module, 1, 1);
+  // a zero-length push touches the indices but copies nothing
+  console.log('# call overhead, ns per call (zero-length FreeQueuePush)');
+  console.log('raw export   ' + timeCalls(
+      () => Module._FreeQueuePush(queuePointer, channels, 0), calls).toFixed(1).padStart(8));
+  console.log('cwrap        ' + timeCalls(
+      () => FreeQueuePush(queuePointer, channels, 0), calls).toFixed(1).padStart(8));
+  console.log('ccall        ' + timeCalls(
+      () => Module.ccall('FreeQueuePush', 'number', ['number', 'number', 'number'],
+          [queuePointer, channels, 0]), calls).toFixed(1).padStart(8));
+  console.log('cwrap+string ' + timeCalls(
+      () => GetFreeQueuePointers(queuePointer, 'channel_data'), calls).toFixed(1).padStart(8) +
+      '  (GetFreeQueuePointers)');
+  freeChannels(Module, channels, 1);
+}
+
+function benchCopy(blockLengths, blocks) {
+  console.log('# copy into a ring, ns per block (per frame)');
+  console.log('block'.padEnd(7) + 'subarray().set()'.padStart(24) + 'for loop'.padStart(24));
+  for (const blockLength of blockLengths) {
+    const ringLength = blockLength * CAPACITY_BLOCKS + 1;
+    const ring = new Float64Array(ringLength);
+    const input = new Float64Array(blockLength);
+    let offset = 0;
+    // both variants split the block at the ring end like |push| does
+    const viaSet = timeCalls(() => {
+      const first = Math.min(blockLength, ringLength - offset);
+      ring.set(input.subarray(0, first), offset);
+      if (first < blockLength) ring.set(input.subarray(first, blockLength), 0);
+      offset = (offset + blockLength) % ringLength;
+    }, blocks);
+    offset = 0;
+    const viaLoop = timeCalls(() => {
+      for (let i = 0; i < blockLength; i++) {
+        ring[(offset + i) % ringLength] = input[i];
+      }
+      offset = (offset + blockLength) % ringLength;
+    }, blocks);
+    const cell = (ns) => (ns.toFixed(1) + ' (' + (ns / blockLength).toFixed(2) + ')').padStart(24);
+    console.log(String(blockLength).padEnd(7) + cell(viaSet) + cell(viaLoop));
+  }
+}
+
+async function benchTransfers(Module, FreeQueue, buildDir, blockLengths, frames) {
+  const CreateFreeQueue = Module.cwrap('CreateFreeQueue', 'number', ['number', 'number']);
+  const GetFreeQueuePointers = Module.cwrap('GetFreeQueuePointers', 'number', ['number', 'string']);
+  const FreeQueuePush = Module.cwrap('FreeQueuePush', 'number', ['number', 'number', 'number']);
+  const FreeQueuePull = Module.cwrap('FreeQueuePull', 'number', ['number', 'number', 'number']);
+  const DestroyFreeQueue = Module._DestroyFreeQueue
+      ? Module.cwrap('DestroyFreeQueue', null, ['number']) : () => {};
+
+  console.log('# transfers, ' + CHANNEL_COUNT + ' channels, ring of ' +
+      CAPACITY_BLOCKS + ' blocks');
+  console.log('path'.padEnd(9) + 'block'.padStart(7) + 'Mframes/s'.padStart(12) +
+      'ns/block'.padStart(12) + 'ns/frame'.padStart(10));
+  for (const blockLength of blockLengths) {
+    const blocks = Math.max(64, Math.floor(frames / blockLength));
+    const capacity = blockLength * CAPACITY_BLOCKS;
+    const shared = {buildDir, blockLength, blocks};
+
+    // JS -> JS: both ends in workers, no wasm involved
+    {
+      const queue = new FreeQueue(capacity, CHANNEL_COUNT);
+      const barrier = new Int32Array(new SharedArrayBuffer(4));
+      const [producer, consumer] = await Promise.all([
+        startWorker({...shared, queue, barrier, produce: true}),
+        startWorker({...shared, queue, barrier, produce: false}),
+      ]);
+      report('JS->JS', blockLength, blocks,
+          Math.max(producer.elapsed, consumer.elapsed), consumer.ordered);
+    }
+
+    // C -> JS and JS -> C: the wasm side runs here, the JS side in a worker
+    for (const cProduces of [true, false]) {
+      const queuePointer = CreateFreeQueue(capacity, CHANNEL_COUNT);
+      const pointers = {
+        bufferLengthPointer: GetFreeQueuePointers(queuePointer, 'buffer_length'),
+        channelCountPointer: GetFreeQueuePointers(queuePointer, 'channel_count'),
+        statePointer: GetFreeQueuePointers(queuePointer, 'state'),
+        channelDataPointer: GetFreeQueuePointers(queuePointer, 'channel_data'),
+        sampleTypePointer: GetFreeQueuePointers(queuePointer, 'sample_type'),
+        flagsPointer: GetFreeQueuePointers(queuePointer, 'flags'),
+        // 0 from builds older than the single-block layout
+        basePointer: GetFreeQueuePointers(queuePointer, 'base'),
+      };
+      const {channels, marker} = allocChannels(Module, CHANNEL_COUNT, blockLength);
+      const barrier = new Int32Array(new SharedArrayBuffer(4));
+      const worker = startWorker({...shared, pointers, barrier,
+          memory: Module.HEAPU8.buffer, produce: !cProduces});
+      arrive(barrier);
+      const start = performance.now();
+      const ordered = cTransfer(Module, cProduces ? FreeQueuePush : FreeQueuePull,
+          queuePointer, channels, marker, cProduces, blockLength, blocks);
+      const elapsed = performance.now() - start;
+      const js = await worker;
+      report(cProduces ? 'C->JS' : 'JS->C', blockLength, blocks,
+          Math.max(elapsed, js.elapsed), cProduces ? js.ordered : ordered);
+      freeChannels(Module, channels, CHANNEL_COUNT);
+      DestroyFreeQueue(queuePointer);
+    }
+  }
+}
+
+async function main() {
+  const args = process.argv.slice(2);
+  const quick = args.includes('--quick');
+  const buildIndex = args.indexOf('--build');
+  const buildDir = buildIndex >= 0 && args[buildIndex + 1]
+      ? path.resolve(args[buildIndex + 1])
+      : path.resolve(path.dirname(fileURLToPath(import.meta.url)), '../build');
+
+  const FreeQueue = loadFreeQueue(buildDir);
+  const Module = await loadModule(buildDir);
+  const blockLengths = quick ? [128, 1024] : [32, 128, 256, 512, 1024, 4096];
+
+  benchCallOverhead(Module, quick ? 100000 : 1000000);
+  benchCopy(blockLengths, quick ? 10000 : 100000);
+  await benchTransfers(Module, FreeQueue, buildDir, blockLengths,
+      quick ? 1 << 20 : 1 << 23);
+}
+
+if (isMainThread) {
+  main().then(() => process.exit(0), (error) => {
+    console.error(error);
+    process.exit(1);
+  });
+} else {
+  runWorker();
+}
@@ -0,0 +1,268 @@
+// Native throughput and latency benchmark for the C queue in
+// src/free_queue.cpp. Build with build-native.sh, then run
+//
+//   build/native/free_queue_bench [--quick] [--producer-cpu N] [--consumer-cpu N]
+//
+// Every configuration moves the same block through FreeQueuePush/Pull on a
+// pinned producer and a pinned consumer thread. The consumer only pulls once
+// the ring holds |fill| of its capacity plus one block, so the fill column
+// sets how far apart the two sides work. Latency is per successful call and
+// includes one steady_clock read (~20 ns).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Entry points of free_queue.cpp; queues are opaque here.
+struct FreeQueueWindow {
+  size_t offset;
+  size_t first;
+  size_t second;
+};
+
+extern "C" {
+void *CreateFreeQueueWithFlagsFloat64(size_t length, size_t channel_count, uint32_t flags);
+void DestroyFreeQueueFloat64(void *queue);
+bool FreeQueuePushFloat64(void *queue, double **input, size_t block_length);
+bool FreeQueuePullFloat64(void *queue, double **output, size_t block_length);
+void *CreateFreeQueueWithFlagsFloat32(size_t length, size_t channel_count, uint32_t flags);
+void DestroyFreeQueueFloat32(void *queue);
+bool FreeQueuePushFloat32(void *queue, float **input, size_t block_length);
+bool FreeQueuePullFloat32(void *queue, float **output, size_t block_length);
+void *CreateFreeQueueWithFlagsInt16(size_t length, size_t channel_count, uint32_t flags);
+void DestroyFreeQueueInt16(void *queue);
+bool FreeQueuePushInt16(void *queue, int16_t **input, size_t block_length);
+bool FreeQueuePullInt16(void *queue, int16_t **output, size_t block_length);
+void *CreateFreeQueueWithFlagsInt32(size_t length, size_t channel_count, uint32_t flags);
+void DestroyFreeQueueInt32(void *queue);
+bool FreeQueuePushInt32(void *queue, int32_t **input, size_t block_length);
+bool FreeQueuePullInt32(void *queue, int32_t **output, size_t block_length);
+size_t FreeQueueBeginRead(void *queue, size_t length, struct FreeQueueWindow *window);
+}
+
+/** Ring capacity in blocks; fill levels are fractions of it. */
+#define BENCH_CAPACITY_BLOCKS 16
+/** Bytes moved per configuration before --quick scaling. */
+#define BENCH_BYTES (256u << 20)
+#define BENCH_MIN_OPS 256
+#define BENCH_MAX_OPS 200000
+/** Failed attempts before a side yields its core. */
+#define BENCH_SPIN 64
+
+template <typename T>
+struct BenchApi {
+  const char *name;
+  void *(*create)(size_t, size_t, uint32_t);
+  void (*destroy)(void *);
+  bool (*push)(void *, T **, size_t);
+  bool (*pull)(void *, T **, size_t);
+};
+
+struct BenchOptions {
+  bool quick;
+  int producer_cpu;
+  int consumer_cpu;
+};
+
+template <typename T>
+struct BenchRun {
+  const BenchApi<T> *api;
+  void *queue;
+  size_t channel_count;
+  size_t block;
+  size_t target;
+  size_t ops;
+  int cpu;
+  std::atomic_int done;
+  std::vector<uint32_t> push_ns;
+  std::vector<uint32_t> pull_ns;
+};
+
+static int cpu_count = 1;
+
+static inline uint64_t _nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void _pin(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % cpu_count, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+template <typename T>
+static T **_allocChannels(size_t channel_count, size_t length) {
+  T **data = (T **)malloc(channel_count * sizeof(T *));
+  for (size_t i = 0; i < channel_count; i++) {
+    data[i] = (T *)calloc(length, sizeof(T));
+  }
+  return data;
+}
+
+template <typename T>
+static void _freeChannels(T **data, size_t channel_count) {
+  for (size_t i = 0; i < channel_count; i++) free(data[i]);
+  free(data);
+}
+
+template <typename T>
+static void *_producer(void *arg) {
+  BenchRun<T> *run = (BenchRun<T> *)arg;
+  _pin(run->cpu);
+  T **input = _allocChannels<T>(run->channel_count, run->block);
+  for (size_t i = 0; i < run->ops; i++) {
+    int misses = 0;
+    for (;;) {
+      uint64_t start = _nowNs();
+      if (run->api->push(run->queue, input, run->block)) {
+        run->push_ns[i] = (uint32_t)std::min<uint64_t>(_nowNs() - start, UINT32_MAX);
+        break;
+      }
+      if (++misses == BENCH_SPIN) {
+        misses = 0;
+        sched_yield();
+      }
+    }
+  }
+  run->done.store(1, std::memory_order_release);
+  _freeChannels(input, run->channel_count);
+  return nullptr;
+}
+
+template <typename T>
+static void _consumer(BenchRun<T> *run, int cpu) {
+  _pin(cpu);
+  T **output = _allocChannels<T>(run->channel_count, run->block);
+  struct FreeQueueWindow window;
+  for (size_t i = 0; i < run->ops; i++) {
+    int misses = 0;
+    for (;;) {
+      // hold the ring at the target fill until the producer is finished
+      bool hold = run->target > 0 && !run->done.load(std::memory_order_acquire) &&
+          FreeQueueBeginRead(run->queue, run->target + run->block, &window) <
+          run->target + run->block;
+      if (!hold) {
+        uint64_t start = _nowNs();
+        if (run->api->pull(run->queue, output, run->block)) {
+          run->pull_ns[i] = (uint32_t)std::min<uint64_t>(_nowNs() - start, UINT32_MAX);
+          break;
+        }
+      }
+      if (++misses == BENCH_SPIN) {
+        misses = 0;
+        sched_yield();
+      }
+    }
+  }
+  _freeChannels(output, run->channel_count);
+}
+
+static uint32_t _percentile(std::vector<uint32_t> &samples, double p) {
+  size_t k = (size_t)(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+  return samples[k];
+}
+
+template <typename T>
+static void _bench(const BenchApi<T> &api, size_t channel_count, size_t block,
+    int fill_percent, const BenchOptions &options) {
+  size_t capacity = block * BENCH_CAPACITY_BLOCKS;
+  size_t bytes_per_op = block * channel_count * sizeof(T);
+  size_t ops = (options.quick ? BENCH_BYTES / 16 : BENCH_BYTES) / bytes_per_op;
+  ops = std::max<size_t>(BENCH_MIN_OPS, std::min<size_t>(BENCH_MAX_OPS, ops));
+
+  BenchRun<T> run;
+  run.api = &api;
+  run.queue = api.create(capacity, channel_count, 0);
+  run.channel_count = channel_count;
+  run.block = block;
+  // leave room for the producer's next block above the target
+  run.target = std::min(capacity * fill_percent / 100, capacity - block);
+  run.ops = ops;
+  run.cpu = options.producer_cpu;
+  run.done.store(0);
+  run.push_ns.assign(ops, 0);
+  run.pull_ns.assign(ops, 0);
+
+  pthread_t tid;
+  uint64_t start = _nowNs();
+  pthread_create(&tid, nullptr, _producer<T>, &run);
+  _consumer(&run, options.consumer_cpu);
+  pthread_join(tid, nullptr);
+  double elapsed = (double)(_nowNs() - start);
+  api.destroy(run.queue);
+
+  printf("%-7s %4zu %6zu %4d%% %12.2f %10.1f %7u %7u %7u %7u %7u %7u\n",
+      api.name, channel_count, block, fill_percent,
+      ops * block / elapsed * 1000.0, elapsed / ops,
+      _percentile(run.push_ns, 0.5), _percentile(run.push_ns, 0.99),
+      _percentile(run.push_ns, 0.999), _percentile(run.pull_ns, 0.5),
+      _percentile(run.pull_ns, 0.99), _percentile(run.pull_ns, 0.999));
+  fflush(stdout);
+}
+
+template <typename T>
+static void _sweep(const BenchApi<T> &api, const BenchOptions &options) {
+  static const size_t kChannels[] = {1, 2, 8, 64};
+  static const size_t kBlocks[] = {1, 16, 128, 1024, 8192};
+  static const int kFills[] = {0, 50, 90};
+  for (size_t channel_count : kChannels) {
+    for (size_t block : kBlocks) {
+      for (int fill : kFills) {
+        if (options.quick && fill != 0) continue;
+        _bench(api, channel_count, block, fill, options);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options = {false, 0, 1};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      options.quick = true;
+    } else if (strcmp(argv[i], "--producer-cpu") == 0 && i + 1 < argc) {
+      options.producer_cpu = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--consumer-cpu") == 0 && i + 1 < argc) {
+      options.consumer_cpu = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--quick] [--producer-cpu N] [--consumer-cpu N]\n", argv[0]);
+      return 1;
+    }
+  }
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_count = online > 0 ? (int)online : 1;
+  printf("# producer on cpu %d, consumer on cpu %d (%d online)%s\n",
+      options.producer_cpu % cpu_count, options.consumer_cpu % cpu_count, cpu_count,
+      options.producer_cpu % cpu_count == options.consumer_cpu % cpu_count
+          ? ", sharing one core" : "");
+  printf("# %-5s %4s %6s %5s %12s %10s %7s %7s %7s %7s %7s %7s\n",
+      "type", "ch", "block", "fill", "Mframes/s", "ns/op",
+      "push50", "push99", "push999", "pull50", "pull99", "pull999");
+
+  static const BenchApi<double> kFloat64 = {"float64", CreateFreeQueueWithFlagsFloat64,
+      DestroyFreeQueueFloat64, FreeQueuePushFloat64, FreeQueuePullFloat64};
+  static const BenchApi<float> kFloat32 = {"float32", CreateFreeQueueWithFlagsFloat32,
+      DestroyFreeQueueFloat32, FreeQueuePushFloat32, FreeQueuePullFloat32};
+  static const BenchApi<int16_t> kInt16 = {"int16", CreateFreeQueueWithFlagsInt16,
+      DestroyFreeQueueInt16, FreeQueuePushInt16, FreeQueuePullInt16};
+  static const BenchApi<int32_t> kInt32 = {"int32", CreateFreeQueueWithFlagsInt32,
+      DestroyFreeQueueInt32, FreeQueuePushInt32, FreeQueuePullInt32};
+  _sweep(kFloat64, options);
+  _sweep(kFloat32, options);
+  _sweep(kInt16, options);
+  _sweep(kInt32, options);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# Native (non-Emscripten) build: static library and throughput benchmark.
+# export CXX=clang++
+
+export CXX=${CXX:-c++}
+export CXXFLAGS=${CXXFLAGS:-"-O3 -std=c++20"}
+export INSTALLDIR=build/native
+
+mkdir -p $INSTALLDIR
+
+echo $CXX: src/free_queue.cpp -DFREE_QUEUE_NO_MAIN -Iinclude -pthread $CXXFLAGS -o $INSTALLDIR/libfree_queue.a
+$CXX src/free_queue.cpp -c -DFREE_QUEUE_NO_MAIN -Iinclude -pthread $CXXFLAGS -o $INSTALLDIR/free_queue.o || exit 1
+OBJECTS=$INSTALLDIR/free_queue.o
+
+# optional decoder producers, e.g. CODEC_SOURCES="free_queue_flac.cpp" CODEC_LIBS="-lFLAC"
+for SOURCE in $CODEC_SOURCES; do
+  echo $CXX: src/$SOURCE
+  $CXX src/$SOURCE -c -Iinclude -pthread $CXXFLAGS -o $INSTALLDIR/${SOURCE%.cpp}.o || exit 1
+  OBJECTS="$OBJECTS $INSTALLDIR/${SOURCE%.cpp}.o"
+done
+ar rcs $INSTALLDIR/libfree_queue.a $OBJECTS || exit 1
+
+echo $CXX: bench/free_queue_bench.cpp -pthread $CXXFLAGS -o $INSTALLDIR/free_queue_bench
+$CXX bench/free_queue_bench.cpp $INSTALLDIR/libfree_queue.a $CODEC_LIBS -pthread $CXXFLAGS -o $INSTALLDIR/free_queue_bench || exit 1
+
+exit 0
@@ -7,7 +7,12 @@ rem Emscripten SDK...
 set EMSCRIPTENDIR=c:/emscripten/emsdk
 
 set CC=emcc
-set EMCCFLAGS=-s SINGLE_FILE=1 -s TOTAL_MEMORY=200MB -s ALLOW_MEMORY_GROWTH=0 -s EXPORTED_RUNTIME_METHODS=['callMain','ccall','cwrap'] -s INVOKE_RUN=0 -O3
+set EMCCFLAGS=-s SINGLE_FILE=1 -s TOTAL_MEMORY=200MB -s ALLOW_MEMORY_GROWTH=0 -s EXPORTED_RUNTIME_METHODS=['callMain','ccall','cwrap'] -s INVOKE_RUN=0 -std=c++20 -msimd128 -O3
+
+rem Optional decoder producers (src/free_queue_<codec>.cpp) and their
+rem libraries, built for wasm into src/lib:
+rem set CODEC_SOURCES=free_queue_flac.cpp
+rem set CODEC_LIBS=-lFLAC
 
 @del build\*.* /F /Q
 
@@ -4,7 +4,12 @@
 # export EMSCRIPTENDIR=c:/emscripten/emsdk
 
 export CC=emcc
-export EMCCFLAGS="-s SINGLE_FILE=1 -s TOTAL_MEMORY=200MB -s ALLOW_MEMORY_GROWTH=0 -s EXPORTED_RUNTIME_METHODS=['callMain','ccall','cwrap'] -s INVOKE_RUN=0 -O3"
+export EMCCFLAGS="-s SINGLE_FILE=1 -s TOTAL_MEMORY=200MB -s ALLOW_MEMORY_GROWTH=0 -s EXPORTED_RUNTIME_METHODS=['callMain','ccall','cwrap'] -s INVOKE_RUN=0 -std=c++20 -msimd128 -O3"
+
+# Optional decoder producers (src/free_queue_<codec>.cpp) and their
+# libraries, built for wasm into src/lib:
+# export CODEC_SOURCES="free_queue_flac.cpp"
+# export CODEC_LIBS="-lFLAC"
 
 rm --force build/*.*
 
@@ -33,8 +33,8 @@ if exist %JS_WASM_FILE% (
 	@del %JS_WASM_FILE%
 )
 
-@echo %CC%: free_queue.cpp -Llib -I../include -Iinclude -pthread %EMCCFLAGS% -o %JS_WASM_JS_FILE%
-@call %CC% free_queue.cpp -Llib -I../include -Iinclude -pthread %EMCCFLAGS% -o %JS_WASM_JS_FILE%
+@echo %CC%: free_queue.cpp %CODEC_SOURCES% -Llib -I../include -Iinclude -pthread %EMCCFLAGS% %CODEC_LIBS% -o %JS_WASM_JS_FILE%
+@call %CC% free_queue.cpp %CODEC_SOURCES% -Llib -I../include -Iinclude -pthread %EMCCFLAGS% %CODEC_LIBS% -o %JS_WASM_JS_FILE%
 
 @type %JS_FILE_PART% >> %JS_FILE%
 
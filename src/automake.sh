@@ -31,8 +31,8 @@ if [ -f $JS_WASM_FILE ]; then
 	rm $JS_WASM_FILE
 fi
 
-echo $CC: free_queue.cpp -Llib -I../include -Iinclude -pthread $EMCCFLAGS -o $JS_WASM_JS_FILE
-$CC free_queue.cpp -Llib -I../include -Iinclude -pthread $EMCCFLAGS -o $JS_WASM_JS_FILE
+echo $CC: free_queue.cpp $CODEC_SOURCES -Llib -I../include -Iinclude -pthread $EMCCFLAGS $CODEC_LIBS -o $JS_WASM_JS_FILE
+$CC free_queue.cpp $CODEC_SOURCES -Llib -I../include -Iinclude -pthread $EMCCFLAGS $CODEC_LIBS -o $JS_WASM_JS_FILE
 
 # cat $JS_FILE_PART >> $JS_FILE
 cat $JS_FILE_PART >> $JS_FILE
@@ -5,8 +5,21 @@
  * @property {Uint32Array} states Backed by SharedArrayBuffer.
  * @property {number} bufferLength The frame buffer length. Should be identical
  * throughout channels.
- * @property {Array<Float64Array>} channelData The length must be > 0.
+ * @property {Array<Float64Array|Float32Array|Int16Array|Int32Array>}
+ *   channelData The length must be > 0.
  * @property {number} channelCount same with channelData.length
+ * @property {number} sampleType One of |FreeQueue.SampleTypes|.
+ */
+
+/**
+ * A region of the ring returned by |beginWrite| and |beginRead|. Mirrors
+ * |struct FreeQueueWindow| in free_queue.cpp.
+ *
+ * @typedef FreeQueueWindow
+ * @property {number} length Frames in the window.
+ * @property {number} offset Start of the first span in every channel.
+ * @property {number} first Frames in the first span.
+ * @property {number} second Frames in the second span, starting at index 0.
  */
 
 /**
@@ -18,14 +31,142 @@
 class FreeQueue {
 
   /**
-   * An index set for shared state fields. Requires atomic access.
+   * An index set for shared state fields. Requires atomic access. READ and
+   * WRITE sit on separate 64-byte cache lines, matching |FreeQueueState| in
+   * free_queue.cpp.
    * @enum {number}
    */
   States = {
     /** @type {number} A shared index for reading from the queue. (consumer) */
     READ: 0,
     /** @type {number} A shared index for writing into the queue. (producer) */
-    WRITE: 1,  
+    WRITE: 16,  
+    /** @type {number} Non-zero once |close| was called. (control) */
+    CLOSED: 32,
+    /** @type {number} Consumers parked on WRITE. (control) */
+    READ_WAITERS: 34,
+    /** @type {number} Producers parked on READ. (control) */
+    WRITE_WAITERS: 36,
+    /** @type {number} Reads that moved frames. (consumer stats) */
+    STATS_PULLS: 48,
+    /** @type {number} Reads short of the request. (consumer stats) */
+    STATS_UNDERRUNS: 50,
+    /** @type {number} Total frames pulled. (consumer stats) */
+    STATS_FRAMES_PULLED: 52,
+    /** @type {number} Lowest fill seen by the consumer. (consumer stats) */
+    STATS_MIN_FILL: 54,
+    /** @type {number} Writes that moved frames. (producer stats) */
+    STATS_PUSHES: 64,
+    /** @type {number} Writes short of the request. (producer stats) */
+    STATS_OVERRUNS: 66,
+    /** @type {number} Total frames pushed. (producer stats) */
+    STATS_FRAMES_PUSHED: 68,
+    /** @type {number} Highest fill seen by the producer. (producer stats) */
+    STATS_MAX_FILL: 70,
+  }
+
+  /**
+   * Length of the shared state block in 32-bit words (consumer, producer,
+   * control and two statistics cache lines).
+   * @type {number}
+   */
+  static STATE_LENGTH = 80;
+
+  /** Bounds of the adaptive spin phase of |waitReadable|/|waitWritable|. */
+  static SPIN_MIN = 16;
+  static SPIN_MAX = 4096;
+
+  /**
+   * Storage type of the samples. Matches |FreeQueueSampleType| in
+   * free_queue.cpp.
+   * @enum {number}
+   */
+  static SampleTypes = {
+    FLOAT64: 0,
+    FLOAT32: 1,
+    INT16: 2,
+    INT32: 3,
+  }
+
+  /**
+   * Typed array constructor for each entry of |FreeQueue.SampleTypes|.
+   * @type {Array<Function>}
+   */
+  static ArrayTypes = [Float64Array, Float32Array, Int16Array, Int32Array];
+
+  /**
+   * Creation flags. Matches |FreeQueueFlags| in free_queue.cpp.
+   * @enum {number}
+   */
+  static Flags = {
+    /**
+     * Power-of-two capacity with free-running 64-bit READ/WRITE counters
+     * and mask indexing.
+     */
+    POW2: 1,
+    /**
+     * Push-to-pull latency instrumentation, see |getLatencyPercentile|.
+     */
+    LATENCY: 2,
+  }
+
+  /**
+   * Word indices of the latency block of a |Flags.LATENCY| queue. Matches
+   * |FreeQueueLatencyState| in free_queue.cpp; counters are 64-bit slots and
+   * each stamp is a {frame position, time in ms} pair of 64-bit slots.
+   * @enum {number}
+   */
+  static LatencyStates = {
+    STAMP_WRITE: 0,
+    DROPS: 2,
+    STAMP_READ: 16,
+    SAMPLES: 18,
+    MAX: 20,
+    HISTOGRAM: 32,
+    STAMPS: 640,
+  }
+
+  /**
+   * Histogram buckets: 8 linear ones below 8 ns, then 8 per power of two.
+   * @type {number}
+   */
+  static LATENCY_BUCKETS = 304;
+
+  /** Outstanding push stamps. @type {number} */
+  static LATENCY_STAMPS = 256;
+
+  /** Length of the latency block in 32-bit words. @type {number} */
+  static LATENCY_LENGTH = 1664;
+
+  /**
+   * First word of every queue block ("FREQ"). Matches |FREE_QUEUE_MAGIC|.
+   * @type {number}
+   */
+  static MAGIC = 0x51455246;
+
+  /** @type {number} Matches |FREE_QUEUE_LAYOUT_VERSION|. */
+  static LAYOUT_VERSION = 1;
+
+  /** @type {number} Header length in 32-bit words (one cache line). */
+  static HEADER_LENGTH = 16;
+
+  /**
+   * Word indices of the block header. Matches |FreeQueueHeader| in
+   * free_queue.cpp; offsets and sizes are in bytes.
+   * @enum {number}
+   */
+  static Header = {
+    MAGIC: 0,
+    VERSION: 1,
+    BYTES: 2,
+    BUFFER_LENGTH: 3,
+    CHANNEL_COUNT: 4,
+    SAMPLE_TYPE: 5,
+    FLAGS: 6,
+    STATE_OFFSET: 7,
+    LATENCY_OFFSET: 8,
+    CHANNEL_OFFSET: 9,
+    CHANNEL_STRIDE: 10,
   }
   
   /**
@@ -34,30 +175,123 @@ class FreeQueue {
    *
    * @param {number} size Frame buffer length.
    * @param {number} channelCount Total channel count.
+   * @param {number} sampleType One of |FreeQueue.SampleTypes|.
+   * @param {number} flags Bitwise OR of |FreeQueue.Flags|.
    */
-  constructor(size, channelCount = 1) {
-    this.states = new Uint32Array(
-      new SharedArrayBuffer(
-        Object.keys(this.States).length * Uint32Array.BYTES_PER_ELEMENT
-      )
-    );
+  constructor(size, channelCount = 1, sampleType = FreeQueue.SampleTypes.FLOAT64,
+      flags = 0) {
+    const header = FreeQueue.layout(size, channelCount, sampleType, flags);
+    const buffer = new SharedArrayBuffer(header[FreeQueue.Header.BYTES]);
+    this._initBlock(buffer, 0, header);
+  }
+
+  /**
+   * Creates a queue in memory that already exists: a region of an imported
+   * WebAssembly.Memory, or a slice of a larger SharedArrayBuffer.
+   *
+   * @param {SharedArrayBuffer} buffer
+   * @param {number} byteOffset Start of the block; a multiple of 64.
+   * @param {number} size Frame buffer length.
+   * @param {number} channelCount Total channel count.
+   * @param {number} sampleType One of |FreeQueue.SampleTypes|.
+   * @param {number} flags Bitwise OR of |FreeQueue.Flags|.
+   * @return {FreeQueue|null} Null if the block would not fit.
+   */
+  static createIn(buffer, byteOffset, size, channelCount = 1,
+      sampleType = FreeQueue.SampleTypes.FLOAT64, flags = 0) {
+    const header = FreeQueue.layout(size, channelCount, sampleType, flags);
+    if (byteOffset % 64 !== 0 ||
+        byteOffset + header[FreeQueue.Header.BYTES] > buffer.byteLength) {
+      return null;
+    }
+    const queue = new FreeQueue(0, 0);
+    queue._initBlock(buffer, byteOffset, header);
+    return queue;
+  }
+
+  /**
+   * Writes an empty queue described by |header| at |byteOffset| and attaches
+   * to it. As in |_initFreeQueueBlock|, the magic goes in last.
+   */
+  _initBlock(buffer, byteOffset, header) {
+    const Header = FreeQueue.Header;
+    new Uint8Array(buffer, byteOffset, header[Header.BYTES]).fill(0);
+    const words = new Uint32Array(buffer, byteOffset, FreeQueue.HEADER_LENGTH);
+    words.set(header.subarray(1), 1);
+    const capacity = (header[Header.FLAGS] & FreeQueue.Flags.POW2)
+        ? header[Header.BUFFER_LENGTH] : header[Header.BUFFER_LENGTH] - 1;
+    const counters = new BigUint64Array(buffer,
+        byteOffset + header[Header.STATE_OFFSET], FreeQueue.STATE_LENGTH / 2);
+    Atomics.store(counters, this.States.STATS_MIN_FILL / 2, BigInt(capacity));
+    Atomics.store(words, Header.MAGIC, FreeQueue.MAGIC);
+    this._attachBuffer(buffer, byteOffset);
+  }
+
+  /**
+   * Computes the block layout of a queue, as |_freeQueueLayout| does in C.
+   *
+   * @param {number} size Capacity in frames.
+   * @param {number} channelCount Total channel count.
+   * @param {number} sampleType One of |FreeQueue.SampleTypes|.
+   * @param {number} flags Bitwise OR of |FreeQueue.Flags|.
+   * @return {Uint32Array} The header; |Header.BYTES| is the block size.
+   */
+  static layout(size, channelCount, sampleType, flags) {
+    const Header = FreeQueue.Header;
+    const alignToLine = (bytes) => Math.ceil(bytes / 64) * 64;
     /**
-     * Use one extra bin to distinguish between the read and write indices 
-     * when full. See Tim Blechmann's |boost::lockfree::spsc_queue|
-     * implementation.
+     * Without POW2 one extra bin distinguishes between the read and write
+     * indices when full. See Tim Blechmann's |boost::lockfree::spsc_queue|.
      */
-    this.bufferLength = size + 1;
-    this.channelCount = channelCount;
-    this.channelData = [];
-    for (let i = 0; i < channelCount; i++) {
-      this.channelData.push(
-        new Float64Array(
-          new SharedArrayBuffer(
-            this.bufferLength * Float64Array.BYTES_PER_ELEMENT
-          )
-        )
-      );
+    let bufferLength = size + 1;
+    if (flags & FreeQueue.Flags.POW2) {
+      bufferLength = 1;
+      while (bufferLength < size) bufferLength *= 2;
+    }
+    const stateOffset = FreeQueue.HEADER_LENGTH * 4;
+    let latencyOffset = stateOffset + FreeQueue.STATE_LENGTH * 4;
+    let channelOffset = latencyOffset;
+    if (flags & FreeQueue.Flags.LATENCY) {
+      channelOffset += alignToLine(FreeQueue.LATENCY_LENGTH * 4);
+    } else {
+      latencyOffset = 0;
     }
+    const stride = alignToLine(
+        bufferLength * FreeQueue.ArrayTypes[sampleType].BYTES_PER_ELEMENT);
+    const header = new Uint32Array(FreeQueue.HEADER_LENGTH);
+    header[Header.MAGIC] = FreeQueue.MAGIC;
+    header[Header.VERSION] = FreeQueue.LAYOUT_VERSION;
+    header[Header.BYTES] = channelOffset + channelCount * stride;
+    header[Header.BUFFER_LENGTH] = bufferLength;
+    header[Header.CHANNEL_COUNT] = channelCount;
+    header[Header.SAMPLE_TYPE] = sampleType;
+    header[Header.FLAGS] = flags;
+    header[Header.STATE_OFFSET] = stateOffset;
+    header[Header.LATENCY_OFFSET] = latencyOffset;
+    header[Header.CHANNEL_OFFSET] = channelOffset;
+    header[Header.CHANNEL_STRIDE] = stride;
+    return header;
+  }
+
+  /**
+   * Attaches to the queue block at |byteOffset| in |buffer|: a queue made by
+   * the constructor (|queue.buffer|, |queue.byteOffset|, e.g. posted to a
+   * worker) or by C in the wasm heap (|memory.buffer| and the "base" pointer
+   * from GetFreeQueuePointers).
+   *
+   * @param {SharedArrayBuffer|ArrayBuffer} buffer
+   * @param {number} byteOffset Start of the block; a multiple of 64.
+   * @return {FreeQueue|null} Null if no queue of this layout version is there.
+   */
+  static fromBuffer(buffer, byteOffset = 0) {
+    const header = new Uint32Array(buffer, byteOffset, FreeQueue.HEADER_LENGTH);
+    if (Atomics.load(header, FreeQueue.Header.MAGIC) !== FreeQueue.MAGIC ||
+        header[FreeQueue.Header.VERSION] !== FreeQueue.LAYOUT_VERSION) {
+      return null;
+    }
+    const queue = new FreeQueue(0, 0);
+    queue._attachBuffer(buffer, byteOffset);
+    return queue;
   }
 
   /**
@@ -71,35 +305,64 @@ class FreeQueue {
    *   channelCountPointer: number;
    *   statePointer: number;
    *   channelDataPointer: number;
+   *   sampleTypePointer?: number; // Float64Array storage when omitted
+   *   flagsPointer?: number;      // no flags when omitted
+   *   latencyPointer?: number;    // needed with Flags.LATENCY
+   *   basePointer?: number;       // when non-zero, everything else is ignored
    * }
    * @returns FreeQueue
    */
   static fromPointers(queuePointers) {
 
+    if (queuePointers.basePointer) {
+      const HEAPU32 = new Uint32Array(queuePointers.memory.buffer);
+      return FreeQueue.fromBuffer(queuePointers.memory.buffer,
+          HEAPU32[queuePointers.basePointer / 4]);
+    }
+
     const queue = new FreeQueue(0, 0);
 
     const HEAPU32 = new Uint32Array(queuePointers.memory.buffer);
-    const HEAPF64 = new Float64Array(queuePointers.memory.buffer);
 
     const bufferLength = HEAPU32[queuePointers.bufferLengthPointer / 4];
     const channelCount = HEAPU32[queuePointers.channelCountPointer / 4];
+    const sampleType = queuePointers.sampleTypePointer
+        ? HEAPU32[queuePointers.sampleTypePointer / 4]
+        : FreeQueue.SampleTypes.FLOAT64;
+    const ArrayType = FreeQueue.ArrayTypes[sampleType];
+    const flags = queuePointers.flagsPointer
+        ? HEAPU32[queuePointers.flagsPointer / 4]
+        : 0;
 
     const states = HEAPU32.subarray(
         HEAPU32[queuePointers.statePointer / 4] / 4,
-        HEAPU32[queuePointers.statePointer / 4] / 4 + 2
+        HEAPU32[queuePointers.statePointer / 4] / 4 + FreeQueue.STATE_LENGTH
     );
 
     const channelData = [];
     for (let i = 0; i < channelCount; i++) {
       channelData.push(
-          new Float64Array( queuePointers.memory.buffer, HEAPU32[HEAPU32[queuePointers.channelDataPointer / 4] / 4 + i], bufferLength )
+          new ArrayType( queuePointers.memory.buffer, HEAPU32[HEAPU32[queuePointers.channelDataPointer / 4] / 4 + i], bufferLength )
       );
     }
     
     queue.bufferLength = bufferLength;
     queue.channelCount = channelCount;
+    queue.sampleType = sampleType;
+    queue.flags = flags;
     queue.states = states;
+    queue.counters = new BigUint64Array(
+        states.buffer, states.byteOffset, FreeQueue.STATE_LENGTH / 2);
+    queue.waitStates = new Int32Array(
+        states.buffer, states.byteOffset, FreeQueue.STATE_LENGTH);
     queue.channelData = channelData;
+    if ((flags & FreeQueue.Flags.LATENCY) && queuePointers.latencyPointer) {
+      const latency = HEAPU32[queuePointers.latencyPointer / 4] / 4;
+      queue._attachLatency(
+          HEAPU32.subarray(latency, latency + FreeQueue.LATENCY_LENGTH));
+    }
+    queue._cachedRead = queue._loadIndex(queue.States.READ);
+    queue._cachedWrite = queue._loadIndex(queue.States.WRITE);
 
     return queue;
   }
@@ -107,83 +370,252 @@ class FreeQueue {
   /**
    * Pushes the data into queue. Used by producer.
    *
-   * @param {Float64Array[]} input Its length must match with the channel
-   *   count of this queue.
+   * @param {TypedArray[]} input Its length must match with the channel
+   *   count of this queue. Values are converted to the queue's sample type
+   *   as on the native side: float input in [-1, 1] is scaled to the full
+   *   range of an integer queue.
    * @param {number} blockLength Input block frame length. It must be identical
    *   throughout channels.
    * @return {boolean} False if the operation fails.
    */
   push(input, blockLength) {
-    const currentRead = Atomics.load(this.states, this.States.READ);
-    const currentWrite = Atomics.load(this.states, this.States.WRITE);
-    if (this._getAvailableWrite(currentRead, currentWrite) < blockLength) {
+    const window = this.beginWrite(blockLength, this._window);
+    if (window.length < blockLength) {
       return false;
     }
-    let nextWrite = currentWrite + blockLength;
-    if (this.bufferLength < nextWrite) {
-      nextWrite -= this.bufferLength;
-      for (let channel = 0; channel < this.channelCount; channel++) {
-        const blockA = this.channelData[channel].subarray(currentWrite);
-        const blockB = this.channelData[channel].subarray(0, nextWrite);
-        blockA.set(input[channel].subarray(0, blockA.length));
-        blockB.set(input[channel].subarray(blockA.length));
-      }
-    } else {
-      for (let channel = 0; channel < this.channelCount; channel++) {
-        this.channelData[channel]
-            .subarray(currentWrite, nextWrite)
-            .set(input[channel].subarray(0, blockLength));
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      FreeQueue._copySamples(input[channel].subarray(0, window.first),
+          this.channelData[channel], window.offset);
+      if (window.second > 0) {
+        FreeQueue._copySamples(
+            input[channel].subarray(window.first, blockLength),
+            this.channelData[channel]);
       }
-      if (nextWrite === this.bufferLength) nextWrite = 0;
     }
-    Atomics.store(this.states, this.States.WRITE, nextWrite);
+    this.commitWrite(blockLength);
     return true;
   }
 
   /**
    * Pulls data out of the queue. Used by consumer.
    *
-   * @param {Float64Array[]} output Its length must match with the channel
-   *   count of this queue.
+   * @param {TypedArray[]} output Its length must match with the channel
+   *   count of this queue. Values are converted from the queue's sample
+   *   type, so integer samples come out in [-1, 1) for a float |output|.
    * @param {number} blockLength output block length. It must be identical
    *   throughout channels.
    * @return {boolean} False if the operation fails.
    */
   pull(output, blockLength) {
-    const currentRead = Atomics.load(this.states, this.States.READ);
-    const currentWrite = Atomics.load(this.states, this.States.WRITE);
-    if (this._getAvailableRead(currentRead, currentWrite) < blockLength) {
+    const window = this.beginRead(blockLength, this._window);
+    if (window.length < blockLength) {
       return false;
     }
-    let nextRead = currentRead + blockLength;
-    if (this.bufferLength < nextRead) {
-      nextRead -= this.bufferLength;
-      for (let channel = 0; channel < this.channelCount; channel++) {
-        const blockA = this.channelData[channel].subarray(currentRead);
-        const blockB = this.channelData[channel].subarray(0, nextRead);
-        output[channel].set(blockA);
-        output[channel].set(blockB, blockA.length);
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      FreeQueue._copySamples(this.channelData[channel].subarray(
+          window.offset, window.offset + window.first), output[channel]);
+      if (window.second > 0) {
+        FreeQueue._copySamples(
+            this.channelData[channel].subarray(0, window.second),
+            output[channel], window.first);
       }
-    } else {
-      for (let channel = 0; channel < this.channelCount; ++channel) {
-        output[channel].set(
-            this.channelData[channel].subarray(currentRead, nextRead)
-        );
+    }
+    this.commitRead(blockLength);
+    return true;
+  }
+
+  /**
+   * Pushes as many of |length| frames as fit. Used by producer.
+   *
+   * @param {TypedArray[]} input Its length must match with the channel
+   *   count of this queue. Values are converted as in |push|.
+   * @param {number} length Input frame length.
+   * @return {number} Number of frames pushed.
+   */
+  pushSome(input, length) {
+    const window = this.beginWrite(length, this._window);
+    if (window.length === 0) {
+      return 0;
+    }
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      FreeQueue._copySamples(input[channel].subarray(0, window.first),
+          this.channelData[channel], window.offset);
+      if (window.second > 0) {
+        FreeQueue._copySamples(
+            input[channel].subarray(window.first, window.length),
+            this.channelData[channel]);
       }
-      if (nextRead === this.bufferLength) {
-        nextRead = 0;
+    }
+    this.commitWrite(window.length);
+    return window.length;
+  }
+
+  /**
+   * Pulls as many of |length| frames as are available. Used by consumer.
+   *
+   * @param {TypedArray[]} output Its length must match with the channel
+   *   count of this queue. Values are converted as in |pull|.
+   * @param {number} length Requested frame length.
+   * @return {number} Number of frames pulled into the start of |output|.
+   */
+  pullSome(output, length) {
+    const window = this.beginRead(length, this._window);
+    if (window.length === 0) {
+      return 0;
+    }
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      FreeQueue._copySamples(this.channelData[channel].subarray(
+          window.offset, window.offset + window.first), output[channel]);
+      if (window.second > 0) {
+        FreeQueue._copySamples(
+            this.channelData[channel].subarray(0, window.second),
+            output[channel], window.first);
       }
     }
-    Atomics.store(this.states, this.States.READ, nextRead);
-    return true;
+    this.commitRead(window.length);
+    return window.length;
+  }
+
+  /**
+   * Reserves up to |length| frames of free space for the producer to fill in
+   * place. In every channel the reserved frames are
+   * |channelData[c][offset, offset + first)| followed by
+   * |channelData[c][0, second)|. Used by producer.
+   *
+   * @param {number} length Requested frame count.
+   * @param {FreeQueueWindow} window Optional object to fill and return, so
+   *   the audio thread can reuse one instead of allocating.
+   * @return {FreeQueueWindow} {length, offset, first, second}; |length| is
+   *   the number of frames reserved and may be smaller than requested.
+   */
+  beginWrite(length, window = {}) {
+    const currentWrite = this._loadIndex(this.States.WRITE);
+    let refreshed = false;
+    if (this._getAvailableWrite(this._cachedRead, currentWrite) < length) {
+      this._cachedRead = this._loadIndex(this.States.READ);
+      refreshed = true;
+    }
+    const available = this._getAvailableWrite(this._cachedRead, currentWrite);
+    if (available < length) {
+      length = available;
+      this._addStat(this.States.STATS_OVERRUNS, 1);
+    }
+    if (refreshed) {
+      const fill = this.getBufferLength() - available;
+      if (fill > this._loadStat(this.States.STATS_MAX_FILL)) {
+        this._storeStat(this.States.STATS_MAX_FILL, fill);
+      }
+    }
+    return this._setWindow(currentWrite, length, window);
+  }
+
+  /**
+   * Publishes |length| frames written after |beginWrite|. Used by producer.
+   *
+   * @param {number} length At most the length returned by |beginWrite|.
+   */
+  commitWrite(length) {
+    const currentWrite = this._loadIndex(this.States.WRITE);
+    if (this.latency && length > 0) {
+      // stamp before publishing, so no read can complete an unstamped block
+      this._latencyStamp(
+          this._loadStat(this.States.STATS_FRAMES_PUSHED) + length);
+    }
+    this._storeIndex(this.States.WRITE, this._advance(currentWrite, length));
+    if (length > 0) {
+      this._addStat(this.States.STATS_PUSHES, 1);
+      this._addStat(this.States.STATS_FRAMES_PUSHED, length);
+    }
+    this._notify(this.States.WRITE, this.States.READ_WAITERS);
   }
+
+  /**
+   * Exposes up to |length| readable frames in place, with the same window
+   * layout as |beginWrite|. Used by consumer.
+   *
+   * @param {number} length Requested frame count.
+   * @param {FreeQueueWindow} window Optional object to fill and return.
+   * @return {FreeQueueWindow} {length, offset, first, second}; |length| is
+   *   the number of frames exposed and may be smaller than requested.
+   */
+  beginRead(length, window = {}) {
+    const currentRead = this._loadIndex(this.States.READ);
+    if (this._getAvailableRead(currentRead, this._cachedWrite) < length) {
+      this._cachedWrite = this._loadIndex(this.States.WRITE);
+      const fill = this._getAvailableRead(currentRead, this._cachedWrite);
+      if (fill < this._loadStat(this.States.STATS_MIN_FILL)) {
+        this._storeStat(this.States.STATS_MIN_FILL, fill);
+      }
+    }
+    const available = this._getAvailableRead(currentRead, this._cachedWrite);
+    if (available < length) {
+      length = available;
+      this._addStat(this.States.STATS_UNDERRUNS, 1);
+    }
+    return this._setWindow(currentRead, length, window);
+  }
+
+  /**
+   * Releases |length| frames consumed after |beginRead|. Used by consumer.
+   *
+   * @param {number} length At most the length returned by |beginRead|.
+   */
+  commitRead(length) {
+    const currentRead = this._loadIndex(this.States.READ);
+    this._storeIndex(this.States.READ, this._advance(currentRead, length));
+    if (length > 0) {
+      this._addStat(this.States.STATS_PULLS, 1);
+      this._addStat(this.States.STATS_FRAMES_PULLED, length);
+      if (this.latency) {
+        this._latencyRecord(this._loadStat(this.States.STATS_FRAMES_PULLED));
+      }
+    }
+    this._notify(this.States.READ, this.States.WRITE_WAITERS);
+  }
+
+  /**
+   * Blocks until at least |frames| frames are readable. Uses Atomics.wait,
+   * so it must not be called on the main thread or in an AudioWorklet.
+   * Wakes on commits from either JS or C (emscripten_futex_wake).
+   *
+   * @param {number} frames Frames required.
+   * @param {number} timeout Milliseconds to wait; Infinity waits forever.
+   * @return {number} 1 when readable, 0 on timeout, -1 once closed.
+   */
+  waitReadable(frames, timeout = Infinity) {
+    return this._wait(() => this._isReadable(frames), timeout,
+        this.States.WRITE, this.States.READ_WAITERS);
+  }
+
+  /**
+   * Blocks until at least |frames| frames are writable. Same rules as
+   * |waitReadable|.
+   *
+   * @param {number} frames Frames required.
+   * @param {number} timeout Milliseconds to wait; Infinity waits forever.
+   * @return {number} 1 when writable, 0 on timeout, -1 once closed.
+   */
+  waitWritable(frames, timeout = Infinity) {
+    return this._wait(() => this._isWritable(frames), timeout,
+        this.States.READ, this.States.WRITE_WAITERS);
+  }
+
+  /**
+   * Marks the queue closed and wakes every blocked waiter on both sides.
+   */
+  close() {
+    Atomics.store(this.states, this.States.CLOSED, 1);
+    Atomics.notify(this.waitStates, this.States.READ);
+    Atomics.notify(this.waitStates, this.States.WRITE);
+  }
+
   /**
    * Helper function for debugging.
    * Prints currently available read and write.
    */
   printAvailableReadAndWrite() {
-    const currentRead = Atomics.load(this.states, this.States.READ);
-    const currentWrite = Atomics.load(this.states, this.States.WRITE);
+    const currentRead = this._loadIndex(this.States.READ);
+    const currentWrite = this._loadIndex(this.States.WRITE);
     console.log(this, {
         availableRead: this._getAvailableRead(currentRead, currentWrite),
         availableWrite: this._getAvailableWrite(currentRead, currentWrite),
@@ -194,8 +626,8 @@ class FreeQueue {
    * @returns {number} number of samples available for read
    */
   getAvailableSamples() {
-    const currentRead = Atomics.load(this.states, this.States.READ);
-    const currentWrite = Atomics.load(this.states, this.States.WRITE);
+    const currentRead = this._loadIndex(this.States.READ);
+    const currentWrite = this._loadIndex(this.States.WRITE);
     return this._getAvailableRead(currentRead, currentWrite);
   }
   /**
@@ -211,26 +643,927 @@ class FreeQueue {
    * @return {number}
    */
   getBufferLength() {
+    if (this.flags & FreeQueue.Flags.POW2) return this.bufferLength;
     return this.bufferLength - 1;
   }
 
+  /**
+   * Total number of frames ever pushed. Only tracked with |Flags.POW2|.
+   * @return {number}
+   */
+  getFramesWritten() {
+    if (this.flags & FreeQueue.Flags.POW2) return this._loadIndex(this.States.WRITE);
+    return 0;
+  }
+
+  /**
+   * Total number of frames ever pulled. Only tracked with |Flags.POW2|.
+   * @return {number}
+   */
+  getFramesRead() {
+    if (this.flags & FreeQueue.Flags.POW2) return this._loadIndex(this.States.READ);
+    return 0;
+  }
+
+  /**
+   * Snapshot of the statistics lines, read straight from shared memory, so
+   * a monitoring thread can sample any number of queues without calling
+   * into wasm. Mirrors |struct FreeQueueStats| in free_queue.cpp.
+   *
+   * @return {{pushes: number, pulls: number, overruns: number,
+   *   underruns: number, framesPushed: number, framesPulled: number,
+   *   minFill: number, maxFill: number}}
+   */
+  getStats() {
+    return {
+      pushes: this._loadStat(this.States.STATS_PUSHES),
+      pulls: this._loadStat(this.States.STATS_PULLS),
+      overruns: this._loadStat(this.States.STATS_OVERRUNS),
+      underruns: this._loadStat(this.States.STATS_UNDERRUNS),
+      framesPushed: this._loadStat(this.States.STATS_FRAMES_PUSHED),
+      framesPulled: this._loadStat(this.States.STATS_FRAMES_PULLED),
+      minFill: this._loadStat(this.States.STATS_MIN_FILL),
+      maxFill: this._loadStat(this.States.STATS_MAX_FILL),
+    };
+  }
+
+  /**
+   * Push-to-pull latency percentile of a |Flags.LATENCY| queue, read from
+   * shared memory like |getStats|. |latencyHistogram| holds the raw
+   * buckets; bucket i covers [latencyBucketLow(i), latencyBucketLow(i + 1))
+   * ns.
+   *
+   * @param {number} percentile In [0, 100].
+   * @return {number} Upper bound in ns of the bucket holding the
+   *   percentile, capped at the recorded maximum; 0 without samples.
+   */
+  getLatencyPercentile(percentile) {
+    if (!this.latency) return 0;
+    const buckets = Array.from(this.latencyHistogram, Number);
+    const samples = buckets.reduce((sum, count) => sum + count, 0);
+    const max = Number(Atomics.load(this.latencyCounters,
+        FreeQueue.LatencyStates.MAX / 2));
+    if (samples === 0) return 0;
+    const rank = Math.max(1, Math.ceil(percentile / 100 * samples));
+    let seen = 0;
+    for (let i = 0; i < buckets.length; i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        const high = i + 1 < buckets.length
+            ? FreeQueue.latencyBucketLow(i + 1) - 1 : max;
+        return Math.min(high, max);
+      }
+    }
+    return max;
+  }
+
+  /**
+   * Smallest residency in ns that falls into histogram bucket |index|.
+   * @return {number}
+   */
+  static latencyBucketLow(index) {
+    if (index < 8) return index;
+    return (8 + index % 8) * 2 ** (Math.floor(index / 8) - 1);
+  }
+
+  static _latencyBucket(ns) {
+    if (ns < 8) return ns;
+    let exponent = Math.floor(Math.log2(ns));
+    if (2 ** exponent > ns) exponent--;
+    else if (2 ** (exponent + 1) <= ns) exponent++;
+    const index = (exponent - 2) * 8 +
+        (Math.floor(ns / 2 ** (exponent - 3)) & 7);
+    return Math.min(index, FreeQueue.LATENCY_BUCKETS - 1);
+  }
+
+  /**
+   * Full-scale value of an integer typed array, 0 for float arrays whose
+   * samples are nominally in [-1, 1]. Matches |FreeQueueSampleScale|.
+   */
+  static _sampleScale(array) {
+    if (array instanceof Int16Array) return 32768;
+    if (array instanceof Int32Array) return 2147483648;
+    return 0;
+  }
+
+  /**
+   * Copies |source| into |target| from |offset| on, converting like
+   * |_convertSample| in free_queue.h: integers are scaled to and from
+   * [-1, 1), float-to-integer rounds to nearest even and saturates.
+   */
+  static _copySamples(source, target, offset = 0) {
+    const from = FreeQueue._sampleScale(source);
+    const to = FreeQueue._sampleScale(target);
+    const length = source.length;
+    if (from === to) {
+      target.set(source, offset);
+    } else if (to === 0) {
+      const scale = 1 / from;
+      for (let i = 0; i < length; i++) {
+        target[offset + i] = source[i] * scale;
+      }
+    } else if (from === 0) {
+      for (let i = 0; i < length; i++) {
+        const scaled = Math.min(Math.max(source[i] * to, -to), to - 1);
+        let rounded = Math.round(scaled);
+        // Math.round takes halves up, lrint to even
+        if (rounded - scaled === 0.5 && (rounded & 1)) rounded--;
+        target[offset + i] = rounded;
+      }
+    } else if (from < to) {
+      for (let i = 0; i < length; i++) {
+        target[offset + i] = source[i] * 65536;
+      }
+    } else {
+      for (let i = 0; i < length; i++) {
+        target[offset + i] = source[i] >> 16;
+      }
+    }
+  }
+
+  /** Builds every view of the block at |byteOffset| from its header. */
+  _attachBuffer(buffer, byteOffset) {
+    const Header = FreeQueue.Header;
+    const header = new Uint32Array(buffer, byteOffset, FreeQueue.HEADER_LENGTH);
+    /** The block; post |buffer| and |byteOffset| to share the queue. */
+    this.buffer = buffer;
+    this.byteOffset = byteOffset;
+    this.bufferLength = header[Header.BUFFER_LENGTH];
+    this.channelCount = header[Header.CHANNEL_COUNT];
+    this.sampleType = header[Header.SAMPLE_TYPE];
+    this.flags = header[Header.FLAGS];
+    const state = byteOffset + header[Header.STATE_OFFSET];
+    this.states = new Uint32Array(buffer, state, FreeQueue.STATE_LENGTH);
+    /** 64-bit view of the same state block, used with |Flags.POW2|. */
+    this.counters = new BigUint64Array(buffer, state, FreeQueue.STATE_LENGTH / 2);
+    /** Int32 view of the same block; Atomics.wait only accepts Int32Array. */
+    this.waitStates = new Int32Array(buffer, state, FreeQueue.STATE_LENGTH);
+    this._attachLatency(header[Header.LATENCY_OFFSET]
+        ? new Uint32Array(buffer, byteOffset + header[Header.LATENCY_OFFSET],
+            FreeQueue.LATENCY_LENGTH)
+        : null);
+    const ArrayType = FreeQueue.ArrayTypes[this.sampleType];
+    this.channelData = [];
+    for (let i = 0; i < this.channelCount; i++) {
+      this.channelData.push(new ArrayType(buffer, byteOffset +
+          header[Header.CHANNEL_OFFSET] + i * header[Header.CHANNEL_STRIDE],
+          this.bufferLength));
+    }
+    this._spinBudget = FreeQueue.SPIN_MIN;
+    /**
+     * Private copies of the opposite side's index. The producer only reloads
+     * READ when the queue looks full, the consumer only reloads WRITE when it
+     * looks empty.
+     */
+    this._cachedRead = this._loadIndex(this.States.READ);
+    this._cachedWrite = this._loadIndex(this.States.WRITE);
+    /** Scratch window reused by push/pull. */
+    this._window = {};
+  }
+
+  _attachLatency(words) {
+    this.latency = words;
+    if (!words) return;
+    this.latencyCounters = new BigUint64Array(
+        words.buffer, words.byteOffset, FreeQueue.LATENCY_LENGTH / 2);
+    /** Float64 view for stamp times; ordered by the STAMP_* counters. */
+    this.latencyTimes = new Float64Array(
+        words.buffer, words.byteOffset, FreeQueue.LATENCY_LENGTH / 2);
+    this.latencyHistogram = this.latencyCounters.subarray(
+        FreeQueue.LatencyStates.HISTOGRAM / 2,
+        FreeQueue.LatencyStates.HISTOGRAM / 2 + FreeQueue.LATENCY_BUCKETS);
+  }
+
+  /**
+   * Same clock as emscripten_get_now() in pthread builds, so stamps from C
+   * and JS compare.
+   */
+  _now() {
+    return performance.timeOrigin + performance.now();
+  }
+
+  /** Producer side of |Flags.LATENCY|, see _latencyStamp in C. */
+  _latencyStamp(position) {
+    const States = FreeQueue.LatencyStates;
+    const counters = this.latencyCounters;
+    const stamp = Number(Atomics.load(counters, States.STAMP_WRITE / 2));
+    const read = Number(Atomics.load(counters, States.STAMP_READ / 2));
+    if (stamp - read >= FreeQueue.LATENCY_STAMPS) {
+      Atomics.store(counters, States.DROPS / 2,
+          Atomics.load(counters, States.DROPS / 2) + 1n);
+      return;
+    }
+    const slot = (States.STAMPS + 4 * (stamp % FreeQueue.LATENCY_STAMPS)) / 2;
+    Atomics.store(counters, slot, BigInt(position));
+    this.latencyTimes[slot + 1] = this._now();
+    Atomics.store(counters, States.STAMP_WRITE / 2, BigInt(stamp + 1));
+  }
+
+  /** Consumer side of |Flags.LATENCY|, see _latencyRecord in C. */
+  _latencyRecord(position) {
+    const States = FreeQueue.LatencyStates;
+    const counters = this.latencyCounters;
+    let stamp = Number(Atomics.load(counters, States.STAMP_READ / 2));
+    const end = Number(Atomics.load(counters, States.STAMP_WRITE / 2));
+    let now = 0;
+    for (; stamp < end; stamp++) {
+      const slot = (States.STAMPS + 4 * (stamp % FreeQueue.LATENCY_STAMPS)) / 2;
+      if (Number(Atomics.load(counters, slot)) > position) break;
+      if (now === 0) now = this._now();
+      const residency = Math.max(0,
+          Math.floor((now - this.latencyTimes[slot + 1]) * 1e6));
+      const bucket = States.HISTOGRAM / 2 + FreeQueue._latencyBucket(residency);
+      Atomics.store(counters, bucket, Atomics.load(counters, bucket) + 1n);
+      Atomics.store(counters, States.SAMPLES / 2,
+          Atomics.load(counters, States.SAMPLES / 2) + 1n);
+      if (residency > Number(Atomics.load(counters, States.MAX / 2))) {
+        Atomics.store(counters, States.MAX / 2, BigInt(residency));
+      }
+    }
+    Atomics.store(counters, States.STAMP_READ / 2, BigInt(stamp));
+  }
+
   _getAvailableWrite(readIndex, writeIndex) {
+    if (this.flags & FreeQueue.Flags.POW2)
+        return this.bufferLength - (writeIndex - readIndex);
     if (writeIndex >= readIndex)
         return this.bufferLength - writeIndex + readIndex - 1;
     return readIndex - writeIndex - 1;
   }
 
   _getAvailableRead(readIndex, writeIndex) {
+    if (this.flags & FreeQueue.Flags.POW2) return writeIndex - readIndex;
     if (writeIndex >= readIndex) return writeIndex - readIndex;
     return writeIndex + this.bufferLength - readIndex;
   }
 
+  /**
+   * Ring offset of an index. With |Flags.POW2| the index is a free-running
+   * counter; |&| keeps its low 32 bits, which is exact for a power-of-two
+   * mask.
+   */
+  _getOffset(index) {
+    if (this.flags & FreeQueue.Flags.POW2) return index & (this.bufferLength - 1);
+    return index;
+  }
+
+  _isReadable(frames) {
+    return this._getAvailableRead(this._loadIndex(this.States.READ),
+        this._loadIndex(this.States.WRITE)) >= frames;
+  }
+
+  _isWritable(frames) {
+    return this._getAvailableWrite(this._loadIndex(this.States.READ),
+        this._loadIndex(this.States.WRITE)) >= frames;
+  }
+
+  /**
+   * Wakes threads parked on |index| if the control line says there are any.
+   * Atomics are sequentially consistent, so either the waiter sees the new
+   * index or this load sees the waiter.
+   */
+  _notify(index, waiters) {
+    if (Atomics.load(this.states, waiters) !== 0) {
+      Atomics.notify(this.waitStates, index);
+    }
+  }
+
+  /**
+   * Spins for an adaptive budget (doubled after a hit, halved after a miss),
+   * then parks on the low word of |index| while advertising in |waiters|.
+   */
+  _wait(ready, timeout, index, waiters) {
+    const deadline = performance.now() + timeout;
+    for (let i = 0; i < this._spinBudget; i++) {
+      if (ready()) {
+        this._spinBudget = Math.min(FreeQueue.SPIN_MAX, this._spinBudget * 2);
+        return 1;
+      }
+      if (Atomics.load(this.states, this.States.CLOSED)) return -1;
+    }
+    this._spinBudget = Math.max(FreeQueue.SPIN_MIN, this._spinBudget >> 1);
+    for (;;) {
+      const observed = Atomics.load(this.waitStates, index);
+      Atomics.add(this.states, waiters, 1);
+      let isReady = ready();
+      const isClosed = Atomics.load(this.states, this.States.CLOSED) !== 0;
+      const remaining = deadline - performance.now();
+      if (!isReady && !isClosed && remaining > 0) {
+        Atomics.wait(this.waitStates, index, observed, remaining);
+      }
+      Atomics.sub(this.states, waiters, 1);
+      if (isReady || ready()) return 1;
+      if (isClosed || Atomics.load(this.states, this.States.CLOSED)) return -1;
+      if (deadline - performance.now() <= 0) return 0;
+    }
+  }
+
+  _setWindow(index, length, window) {
+    window.length = length;
+    window.offset = this._getOffset(index);
+    window.first = Math.min(length, this.bufferLength - window.offset);
+    window.second = length - window.first;
+    return window;
+  }
+
+  _advance(index, length) {
+    if (this.flags & FreeQueue.Flags.POW2) return index + length;
+    const next = index + length;
+    return next >= this.bufferLength ? next - this.bufferLength : next;
+  }
+
+  _loadIndex(index) {
+    if (this.flags & FreeQueue.Flags.POW2)
+        return Number(Atomics.load(this.counters, index / 2));
+    return Atomics.load(this.states, index);
+  }
+
+  _storeIndex(index, value) {
+    if (this.flags & FreeQueue.Flags.POW2)
+        Atomics.store(this.counters, index / 2, BigInt(value));
+    else
+        Atomics.store(this.states, index, value);
+  }
+
+  /**
+   * Statistics slots are 64-bit and have a single writer each, so a load
+   * and a store replace a read-modify-write.
+   */
+  _loadStat(index) {
+    return Number(Atomics.load(this.counters, index / 2));
+  }
+
+  _storeStat(index, value) {
+    Atomics.store(this.counters, index / 2, BigInt(value));
+  }
+
+  _addStat(index, value) {
+    this._storeStat(index, this._loadStat(index) + value);
+  }
+
   _reset() {
     for (let channel = 0; channel < this.channelCount; channel++) {
       this.channelData[channel].fill(0);
     }
-    Atomics.store(this.states, this.States.READ, 0);
-    Atomics.store(this.states, this.States.WRITE, 0);
+    this._storeIndex(this.States.READ, 0);
+    this._storeIndex(this.States.WRITE, 0);
+    this._cachedRead = 0;
+    this._cachedWrite = 0;
+  }
+}
+
+/**
+ * A span of shared memory that queues are carved from, e.g. part of a
+ * WebAssembly.Memory imported by several modules. Matches the region
+ * functions of free_queue.cpp (|FreeQueueRegionHeader|), so C and JS can
+ * create queues in the same region and attach to each other's by offset.
+ */
+class FreeQueueRegion {
+
+  /**
+   * Word indices of the region header. The directory of queue offsets is
+   * the second cache line.
+   * @enum {number}
+   */
+  static Header = {
+    MAGIC: 0,
+    VERSION: 1,
+    BYTES: 2,
+    USED: 3,
+    COUNT: 4,
+    DIRECTORY: 16,
+  }
+
+  /** "REGN". Matches |FREE_QUEUE_REGION_MAGIC|. */
+  static MAGIC = 0x4e474552;
+
+  /** @type {number} Matches |FREE_QUEUE_REGION_ENTRIES|. */
+  static ENTRIES = 16;
+
+  /**
+   * Maps the region at |byteOffset| of |buffer|, formatting it first when
+   * |bytes| is given.
+   *
+   * @param {SharedArrayBuffer} buffer E.g. |memory.buffer|.
+   * @param {number} byteOffset Start of the region; a multiple of 64.
+   * @param {number=} bytes Size of a new region; omit to attach. Like
+   *   InitFreeQueueRegion, a misaligned start or a size below two cache
+   *   lines, above 32 bits or past the end of |buffer| throws a RangeError.
+   */
+  constructor(buffer, byteOffset, bytes) {
+    const Header = FreeQueueRegion.Header;
+    if (bytes !== undefined && (byteOffset % 64 !== 0 || bytes < 2 * 64 ||
+        bytes > 0xffffffff || byteOffset + bytes > buffer.byteLength)) {
+      throw new RangeError('FreeQueueRegion: bad region start or size');
+    }
+    this.buffer = buffer;
+    this.byteOffset = byteOffset;
+    this.words = new Uint32Array(buffer, byteOffset, 2 * 16);
+    if (bytes !== undefined) {
+      this.words.fill(0);
+      this.words[Header.VERSION] = FreeQueue.LAYOUT_VERSION;
+      this.words[Header.BYTES] = bytes;
+      this.words[Header.USED] = 2 * 64;
+      Atomics.store(this.words, Header.MAGIC, FreeQueueRegion.MAGIC);
+    }
+  }
+
+  /** @return {boolean} True if a region of this layout version is mapped. */
+  isValid() {
+    return Atomics.load(this.words, FreeQueueRegion.Header.MAGIC) ===
+        FreeQueueRegion.MAGIC &&
+        this.words[FreeQueueRegion.Header.VERSION] === FreeQueue.LAYOUT_VERSION;
+  }
+
+  /**
+   * Creates a queue in the region, like CreateFreeQueueInRegion.
+   * @return {number} Byte offset of the queue from the region, 0 if full.
+   */
+  create(size, channelCount = 1, sampleType = FreeQueue.SampleTypes.FLOAT64,
+      flags = 0) {
+    const Header = FreeQueueRegion.Header;
+    if (!this.isValid()) return 0;
+    const header = FreeQueue.layout(size, channelCount, sampleType, flags);
+    const bytes = Math.ceil(header[FreeQueue.Header.BYTES] / 64) * 64;
+    let offset = Atomics.load(this.words, Header.USED);
+    for (;;) {
+      if (offset + bytes > this.words[Header.BYTES]) return 0;
+      const seen = Atomics.compareExchange(
+          this.words, Header.USED, offset, offset + bytes);
+      if (seen === offset) break;
+      offset = seen;
+    }
+    FreeQueue.createIn(this.buffer, this.byteOffset + offset, size,
+        channelCount, sampleType, flags);
+    const index = Atomics.add(this.words, Header.COUNT, 1);
+    if (index < FreeQueueRegion.ENTRIES) {
+      Atomics.store(this.words, Header.DIRECTORY + index, offset);
+    }
+    return offset;
+  }
+
+  /**
+   * @return {number} Byte offset of the |index|th queue created in the
+   *   region, 0 if there is none (yet).
+   */
+  entry(index) {
+    if (!this.isValid() || index >= FreeQueueRegion.ENTRIES) return 0;
+    return Atomics.load(this.words, FreeQueueRegion.Header.DIRECTORY + index);
+  }
+
+  /**
+   * @return {FreeQueue|null} The queue at |offset| bytes into the region;
+   *   null if there is none, |offset| is not a multiple of 64 or the queue
+   *   does not end inside the region.
+   */
+  attach(offset) {
+    if (!this.isValid()) return null;
+    const limit = this.words[FreeQueueRegion.Header.BYTES];
+    if (offset < 2 * 64 || offset % 64 !== 0 ||
+        offset + FreeQueue.HEADER_LENGTH * 4 > limit) {
+      return null;
+    }
+    const header = new Uint32Array(
+        this.buffer, this.byteOffset + offset, FreeQueue.HEADER_LENGTH);
+    // a stale offset must not reach past the region into another heap
+    if (Atomics.load(header, FreeQueue.Header.MAGIC) !== FreeQueue.MAGIC ||
+        offset + header[FreeQueue.Header.BYTES] > limit) {
+      return null;
+    }
+    return FreeQueue.fromBuffer(this.buffer, this.byteOffset + offset);
+  }
+}
+
+/**
+ * A bounded multi-producer/multi-consumer queue of planar blocks of up to
+ * |blockLength| frames, backed by SharedArrayBuffer or the wasm heap. Any
+ * number of workers (and C threads) may push and pull at once without a
+ * lock. Matches |FreeQueueMPMC| in free_queue.cpp; see there for the
+ * sequence protocol.
+ */
+class FreeQueueMPMC {
+
+  /**
+   * Word indices of the state block. Matches |FreeQueueMPMCState| in
+   * free_queue.cpp: two counters on their own cache lines, then one sequence
+   * word and one frame count per slot.
+   * @enum {number}
+   */
+  static States = {
+    /** @type {number} Next position handed to a producer. (producers) */
+    ENQUEUE: 0,
+    /** @type {number} Next position handed to a consumer. (consumers) */
+    DEQUEUE: 16,
+    /** @type {number} First of |slotCount| slot sequence numbers. */
+    SEQUENCE: 32,
+  }
+
+  /**
+   * @param {number} slotCount Number of blocks; rounded up to a power of two.
+   * @param {number} blockLength Maximum frames per block.
+   * @param {number} channelCount Total channel count.
+   * @param {number} sampleType One of |FreeQueue.SampleTypes|.
+   */
+  constructor(slotCount, blockLength, channelCount = 1,
+      sampleType = FreeQueue.SampleTypes.FLOAT64) {
+    this.slotCount = 2;
+    while (this.slotCount < slotCount) this.slotCount *= 2;
+    this.blockLength = blockLength;
+    this.channelCount = channelCount;
+    this.sampleType = sampleType;
+    const states = new Uint32Array(new SharedArrayBuffer(
+        FreeQueueMPMC._stateLength(this.slotCount) * Uint32Array.BYTES_PER_ELEMENT));
+    for (let slot = 0; slot < this.slotCount; slot++) {
+      states[FreeQueueMPMC.States.SEQUENCE + slot] = slot;
+    }
+    const ArrayType = FreeQueue.ArrayTypes[sampleType];
+    const channelData = [];
+    for (let i = 0; i < channelCount; i++) {
+      channelData.push(new ArrayType(new SharedArrayBuffer(
+          this.slotCount * blockLength * ArrayType.BYTES_PER_ELEMENT)));
+    }
+    this._attach(states, channelData);
+  }
+
+  /**
+   * Maps a queue created in wasm.
+   *
+   * interface FreeQueueMPMCPointers {
+   *   memory: WebAssembly.Memory;
+   *   slotCountPointer: number;      // GetFreeQueueMPMCPointers(q, "slot_count")
+   *   blockLengthPointer: number;
+   *   channelCountPointer: number;
+   *   statePointer: number;
+   *   channelDataPointer: number;
+   *   sampleTypePointer: number;
+   * }
+   * @returns FreeQueueMPMC
+   */
+  static fromPointers(queuePointers) {
+    const HEAPU32 = new Uint32Array(queuePointers.memory.buffer);
+    const slotCount = HEAPU32[queuePointers.slotCountPointer / 4];
+    const blockLength = HEAPU32[queuePointers.blockLengthPointer / 4];
+    const channelCount = HEAPU32[queuePointers.channelCountPointer / 4];
+    const sampleType = HEAPU32[queuePointers.sampleTypePointer / 4];
+    const ArrayType = FreeQueue.ArrayTypes[sampleType];
+    const state = HEAPU32[queuePointers.statePointer / 4] / 4;
+    const channelData = [];
+    for (let i = 0; i < channelCount; i++) {
+      channelData.push(new ArrayType(queuePointers.memory.buffer,
+          HEAPU32[HEAPU32[queuePointers.channelDataPointer / 4] / 4 + i],
+          slotCount * blockLength));
+    }
+    const queue = Object.create(FreeQueueMPMC.prototype);
+    queue.slotCount = slotCount;
+    queue.blockLength = blockLength;
+    queue.channelCount = channelCount;
+    queue.sampleType = sampleType;
+    queue._attach(HEAPU32.subarray(
+        state, state + FreeQueueMPMC._stateLength(slotCount)), channelData);
+    return queue;
+  }
+
+  /**
+   * Pushes one block. Safe to call from any number of threads.
+   *
+   * @param {TypedArray[]} input One array per channel.
+   * @param {number} frames Block length, at most |blockLength|.
+   * @return {boolean} False if every slot is full or the block is too long.
+   */
+  push(input, frames) {
+    if (frames > this.blockLength) return false;
+    const position = this._claim(FreeQueueMPMC.States.ENQUEUE, 0);
+    if (position < 0) return false;
+    const slot = position & (this.slotCount - 1);
+    const offset = slot * this.blockLength;
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      this.channelData[channel].set(input[channel].subarray(0, frames), offset);
+    }
+    this.frames[slot] = frames;
+    Atomics.store(this.states, FreeQueueMPMC.States.SEQUENCE + slot,
+        (position + 1) >>> 0);
+    return true;
+  }
+
+  /**
+   * Pulls the oldest published block. Safe to call from any number of
+   * threads.
+   *
+   * @param {TypedArray[]} output One array per channel, each with room for
+   *   |blockLength| frames.
+   * @return {number} Frames in the block; 0 if the queue is empty.
+   */
+  pull(output) {
+    const position = this._claim(FreeQueueMPMC.States.DEQUEUE, 1);
+    if (position < 0) return 0;
+    const slot = position & (this.slotCount - 1);
+    const offset = slot * this.blockLength;
+    const frames = this.frames[slot];
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      output[channel].set(
+          this.channelData[channel].subarray(offset, offset + frames));
+    }
+    Atomics.store(this.states, FreeQueueMPMC.States.SEQUENCE + slot,
+        (position + this.slotCount) >>> 0);
+    return frames;
+  }
+
+  static _stateLength(slotCount) {
+    return FreeQueueMPMC.States.SEQUENCE + 2 * slotCount;
+  }
+
+  _attach(states, channelData) {
+    this.states = states;
+    /** Frame count of each slot, published by the slot's sequence. */
+    this.frames = states.subarray(FreeQueueMPMC.States.SEQUENCE + this.slotCount);
+    this.channelData = channelData;
+  }
+
+  /**
+   * Claims the next position of |counter| whose slot sequence is
+   * |position + lag|.
+   * @return {number} The position, or -1 if full (producers) or empty
+   *   (consumers).
+   */
+  _claim(counter, lag) {
+    const mask = this.slotCount - 1;
+    let position = Atomics.load(this.states, counter);
+    for (;;) {
+      const sequence = Atomics.load(
+          this.states, FreeQueueMPMC.States.SEQUENCE + (position & mask));
+      const difference = (sequence - position - lag) | 0;
+      if (difference === 0) {
+        const seen = Atomics.compareExchange(
+            this.states, counter, position, (position + 1) >>> 0);
+        if (seen === position) return position;
+        position = seen;
+      } else if (difference < 0) {
+        return -1;
+      } else {
+        position = Atomics.load(this.states, counter);
+      }
+    }
+  }
+}
+
+/**
+ * A single-producer/multi-reader queue backed by SharedArrayBuffer or the
+ * wasm heap: every attached reader sees every frame through its own cursor.
+ * Matches |FreeQueueBroadcast| in free_queue.cpp.
+ */
+class FreeQueueBroadcast {
+
+  /**
+   * Word indices of the state block. Matches |FreeQueueBroadcastState| in
+   * free_queue.cpp.
+   * @enum {number}
+   */
+  static States = {
+    /** @type {number} Frames published. (producer) */
+    WRITE: 0,
+    /** @type {number} End of the frames being written. (producer) */
+    RESERVE: 2,
+    /** @type {number} Readers detached by the DETACH policy. (producer) */
+    DETACHES: 4,
+    /** @type {number} Line of reader 0; reader r is |r| lines further. */
+    READERS: 16,
+    /** @type {number} Frames consumed, relative to a reader line. */
+    CURSOR: 0,
+    /** @type {number} Reader status, relative to a reader line. */
+    STATUS: 2,
+  }
+
+  /**
+   * What the producer does when the slowest reader leaves no room.
+   * Matches |FreeQueueBroadcastPolicy|.
+   * @enum {number}
+   */
+  static Policies = {
+    BLOCK: 0,
+    DETACH: 1,
+  }
+
+  /** Reader line status. Matches |FreeQueueBroadcastReaderStatus|. */
+  static Status = {
+    FREE: 0,
+    ACTIVE: 1,
+    DETACHED: 2,
+    CLAIMED: 3,
+  }
+
+  /**
+   * @param {number} size Capacity in frames; rounded up to a power of two.
+   * @param {number} channelCount Total channel count.
+   * @param {number} maxReaders Number of reader lines.
+   * @param {number} sampleType One of |FreeQueue.SampleTypes|.
+   * @param {number} policy One of |FreeQueueBroadcast.Policies|.
+   */
+  constructor(size, channelCount = 1, maxReaders = 4,
+      sampleType = FreeQueue.SampleTypes.FLOAT64,
+      policy = FreeQueueBroadcast.Policies.BLOCK) {
+    this.bufferLength = 1;
+    while (this.bufferLength < size) this.bufferLength *= 2;
+    this.channelCount = channelCount;
+    this.maxReaders = maxReaders;
+    this.sampleType = sampleType;
+    this.policy = policy;
+    this.states = new Uint32Array(new SharedArrayBuffer(
+        FreeQueueBroadcast._stateLength(maxReaders) * Uint32Array.BYTES_PER_ELEMENT));
+    const ArrayType = FreeQueue.ArrayTypes[sampleType];
+    this.channelData = [];
+    for (let i = 0; i < channelCount; i++) {
+      this.channelData.push(new ArrayType(new SharedArrayBuffer(
+          this.bufferLength * ArrayType.BYTES_PER_ELEMENT)));
+    }
+  }
+
+  /**
+   * Maps a queue created in wasm.
+   *
+   * interface FreeQueueBroadcastPointers {
+   *   memory: WebAssembly.Memory;
+   *   bufferLengthPointer: number;  // GetFreeQueueBroadcastPointers(q, "buffer_length")
+   *   channelCountPointer: number;
+   *   statePointer: number;
+   *   channelDataPointer: number;
+   *   sampleTypePointer: number;
+   *   maxReadersPointer: number;
+   *   policyPointer: number;
+   * }
+   * @returns FreeQueueBroadcast
+   */
+  static fromPointers(queuePointers) {
+    const HEAPU32 = new Uint32Array(queuePointers.memory.buffer);
+    const queue = Object.create(FreeQueueBroadcast.prototype);
+    queue.bufferLength = HEAPU32[queuePointers.bufferLengthPointer / 4];
+    queue.channelCount = HEAPU32[queuePointers.channelCountPointer / 4];
+    queue.sampleType = HEAPU32[queuePointers.sampleTypePointer / 4];
+    queue.maxReaders = HEAPU32[queuePointers.maxReadersPointer / 4];
+    queue.policy = HEAPU32[queuePointers.policyPointer / 4];
+    const state = HEAPU32[queuePointers.statePointer / 4] / 4;
+    queue.states = HEAPU32.subarray(
+        state, state + FreeQueueBroadcast._stateLength(queue.maxReaders));
+    const ArrayType = FreeQueue.ArrayTypes[queue.sampleType];
+    queue.channelData = [];
+    for (let i = 0; i < queue.channelCount; i++) {
+      queue.channelData.push(new ArrayType(queuePointers.memory.buffer,
+          HEAPU32[HEAPU32[queuePointers.channelDataPointer / 4] / 4 + i],
+          queue.bufferLength));
+    }
+    return queue;
+  }
+
+  /**
+   * Writes |length| frames for every reader, or none. Producer only.
+   *
+   * @param {TypedArray[]} input One array per channel.
+   * @param {number} length Frames to write.
+   * @return {boolean} False if a reader is in the way under BLOCK.
+   */
+  push(input, length) {
+    const States = FreeQueueBroadcast.States;
+    if (length > this.bufferLength) return false;
+    const writeIndex = Atomics.load(this.states, States.WRITE);
+    const detachAbove = this.policy === FreeQueueBroadcast.Policies.DETACH
+        ? this.bufferLength - length : Infinity;
+    if (this._fill(writeIndex, detachAbove) + length > this.bufferLength) {
+      return false;
+    }
+    Atomics.store(this.states, States.RESERVE, (writeIndex + length) >>> 0);
+    const offset = writeIndex & (this.bufferLength - 1);
+    const first = Math.min(length, this.bufferLength - offset);
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      this.channelData[channel].set(input[channel].subarray(0, first), offset);
+      if (first < length) {
+        this.channelData[channel].set(input[channel].subarray(first, length), 0);
+      }
+    }
+    Atomics.store(this.states, States.WRITE, (writeIndex + length) >>> 0);
+    return true;
+  }
+
+  /**
+   * Registers a reader at the live edge.
+   * @return {number} Reader index, or -1 if every line is taken.
+   */
+  attach() {
+    const Status = FreeQueueBroadcast.Status;
+    for (let reader = 0; reader < this.maxReaders; reader++) {
+      if (Atomics.compareExchange(this.states, this._line(reader) +
+          FreeQueueBroadcast.States.STATUS, Status.FREE, Status.CLAIMED) ===
+          Status.FREE) {
+        const line = this._line(reader);
+        Atomics.store(this.states, line + FreeQueueBroadcast.States.CURSOR,
+            Atomics.load(this.states, FreeQueueBroadcast.States.WRITE));
+        Atomics.store(this.states, line + FreeQueueBroadcast.States.STATUS,
+            Status.ACTIVE);
+        return reader;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * Moves |reader| to the live edge and reactivates it. A no-op on a line
+   * that is not attached.
+   * @return {boolean} False if the line was not attached.
+   */
+  rejoin(reader) {
+    const States = FreeQueueBroadcast.States;
+    const Status = FreeQueueBroadcast.Status;
+    const line = this._line(reader);
+    let status = Atomics.load(this.states, line + States.STATUS);
+    while (status === Status.ACTIVE || status === Status.DETACHED) {
+      Atomics.store(this.states, line + States.CURSOR,
+          Atomics.load(this.states, States.WRITE));
+      const seen = Atomics.compareExchange(this.states, line + States.STATUS,
+          status, Status.ACTIVE);
+      if (seen === status) return true;
+      status = seen;
+    }
+    return false;
+  }
+
+  /** Releases the line of |reader|. */
+  detach(reader) {
+    Atomics.store(this.states, this._line(reader) +
+        FreeQueueBroadcast.States.STATUS, FreeQueueBroadcast.Status.FREE);
+  }
+
+  /**
+   * Copies the next |length| frames of |reader| into |output|.
+   *
+   * @param {number} reader Index returned by |attach|.
+   * @param {TypedArray[]} output One array per channel.
+   * @param {number} length Frames to read.
+   * @return {number} 1 on success, 0 if fewer frames are available, -1 if
+   *   the reader was detached; call |rejoin| to continue.
+   */
+  read(reader, output, length) {
+    const States = FreeQueueBroadcast.States;
+    const Status = FreeQueueBroadcast.Status;
+    const line = this._line(reader);
+    if (Atomics.load(this.states, line + States.STATUS) !== Status.ACTIVE) {
+      return -1;
+    }
+    const cursor = Atomics.load(this.states, line + States.CURSOR);
+    const writeIndex = Atomics.load(this.states, States.WRITE);
+    if (((writeIndex - cursor) >>> 0) < length) return 0;
+    const offset = cursor & (this.bufferLength - 1);
+    const first = Math.min(length, this.bufferLength - offset);
+    for (let channel = 0; channel < this.channelCount; channel++) {
+      output[channel].set(
+          this.channelData[channel].subarray(offset, offset + first));
+      if (first < length) {
+        output[channel].set(
+            this.channelData[channel].subarray(0, length - first), first);
+      }
+    }
+    const reserve = Atomics.load(this.states, States.RESERVE);
+    if (((reserve - cursor) >>> 0) > this.bufferLength) {
+      Atomics.compareExchange(this.states, line + States.STATUS,
+          Status.ACTIVE, Status.DETACHED);
+      return -1;
+    }
+    Atomics.store(this.states, line + States.CURSOR, (cursor + length) >>> 0);
+    return 1;
+  }
+
+  /** @return {number} Readers detached by the DETACH policy so far. */
+  getDetachCount() {
+    return Atomics.load(this.states, FreeQueueBroadcast.States.DETACHES);
+  }
+
+  static _stateLength(maxReaders) {
+    return FreeQueueBroadcast.States.READERS * (1 + maxReaders);
+  }
+
+  _line(reader) {
+    return FreeQueueBroadcast.States.READERS * (1 + reader);
+  }
+
+  /**
+   * Lag of the slowest active reader; readers lagging more than
+   * |detachAbove| are detached first. Mirrors |_broadcastFill|.
+   */
+  _fill(writeIndex, detachAbove) {
+    const States = FreeQueueBroadcast.States;
+    const Status = FreeQueueBroadcast.Status;
+    let fill = 0;
+    for (let reader = 0; reader < this.maxReaders; reader++) {
+      const line = this._line(reader);
+      if (Atomics.load(this.states, line + States.STATUS) !== Status.ACTIVE) {
+        continue;
+      }
+      const lag = (writeIndex - Atomics.load(this.states, line + States.CURSOR)) >>> 0;
+      if (lag > detachAbove && Atomics.compareExchange(this.states,
+          line + States.STATUS, Status.ACTIVE, Status.DETACHED) === Status.ACTIVE) {
+        Atomics.add(this.states, States.DETACHES, 1);
+        continue;
+      }
+      if (lag > fill) fill = lag;
+    }
+    return fill;
   }
 }
 
@@ -1,146 +1,514 @@
-#include <emscripten.h>
-#include <stdatomic.h>
-#include <stdbool.h>
-#include <stdint.h>
+#ifndef __EMSCRIPTEN__
+/** Native builds export every entry point anyway. */
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+#include "free_queue.h"
+#include <errno.h>
 #include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
 #include <pthread.h>
-#include <unistd.h> 
 
-int treads_busy = 1;
+/** Upper bound on concurrently registered pipelines. */
+#define FREE_QUEUE_MAX_PIPELINES 256
 
-pthread_t tid_consumer = 0;
-pthread_t tid_producer = 0;
+/** A pacer more than this many periods late drops the backlog. */
+#define FREE_QUEUE_PACER_MAX_LATE 8
 
-struct FreeQueue {
-  size_t buffer_length;
-  size_t channel_count;
-  double **channel_data;
-  atomic_uint *state;
+/**
+ * Block clock on absolute deadlines: tick n is due at start + n * period,
+ * period = block_length / sample_rate, so sleep overshoot and work time
+ * never accumulate into drift. Counters may be read from any thread.
+ */
+struct FreeQueuePacer {
+  double period_ms;
+  /** Next deadline on the monotonic clock (emscripten_get_now in wasm). */
+  double deadline_ms;
+  std::atomic_uint ticks;
+  /** Ticks whose deadline had already passed when the wait began. */
+  std::atomic_uint misses;
+  /** Times the clock was re-anchored after FREE_QUEUE_PACER_MAX_LATE. */
+  std::atomic_uint resyncs;
 };
 
-struct FreeQueueThread {
-  struct FreeQueue* instance;
-  int busy;
+/** Deadline counters of both pipeline threads. */
+struct FreeQueuePipelineTiming {
+  uint32_t producer_ticks;
+  uint32_t producer_misses;
+  uint32_t producer_resyncs;
+  uint32_t consumer_ticks;
+  uint32_t consumer_misses;
+  uint32_t consumer_resyncs;
 };
 
 /**
- * An index set for shared state fields.
- * @enum {number}
+ * Configuration of a producer/consumer pipeline. Zero fields take the
+ * defaults of the original demo: 2 channels, 1764-frame blocks at 44100 Hz,
+ * a ring of 500 blocks and a producer that stops filling at 50 blocks.
  */
-enum FreeQueueState {
-  /** @type {number} A shared index for reading from the queue. (consumer) */
-  READ = 0,
-  /** @type {number} A shared index for writing into the queue. (producer) */
-  WRITE = 1
+struct FreeQueuePipelineConfig {
+  uint32_t channel_count;
+  uint32_t block_length;
+  /** Ring capacity in frames. */
+  uint32_t capacity;
+  /** Fill level in frames above which the producer pauses. */
+  uint32_t high_watermark;
+  /** FreeQueueFlags of the ring. */
+  uint32_t flags;
+  /** Producer pushes one block per block_length / sample_rate seconds. */
+  uint32_t sample_rate;
+  /**
+   * Non-zero clocks the consumer as well, pulling one block per period
+   * like an audio device from a ring primed to the high watermark.
+   * Otherwise the consumer drains whatever lands as soon as it lands.
+   */
+  uint32_t paced_consumer;
+};
+
+/**
+ * One independent pipeline: a queue with its own producer and consumer
+ * threads. Pipelines share nothing, so any number can run side by side.
+ */
+struct FreeQueuePipeline {
+  FreeQueue<double>* instance;
+  struct FreeQueuePipelineConfig config;
+  pthread_t tid_producer;
+  pthread_t tid_consumer;
+  std::atomic_int busy;
+  /** Threads started; only read and written under pipelines_control_mutex. */
+  int running;
+  struct FreeQueuePacer producer_pacer;
+  struct FreeQueuePacer consumer_pacer;
+  /** Decoder replacing the demo signal, see SetFreeQueuePipelineSource. */
+  int (*decode)( void* decoder, double timeout_ms );
+  void* decoder;
 };
 
 void *producer( void *arg ); 
 void *consumer( void *arg );
 
-static pthread_mutex_t tasks_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct FreeQueueThread memorydata;
+/**
+ * Pipeline registry. Handles are slot index + 1; the mutex only guards
+ * registration, lookup and timing reads, never the audio path.
+ */
+static pthread_mutex_t pipelines_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Serializes Start/Stop/Destroy/SetSource, so concurrent control calls on
+ * one handle cannot join its threads twice or free it under each other.
+ * Never taken by the pipeline threads.
+ */
+static pthread_mutex_t pipelines_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct FreeQueuePipeline* pipelines[FREE_QUEUE_MAX_PIPELINES];
+/** Pipeline behind the legacy CreateFreeQueueThreads API. */
+static int default_pipeline = 0;
+
+/** Sleeps until |deadline_ms| on the _nowMs clock. */
+static void _sleepUntil(double deadline_ms) {
+#ifdef __EMSCRIPTEN__
+  double remaining = deadline_ms - emscripten_get_now();
+  if (remaining > 0) {
+    emscripten_thread_sleep(remaining);
+  }
+#else
+  struct timespec ts;
+  ts.tv_sec = (time_t)(deadline_ms / 1000);
+  ts.tv_nsec = (long)((deadline_ms - ts.tv_sec * 1000.0) * 1000000.0);
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+  }
+#endif
+}
 
-uint32_t _getAvailableRead(
-  struct FreeQueue *queue, 
-  uint32_t read_index, 
-  uint32_t write_index
-) {  
-  if (write_index >= read_index)
-    return write_index - read_index;
-  
-  return write_index + queue->buffer_length - read_index;
+/** Dispatches on the ring's storage type. */
+static bool _freeQueuePushFormat(void *instance, const void *interleaved, 
+    const void *const *planar, uint32_t format, size_t length) {
+  FreeQueue<double> *queue = (FreeQueue<double> *)instance;
+  if (queue == nullptr) return false;
+  switch (queue->sample_type) {
+    case FREE_QUEUE_FLOAT64: return _freeQueuePushAs((FreeQueue<double> *)instance, 
+        interleaved, planar, format, length);
+    case FREE_QUEUE_FLOAT32: return _freeQueuePushAs((FreeQueue<float> *)instance, 
+        interleaved, planar, format, length);
+    case FREE_QUEUE_INT16: return _freeQueuePushAs((FreeQueue<int16_t> *)instance, 
+        interleaved, planar, format, length);
+    case FREE_QUEUE_INT32: return _freeQueuePushAs((FreeQueue<int32_t> *)instance, 
+        interleaved, planar, format, length);
+  }
+  return false;
+}
+
+static bool _freeQueuePullFormat(void *instance, void *interleaved, void *const *planar, 
+    uint32_t format, size_t length) {
+  FreeQueue<double> *queue = (FreeQueue<double> *)instance;
+  if (queue == nullptr) return false;
+  switch (queue->sample_type) {
+    case FREE_QUEUE_FLOAT64: return _freeQueuePullAs((FreeQueue<double> *)instance, 
+        interleaved, planar, format, length);
+    case FREE_QUEUE_FLOAT32: return _freeQueuePullAs((FreeQueue<float> *)instance, 
+        interleaved, planar, format, length);
+    case FREE_QUEUE_INT16: return _freeQueuePullAs((FreeQueue<int16_t> *)instance, 
+        interleaved, planar, format, length);
+    case FREE_QUEUE_INT32: return _freeQueuePullAs((FreeQueue<int32_t> *)instance, 
+        interleaved, planar, format, length);
+  }
+  return false;
 }
 
-uint32_t _getAvailableWrite(
-  struct FreeQueue *queue, 
-  uint32_t read_index, 
-  uint32_t write_index
-) {
-  if (write_index >= read_index)
-    return queue->buffer_length - write_index + read_index - 1;
-  return read_index - write_index - 1;
+template <typename T>
+void _printQueueInfo(FreeQueue<T> *queue) {
+  for (uint32_t channel = 0; channel < queue->channel_count; channel++) {
+    printf("channel %d: ", channel);
+    for (uint32_t i = 0; i < queue->buffer_length; i++) {
+      printf("%f ", (double)queue->channel_data[channel][i]);
+    }
+    printf("\n");
+  }
+  uint64_t current_read = _loadIndex(queue, READ, std::memory_order_acquire);
+  uint64_t current_write = _loadIndex(queue, WRITE, std::memory_order_acquire);
+  printf("----------\n");
+  printf("current_read: %llu  | current_write: %llu\n", 
+      (unsigned long long)current_read, (unsigned long long)current_write);
+  printf("available_read: %zu  | available_write: %zu\n", 
+      _framesReadable(queue, current_read, current_write), 
+      _framesWritable(queue, current_read, current_write));
+  printf("----------\n");
 }
 
+/**
+ * Declares the C entry points of one FreeQueue<TYPE> instantiation:
+ * CreateFreeQueue<SUFFIX>, CreateFreeQueueWithFlags<SUFFIX>,
+ * DestroyFreeQueue<SUFFIX>, FreeQueuePush<SUFFIX>, FreeQueuePull<SUFFIX>,
+ * FreeQueuePushSome<SUFFIX> and FreeQueuePullSome<SUFFIX>.
+ */
+#define FREE_QUEUE_ENTRY_POINTS(SUFFIX, TYPE) \
+  EMSCRIPTEN_KEEPALIVE \
+  FreeQueue<TYPE> *CreateFreeQueue##SUFFIX(size_t length, size_t channel_count) { \
+    return _createFreeQueue<TYPE>(length, channel_count, 0); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  FreeQueue<TYPE> *CreateFreeQueueWithFlags##SUFFIX(size_t length, size_t channel_count, \
+      uint32_t flags) { \
+    return _createFreeQueue<TYPE>(length, channel_count, flags); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  void DestroyFreeQueue##SUFFIX(FreeQueue<TYPE> *queue) { \
+    _destroyFreeQueue<TYPE>(queue); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  bool FreeQueuePush##SUFFIX(FreeQueue<TYPE> *queue, TYPE **input, size_t block_length) { \
+    return _freeQueuePush(queue, input, block_length); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  bool FreeQueuePull##SUFFIX(FreeQueue<TYPE> *queue, TYPE **output, size_t block_length) { \
+    return _freeQueuePull(queue, output, block_length); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  size_t FreeQueuePushSome##SUFFIX(FreeQueue<TYPE> *queue, TYPE **input, size_t length) { \
+    return _freeQueuePushSome(queue, input, length); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  size_t FreeQueuePullSome##SUFFIX(FreeQueue<TYPE> *queue, TYPE **output, size_t length) { \
+    return _freeQueuePullSome(queue, output, length); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  FreeQueueMPMC<TYPE> *CreateFreeQueueMPMC##SUFFIX(size_t slot_count, size_t block_length, \
+      size_t channel_count) { \
+    return _createFreeQueueMPMC<TYPE>(slot_count, block_length, channel_count); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  void DestroyFreeQueueMPMC##SUFFIX(FreeQueueMPMC<TYPE> *queue) { \
+    _destroyFreeQueueMPMC<TYPE>(queue); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  bool FreeQueueMPMCPush##SUFFIX(FreeQueueMPMC<TYPE> *queue, TYPE **input, size_t frames) { \
+    return _freeQueueMPMCPush(queue, input, frames); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  size_t FreeQueueMPMCPull##SUFFIX(FreeQueueMPMC<TYPE> *queue, TYPE **output, size_t length) { \
+    return _freeQueueMPMCPull(queue, output, length); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  FreeQueueBroadcast<TYPE> *CreateFreeQueueBroadcast##SUFFIX(size_t length, size_t channel_count, \
+      uint32_t max_readers, uint32_t policy) { \
+    return _createFreeQueueBroadcast<TYPE>(length, channel_count, max_readers, policy); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  void DestroyFreeQueueBroadcast##SUFFIX(FreeQueueBroadcast<TYPE> *queue) { \
+    _destroyFreeQueueBroadcast<TYPE>(queue); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  bool FreeQueueBroadcastPush##SUFFIX(FreeQueueBroadcast<TYPE> *queue, TYPE **input, \
+      size_t length) { \
+    return _freeQueueBroadcastPush(queue, input, length); \
+  } \
+  EMSCRIPTEN_KEEPALIVE \
+  int FreeQueueBroadcastRead##SUFFIX(FreeQueueBroadcast<TYPE> *queue, uint32_t reader, \
+      TYPE **output, size_t length) { \
+    return _freeQueueBroadcastRead(queue, reader, output, length); \
+  }
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+FREE_QUEUE_ENTRY_POINTS(, double)
+FREE_QUEUE_ENTRY_POINTS(Float64, double)
+FREE_QUEUE_ENTRY_POINTS(Float32, float)
+FREE_QUEUE_ENTRY_POINTS(Int16, int16_t)
+FREE_QUEUE_ENTRY_POINTS(Int32, int32_t)
+
+/**
+ * Pushes |length| interleaved frames of |format| (a FreeQueueSampleType),
+ * deinterleaving and converting into the ring's storage type in one pass.
+ * Integer samples map to [-1, 1) in floating point storage.
+ * @return {bool} False if there is not enough room; nothing is written.
+ */
 EMSCRIPTEN_KEEPALIVE
-struct FreeQueue *CreateFreeQueue(size_t length, size_t channel_count) {
-  struct FreeQueue *queue = (struct FreeQueue *)malloc(sizeof(struct FreeQueue));
-  queue->buffer_length = length + 1;
-  queue->channel_count = channel_count;
-  queue->state = (atomic_uint *)malloc(2 * sizeof(atomic_uint));
-  atomic_store(queue->state + READ, 0);
-  atomic_store(queue->state + WRITE, 0);
-  queue->channel_data = (double **)malloc(channel_count * sizeof(double *));
-  for (int i = 0; i < channel_count; i++) {
-    queue->channel_data[i] = (double *)malloc(queue->buffer_length * sizeof(double));
-    for (int j = 0; j < queue->buffer_length; j++) {
-      queue->channel_data[i][j] = 0;
-    }
-  }
-  return queue;
+bool FreeQueuePushInterleaved( void* instance, const void* input, uint32_t format, size_t length )
+{
+  return _freeQueuePushFormat(instance, input, nullptr, format, length);
 }
 
+/** Same as FreeQueuePushInterleaved for one |format| array per channel. */
 EMSCRIPTEN_KEEPALIVE
-void DestroyFreeQueue(struct FreeQueue *queue) {
-  if ( queue != nullptr ) {
-    for (int i = 0; i < queue->channel_count; i++) {
-      free(queue->channel_data[i]);
-    }
-    free(queue->channel_data);
-    free(queue);
-  }
+bool FreeQueuePushPlanar( void* instance, const void* const* input, uint32_t format, size_t length )
+{
+  return _freeQueuePushFormat(instance, nullptr, input, format, length);
+}
+
+/**
+ * Pulls |length| frames into |output| as interleaved samples of |format|,
+ * converting from the ring's storage type; float-to-integer conversion
+ * rounds and saturates.
+ * @return {bool} False if not enough frames are available; nothing is read.
+ */
+EMSCRIPTEN_KEEPALIVE
+bool FreeQueuePullInterleaved( void* instance, void* output, uint32_t format, size_t length )
+{
+  return _freeQueuePullFormat(instance, output, nullptr, format, length);
+}
+
+/** Same as FreeQueuePullInterleaved for one |format| array per channel. */
+EMSCRIPTEN_KEEPALIVE
+bool FreeQueuePullPlanar( void* instance, void* const* output, uint32_t format, size_t length )
+{
+  return _freeQueuePullFormat(instance, nullptr, output, format, length);
 }
 
 EMSCRIPTEN_KEEPALIVE
-bool FreeQueuePush(struct FreeQueue *queue, double **input, size_t block_length) {
+void *GetFreeQueuePointers( void* instance, char* data ) 
+{
+  // Field offsets are identical for every sample type.
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
   if ( queue != nullptr ) {
-    uint32_t current_read = atomic_load(queue->state + READ);
-    uint32_t current_write = atomic_load(queue->state + WRITE);
-    if (_getAvailableWrite(queue, current_read, current_write) < block_length) {
-      return false;
+    if (strcmp(data, "buffer_length") == 0) {
+      return ( void* )&queue->buffer_length;
+    }
+    else if (strcmp(data, "channel_count") == 0) {
+      return ( void* )&queue->channel_count;
+    }
+    else if (strcmp(data, "state") == 0) {
+      return ( void* )&queue->state;
     }
-    for (uint32_t i = 0; i < block_length; i++) {
-      for (uint32_t channel = 0; channel < queue->channel_count; channel++) {
-        queue->channel_data[channel][(current_write + i) % queue->buffer_length] = 
-            input[channel][i];
-      }
+    else if (strcmp(data, "channel_data") == 0) {
+      return ( void* )&queue->channel_data;
+    }
+    else if (strcmp(data, "sample_type") == 0) {
+      return ( void* )&queue->sample_type;
+    }
+    else if (strcmp(data, "latency") == 0) {
+      return ( void* )&queue->latency;
+    }
+    else if (strcmp(data, "flags") == 0) {
+      return ( void* )&queue->flags;
+    }
+    else if (strcmp(data, "base") == 0) {
+      return ( void* )&queue->header;
     }
-    uint32_t next_write = (current_write + block_length) % queue->buffer_length;
-    atomic_store(queue->state + WRITE, next_write);
-    return true;
   }
-  return false;
+  return 0;
+}
+
+/**
+ * Size of the contiguous block for a queue of these dimensions, for callers
+ * that place queues in memory of their own (a shared heap region, a SAB).
+ * @return {size_t} Bytes, or 0 for an unknown sample type.
+ */
+EMSCRIPTEN_KEEPALIVE
+size_t FreeQueueLayoutBytes( size_t length, size_t channel_count, uint32_t sample_type, uint32_t flags )
+{
+  uint32_t header[FREE_QUEUE_HEADER_LENGTH];
+  return _freeQueueLayout(header, length, channel_count, sample_type, flags);
+}
+
+/**
+ * Lays out an empty queue in |bytes| of caller-owned memory at |base|
+ * (cache-line aligned, at least FreeQueueLayoutBytes long).
+ * @return {size_t} Bytes used, or 0 on a bad base or size.
+ */
+EMSCRIPTEN_KEEPALIVE
+size_t InitFreeQueueLayout( void* base, size_t bytes, size_t length, size_t channel_count, 
+    uint32_t sample_type, uint32_t flags )
+{
+  return _initFreeQueueBlock(base, bytes, length, channel_count, sample_type, flags);
 }
 
+/**
+ * Attaches to the queue block at |base| (see GetFreeQueuePointers "base"),
+ * whatever its sample type. Release the handle with DetachFreeQueue; the
+ * block stays with its owner.
+ * @return {void*} Handle, or nullptr if |base| holds no queue of this layout
+ *   version.
+ */
 EMSCRIPTEN_KEEPALIVE
-bool FreeQueuePull(struct FreeQueue *queue, double **output, size_t block_length) {
+void *AttachFreeQueue( void* base )
+{
+  return _attachFreeQueue<double>(base);
+}
+
+/** Frees a handle of any sample type, and its block if it created it. */
+EMSCRIPTEN_KEEPALIVE
+void DetachFreeQueue( void* instance )
+{
+  _destroyFreeQueue((FreeQueue<double>*)instance);
+}
+
+/**
+ * Formats |bytes| at |base| as a queue region that several modules sharing
+ * one memory (or JS, through FreeQueueRegion) can create queues in without
+ * touching each other's heaps. |base| must be cache-line aligned.
+ * @return {int} 1 on success, 0 otherwise.
+ */
+EMSCRIPTEN_KEEPALIVE
+int InitFreeQueueRegion( void* base, size_t bytes )
+{
+  return _initFreeQueueRegion(base, bytes) ? 1 : 0;
+}
+
+/**
+ * Creates a queue inside a region.
+ * @return {size_t} Byte offset of the queue from |region|, 0 if it is full.
+ */
+EMSCRIPTEN_KEEPALIVE
+size_t CreateFreeQueueInRegion( void* region, size_t length, size_t channel_count, 
+    uint32_t sample_type, uint32_t flags )
+{
+  return _createFreeQueueInRegion(region, length, channel_count, sample_type, flags);
+}
+
+/**
+ * @return {size_t} Byte offset of the |index|th queue created in |region|,
+ *   or 0.
+ */
+EMSCRIPTEN_KEEPALIVE
+size_t GetFreeQueueRegionEntry( void* region, uint32_t index )
+{
+  return _freeQueueRegionEntry(region, index);
+}
+
+/**
+ * Attaches to the queue at |offset| bytes into |region|, e.g. one created
+ * by another module. Release with DetachFreeQueue.
+ * @return {void*} Handle, or nullptr if no queue is there, |offset| is not
+ *   cache-line aligned or the queue does not end inside the region.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *AttachFreeQueueInRegion( void* region, size_t offset )
+{
+  if (!_isFreeQueueRegion(region)) return nullptr;
+  size_t limit = ((uint32_t *)region)[REGION_BYTES];
+  if (offset < 2 * FREE_QUEUE_CACHE_LINE || (offset & (FREE_QUEUE_CACHE_LINE - 1)) != 0 || 
+      offset + FREE_QUEUE_HEADER_LENGTH * sizeof(uint32_t) > limit) {
+    return nullptr;
+  }
+  FreeQueue<double> *queue = _attachFreeQueue<double>((char *)region + offset);
+  // a stale offset must not reach past the region into another heap
+  if (queue != nullptr && offset + queue->header[HEADER_BYTES] > limit) {
+    _destroyFreeQueue(queue);
+    return nullptr;
+  }
+  return queue;
+}
+
+/**
+ * Field lookup for FreeQueueMPMC, like GetFreeQueuePointers. Keys:
+ * "slot_count", "block_length", "channel_count", "state", "channel_data"
+ * and "sample_type".
+ */
+EMSCRIPTEN_KEEPALIVE
+void *GetFreeQueueMPMCPointers( void* instance, char* data ) 
+{
+  FreeQueueMPMC<double>* queue = (FreeQueueMPMC<double>*)instance;
   if ( queue != nullptr ) {
-    uint32_t current_read = atomic_load(queue->state + READ);
-    uint32_t current_write = atomic_load(queue->state + WRITE);
-    if (_getAvailableRead(queue, current_read, current_write) < block_length) {
-      return false;
+    if (strcmp(data, "slot_count") == 0) {
+      return ( void* )&queue->slot_count;
+    }
+    else if (strcmp(data, "block_length") == 0) {
+      return ( void* )&queue->block_length;
+    }
+    else if (strcmp(data, "channel_count") == 0) {
+      return ( void* )&queue->channel_count;
     }
-    for (uint32_t i = 0; i < block_length; i++) {
-      for (uint32_t channel = 0; channel < queue->channel_count; channel++) {
-        output[channel][i] = 
-            queue->channel_data[channel][(current_read + i) % queue->buffer_length];
-      }
+    else if (strcmp(data, "state") == 0) {
+      return ( void* )&queue->state;
+    }
+    else if (strcmp(data, "channel_data") == 0) {
+      return ( void* )&queue->channel_data;
+    }
+    else if (strcmp(data, "sample_type") == 0) {
+      return ( void* )&queue->sample_type;
     }
-    uint32_t nextRead = (current_read + block_length) % queue->buffer_length;
-    atomic_store(queue->state + READ, nextRead);
-    return true;
   }
-  return false;
+  return 0;
 }
 
+/**
+ * Registers a reader on a broadcast queue of any sample type. It starts at
+ * the live edge: frames pushed before the call are not seen.
+ * @return {int} Reader index, or -1 if every reader line is taken.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueBroadcastAttach( void* instance )
+{
+  FreeQueueBroadcast<double>* queue = (FreeQueueBroadcast<double>*)instance;
+  if ( queue == nullptr ) return -1;
+  return _broadcastAttach(queue);
+}
+
+/**
+ * Moves a detached (or lagging) reader to the live edge and reactivates it.
+ * A no-op on a line that is not attached.
+ */
+EMSCRIPTEN_KEEPALIVE
+void FreeQueueBroadcastRejoin( void* instance, uint32_t reader )
+{
+  FreeQueueBroadcast<double>* queue = (FreeQueueBroadcast<double>*)instance;
+  if ( queue != nullptr && reader < queue->max_readers ) {
+    _broadcastRejoin(queue, reader);
+  }
+}
+
+/** Releases a reader line; the producer stops waiting for it at once. */
 EMSCRIPTEN_KEEPALIVE
-void *GetFreeQueuePointers( struct FreeQueue* queue, char* data ) 
+void FreeQueueBroadcastDetach( void* instance, uint32_t reader )
 {
+  FreeQueueBroadcast<double>* queue = (FreeQueueBroadcast<double>*)instance;
+  if ( queue != nullptr && reader < queue->max_readers ) {
+    std::atomic_store(_broadcastReader(queue, reader) + BROADCAST_STATUS, 
+        (unsigned int)BROADCAST_FREE);
+  }
+}
+
+/**
+ * Field lookup for FreeQueueBroadcast. Keys: "buffer_length",
+ * "channel_count", "state", "channel_data", "sample_type", "max_readers"
+ * and "policy".
+ */
+EMSCRIPTEN_KEEPALIVE
+void *GetFreeQueueBroadcastPointers( void* instance, char* data ) 
+{
+  FreeQueueBroadcast<double>* queue = (FreeQueueBroadcast<double>*)instance;
   if ( queue != nullptr ) {
     if (strcmp(data, "buffer_length") == 0) {
       return ( void* )&queue->buffer_length;
@@ -154,20 +522,488 @@ void *GetFreeQueuePointers( struct FreeQueue* queue, char* data )
     else if (strcmp(data, "channel_data") == 0) {
       return ( void* )&queue->channel_data;
     }
+    else if (strcmp(data, "sample_type") == 0) {
+      return ( void* )&queue->sample_type;
+    }
+    else if (strcmp(data, "max_readers") == 0) {
+      return ( void* )&queue->max_readers;
+    }
+    else if (strcmp(data, "policy") == 0) {
+      return ( void* )&queue->policy;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reserves up to |length| frames of free space directly inside
+ * |channel_data| for the producer to fill in place.
+ * @return {size_t} Number of frames reserved; |window| describes them.
+ */
+EMSCRIPTEN_KEEPALIVE
+size_t FreeQueueBeginWrite( void* instance, size_t length, struct FreeQueueWindow* window )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    return _beginWrite(queue, length, window);
+  }
+  return 0;
+}
+
+/**
+ * Publishes |length| frames (at most the amount reserved by the last
+ * FreeQueueBeginWrite) to the consumer.
+ */
+EMSCRIPTEN_KEEPALIVE
+void FreeQueueCommitWrite( void* instance, size_t length )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    _commitWrite(queue, length);
+  }
+}
+
+/**
+ * Exposes up to |length| readable frames directly inside |channel_data|.
+ * @return {size_t} Number of frames exposed; |window| describes them.
+ */
+EMSCRIPTEN_KEEPALIVE
+size_t FreeQueueBeginRead( void* instance, size_t length, struct FreeQueueWindow* window )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    return _beginRead(queue, length, window);
+  }
+  return 0;
+}
+
+/**
+ * Releases |length| frames (at most the amount exposed by the last
+ * FreeQueueBeginRead) back to the producer.
+ */
+EMSCRIPTEN_KEEPALIVE
+void FreeQueueCommitRead( void* instance, size_t length )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    _commitRead(queue, length);
+  }
+}
+
+/**
+ * Blocks the consumer until at least |frames| frames are readable.
+ * Do not call on the browser main thread or in an AudioWorklet.
+ * @return {int} 1 when readable, 0 after |timeout_ms| (negative waits
+ *   forever), -1 once the queue has been closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueWaitReadable( void* instance, size_t frames, double timeout_ms )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    return _wait(queue, frames, timeout_ms, _isReadable<double>, WRITE, READ_WAITERS, READ_SPIN);
+  }
+  return -1;
+}
+
+/**
+ * Blocks the producer until at least |frames| frames are writable.
+ * Do not call on the browser main thread or in an AudioWorklet.
+ * @return {int} 1 when writable, 0 after |timeout_ms| (negative waits
+ *   forever), -1 once the queue has been closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueWaitWritable( void* instance, size_t frames, double timeout_ms )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    return _wait(queue, frames, timeout_ms, _isWritable<double>, READ, WRITE_WAITERS, WRITE_SPIN);
+  }
+  return -1;
+}
+
+/**
+ * Marks the queue closed and wakes every thread blocked in
+ * FreeQueueWaitReadable/FreeQueueWaitWritable. Waiters must have returned
+ * before the queue is destroyed.
+ */
+EMSCRIPTEN_KEEPALIVE
+void FreeQueueClose( void* instance )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr ) {
+    std::atomic_store_explicit(queue->state + CLOSED, 1u, std::memory_order_seq_cst);
+    _futexWake(queue->state + READ);
+    _futexWake(queue->state + WRITE);
+  }
+}
+
+/**
+ * Total number of frames ever pushed into a FREE_QUEUE_POW2 queue.
+ * Returns 0 for queues created without that flag.
+ */
+EMSCRIPTEN_KEEPALIVE
+uint64_t FreeQueueGetFramesWritten( void* instance )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr && ( queue->flags & FREE_QUEUE_POW2 ) ) {
+    return _loadIndex(queue, WRITE, std::memory_order_acquire);
   }
   return 0;
 }
 
+/**
+ * Total number of frames ever pulled from a FREE_QUEUE_POW2 queue.
+ * Returns 0 for queues created without that flag.
+ */
+EMSCRIPTEN_KEEPALIVE
+uint64_t FreeQueueGetFramesRead( void* instance )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr && ( queue->flags & FREE_QUEUE_POW2 ) ) {
+    return _loadIndex(queue, READ, std::memory_order_acquire);
+  }
+  return 0;
+}
+
+/**
+ * Starts a block clock of |block_length| frames at |sample_rate| Hz. The
+ * first deadline is one period from now, so callers do their work first
+ * and then wait.
+ */
+EMSCRIPTEN_KEEPALIVE
+void FreeQueuePacerInit( struct FreeQueuePacer* pacer, uint32_t sample_rate, uint32_t block_length )
+{
+  pacer->period_ms = sample_rate > 0 ? 1000.0 * block_length / sample_rate : 0;
+  pacer->deadline_ms = _nowMs() + pacer->period_ms;
+  std::atomic_store_explicit(&pacer->ticks, 0u, std::memory_order_relaxed);
+  std::atomic_store_explicit(&pacer->misses, 0u, std::memory_order_relaxed);
+  std::atomic_store_explicit(&pacer->resyncs, 0u, std::memory_order_relaxed);
+}
+
+/**
+ * Sleeps until the next deadline and advances it by one period. A late
+ * tick returns at once and the following ones catch up, unless the pacer
+ * is more than FREE_QUEUE_PACER_MAX_LATE periods behind; then the clock
+ * is re-anchored to now instead of bursting through the backlog.
+ * @return {int} 1 when the deadline was met, 0 when it was missed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueuePacerWait( struct FreeQueuePacer* pacer )
+{
+  int on_time = 1;
+  double now = _nowMs();
+  if ( now > pacer->deadline_ms ) {
+    on_time = 0;
+    std::atomic_fetch_add_explicit(&pacer->misses, 1u, std::memory_order_relaxed);
+    if ( now - pacer->deadline_ms > FREE_QUEUE_PACER_MAX_LATE * pacer->period_ms ) {
+      pacer->deadline_ms = now;
+      std::atomic_fetch_add_explicit(&pacer->resyncs, 1u, std::memory_order_relaxed);
+    }
+  } else {
+    _sleepUntil(pacer->deadline_ms);
+  }
+  pacer->deadline_ms += pacer->period_ms;
+  std::atomic_fetch_add_explicit(&pacer->ticks, 1u, std::memory_order_relaxed);
+  return on_time;
+}
+
+/**
+ * Copies the statistics of a queue into |stats|. Safe to call from any
+ * thread while the queue is in use.
+ */
+EMSCRIPTEN_KEEPALIVE
+void FreeQueueGetStats( void* instance, struct FreeQueueStats* stats )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue != nullptr && stats != nullptr ) {
+    std::atomic_uint* state = queue->state;
+    stats->pushes = std::atomic_load_explicit(_counter(state, STATS_PUSHES), std::memory_order_relaxed);
+    stats->pulls = std::atomic_load_explicit(_counter(state, STATS_PULLS), std::memory_order_relaxed);
+    stats->overruns = std::atomic_load_explicit(_counter(state, STATS_OVERRUNS), std::memory_order_relaxed);
+    stats->underruns = std::atomic_load_explicit(_counter(state, STATS_UNDERRUNS), std::memory_order_relaxed);
+    stats->frames_pushed = std::atomic_load_explicit(_counter(state, STATS_FRAMES_PUSHED), std::memory_order_relaxed);
+    stats->frames_pulled = std::atomic_load_explicit(_counter(state, STATS_FRAMES_PULLED), std::memory_order_relaxed);
+    stats->min_fill = std::atomic_load_explicit(_counter(state, STATS_MIN_FILL), std::memory_order_relaxed);
+    stats->max_fill = std::atomic_load_explicit(_counter(state, STATS_MAX_FILL), std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Copies the push-to-pull latency histogram of a FREE_QUEUE_LATENCY queue
+ * into |buckets| (up to |count| of FREE_QUEUE_LATENCY_BUCKETS counters).
+ * Bucket i holds residencies in [FreeQueueLatencyBucketLow(i),
+ * FreeQueueLatencyBucketLow(i + 1)) ns.
+ * @return {uint64_t} Number of samples, 0 without instrumentation.
+ */
+EMSCRIPTEN_KEEPALIVE
+uint64_t FreeQueueGetLatencyHistogram( void* instance, uint64_t* buckets, size_t count )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue == nullptr || queue->latency == nullptr ) return 0;
+  if ( count > FREE_QUEUE_LATENCY_BUCKETS ) count = FREE_QUEUE_LATENCY_BUCKETS;
+  for (size_t i = 0; i < count; i++) {
+    buckets[i] = std::atomic_load_explicit(
+        _counter(queue->latency, LATENCY_HISTOGRAM + 2 * (int)i), std::memory_order_relaxed);
+  }
+  return std::atomic_load_explicit(_counter(queue->latency, LATENCY_SAMPLES), 
+      std::memory_order_relaxed);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint64_t FreeQueueLatencyBucketLow( uint32_t index )
+{
+  return _latencyBucketLow(index);
+}
+
+/**
+ * Push-to-pull latency percentile of a FREE_QUEUE_LATENCY queue.
+ * @param percentile In [0, 100].
+ * @return {uint64_t} Upper bound in ns of the bucket holding the
+ *   percentile (the recorded maximum for the last bucket), 0 without
+ *   samples.
+ */
+EMSCRIPTEN_KEEPALIVE
+uint64_t FreeQueueGetLatencyPercentile( void* instance, double percentile )
+{
+  FreeQueue<double>* queue = (FreeQueue<double>*)instance;
+  if ( queue == nullptr || queue->latency == nullptr ) return 0;
+  uint64_t buckets[FREE_QUEUE_LATENCY_BUCKETS];
+  uint64_t samples = 0;
+  for (int i = 0; i < FREE_QUEUE_LATENCY_BUCKETS; i++) {
+    buckets[i] = std::atomic_load_explicit(
+        _counter(queue->latency, LATENCY_HISTOGRAM + 2 * i), std::memory_order_relaxed);
+    samples += buckets[i];
+  }
+  uint64_t max = std::atomic_load_explicit(_counter(queue->latency, LATENCY_MAX), 
+      std::memory_order_relaxed);
+  if ( samples == 0 ) return 0;
+  uint64_t rank = (uint64_t)ceil(percentile / 100.0 * samples);
+  if ( rank == 0 ) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < FREE_QUEUE_LATENCY_BUCKETS; i++) {
+    seen += buckets[i];
+    if ( seen >= rank ) {
+      uint64_t high = i + 1 < FREE_QUEUE_LATENCY_BUCKETS ? _latencyBucketLow(i + 1) - 1 : max;
+      return high < max ? high : max;
+    }
+  }
+  return max;
+}
+
+static struct FreeQueuePipeline* _getPipeline( int handle ) {
+  struct FreeQueuePipeline* pipeline = nullptr;
+  if ( handle > 0 && handle <= FREE_QUEUE_MAX_PIPELINES ) {
+    pthread_mutex_lock( &pipelines_mutex );
+    pipeline = pipelines[handle - 1];
+    pthread_mutex_unlock( &pipelines_mutex );
+  }
+  return pipeline;
+}
+
+/**
+ * Creates a pipeline (queue only, threads are started separately).
+ * @param config Configuration; nullptr or zero fields take the defaults.
+ * @return {int} Handle > 0, or -1 when the registry is full, the queue
+ *   cannot be created or |block_length| is too large or exceeds
+ *   |capacity|.
+ */
+EMSCRIPTEN_KEEPALIVE 
+int CreateFreeQueuePipeline( const struct FreeQueuePipelineConfig* config ) {
+  struct FreeQueuePipelineConfig c;
+  memset( &c, 0, sizeof(c) );
+  if ( config != nullptr ) c = *config;
+  if ( c.channel_count == 0 ) c.channel_count = 2;
+  if ( c.block_length == 0 ) c.block_length = 1764;
+  // the default capacity of 500 blocks must fit in 32 bits
+  if ( c.block_length > UINT32_MAX / 500 ) return -1;
+  if ( c.capacity == 0 ) c.capacity = c.block_length * 500;
+  // the producer could never find room for a block
+  if ( c.block_length > c.capacity ) return -1;
+  if ( c.high_watermark == 0 ) c.high_watermark = c.block_length * 50;
+  if ( c.sample_rate == 0 ) c.sample_rate = 44100;
+
+  struct FreeQueuePipeline* pipeline = 
+      (struct FreeQueuePipeline*)calloc( 1, sizeof(struct FreeQueuePipeline) );
+  if ( pipeline == nullptr ) return -1;
+  pipeline->config = c;
+  std::atomic_init( &pipeline->busy, 0 );
+  pipeline->instance = CreateFreeQueueWithFlags( c.capacity, c.channel_count, c.flags );
+  if ( pipeline->instance == nullptr ) {
+    free( pipeline );
+    return -1;
+  }
+
+  int handle = -1;
+  pthread_mutex_lock( &pipelines_mutex );
+  for ( int i = 0; i < FREE_QUEUE_MAX_PIPELINES; i++ ) {
+    if ( pipelines[i] == nullptr ) {
+      pipelines[i] = pipeline;
+      handle = i + 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &pipelines_mutex );
+  if ( handle < 0 ) {
+    DestroyFreeQueue( pipeline->instance );
+    free( pipeline );
+  }
+  return handle;
+}
+
+/** Stops the threads of |pipeline|; the caller holds pipelines_control_mutex. */
+static int _stopPipeline( struct FreeQueuePipeline* pipeline ) {
+  if ( !pipeline->running ) return 0;
+  pipeline->busy = 0;
+  FreeQueueClose( pipeline->instance );
+  pthread_join( pipeline->tid_producer, 0 );
+  pthread_join( pipeline->tid_consumer, 0 );
+  pipeline->running = 0;
+  return 1;
+}
+
+/**
+ * Stops the producer and consumer threads of a pipeline. The queue is
+ * closed first so both threads wake up immediately.
+ * @return {int} 1 when stopped, 0 when not running, -1 for a bad handle.
+ */
+EMSCRIPTEN_KEEPALIVE 
+int StopFreeQueuePipeline( int handle ) {
+  pthread_mutex_lock( &pipelines_control_mutex );
+  struct FreeQueuePipeline* pipeline = _getPipeline( handle );
+  int result = pipeline != nullptr ? _stopPipeline( pipeline ) : -1;
+  pthread_mutex_unlock( &pipelines_control_mutex );
+  return result;
+}
+
+/**
+ * Starts the producer and consumer threads of a pipeline.
+ * @return {int} 1 when started, 0 when already running, -1 on error.
+ */
+EMSCRIPTEN_KEEPALIVE 
+int StartFreeQueuePipeline( int handle ) {
+  pthread_mutex_lock( &pipelines_control_mutex );
+  struct FreeQueuePipeline* pipeline = _getPipeline( handle );
+  int result = 1;
+  if ( pipeline == nullptr ) {
+    result = -1;
+  } else if ( pipeline->running ) {
+    result = 0;
+  } else {
+    pipeline->busy = 1;
+    // reopen a queue closed by a previous stop
+    std::atomic_store( pipeline->instance->state + CLOSED, 0u );
+    if ( pthread_create( &pipeline->tid_consumer, 0, consumer, pipeline ) ) {
+      pipeline->busy = 0;
+      result = -1;
+    } else if ( pthread_create( &pipeline->tid_producer, 0, producer, pipeline ) ) {
+      printf( "pipeline %d: consumer thread created...\n", handle );
+      pipeline->busy = 0;
+      FreeQueueClose( pipeline->instance );
+      pthread_join( pipeline->tid_consumer, 0 );
+      result = -1;
+    } else {
+      printf( "pipeline %d: consumer thread created...\n", handle );
+      printf( "pipeline %d: producer thread created...\n", handle );
+      pipeline->running = 1;
+    }
+  }
+  pthread_mutex_unlock( &pipelines_control_mutex );
+  return result;
+}
+
+/**
+ * Stops a pipeline if needed, unregisters it and frees its queue.
+ * @return {int} 1 when destroyed, -1 for a bad handle.
+ */
+EMSCRIPTEN_KEEPALIVE 
+int DestroyFreeQueuePipeline( int handle ) {
+  pthread_mutex_lock( &pipelines_control_mutex );
+  struct FreeQueuePipeline* pipeline = _getPipeline( handle );
+  if ( pipeline != nullptr ) {
+    _stopPipeline( pipeline );
+    pthread_mutex_lock( &pipelines_mutex );
+    pipelines[handle - 1] = nullptr;
+    pthread_mutex_unlock( &pipelines_mutex );
+  }
+  pthread_mutex_unlock( &pipelines_control_mutex );
+  if ( pipeline == nullptr ) return -1;
+  DestroyFreeQueue( pipeline->instance );
+  free( pipeline );
+  return 1;
+}
+
+/**
+ * Makes the producer of a stopped pipeline run |decode(decoder, -1)| until
+ * it returns -1 instead of rendering the demo signal; |decode| waits for
+ * room itself. Decoders come from free_queue_codec.h, e.g.
+ * SetFreeQueuePipelineSource(handle, FreeQueueFlacDecode, decoder), and
+ * must be created for the pipeline's queue; the pipeline does not own
+ * them. nullptr restores the demo.
+ * @return {int} 1 on success, 0 while running, -1 for a bad handle.
+ */
+EMSCRIPTEN_KEEPALIVE 
+int SetFreeQueuePipelineSource( int handle, int (*decode)( void*, double ), void* decoder )
+{
+  pthread_mutex_lock( &pipelines_control_mutex );
+  struct FreeQueuePipeline* pipeline = _getPipeline( handle );
+  int result = 1;
+  if ( pipeline == nullptr ) {
+    result = -1;
+  } else if ( pipeline->running ) {
+    result = 0;
+  } else {
+    pipeline->decode = decode;
+    pipeline->decoder = decoder;
+  }
+  pthread_mutex_unlock( &pipelines_control_mutex );
+  return result;
+}
+
+/**
+ * Queue of a pipeline, e.g. to attach a JS FreeQueue through fromPointers.
+ * It is freed by DestroyFreeQueuePipeline.
+ */
+EMSCRIPTEN_KEEPALIVE 
+FreeQueue<double> *GetFreeQueuePipelineQueue( int handle ) {
+  struct FreeQueuePipeline* pipeline = _getPipeline( handle );
+  if ( pipeline != nullptr ) {
+    return pipeline->instance;
+  }
+  return nullptr;
+}
+
+/**
+ * Copies the deadline counters of a pipeline's threads into |timing|.
+ * @return {int} 1 on success, -1 for a bad handle.
+ */
+EMSCRIPTEN_KEEPALIVE 
+int GetFreeQueuePipelineTiming( int handle, struct FreeQueuePipelineTiming* timing ) {
+  if ( timing == nullptr || handle <= 0 || handle > FREE_QUEUE_MAX_PIPELINES ) return -1;
+  // held so that a concurrent destroy cannot free the pipeline under us
+  pthread_mutex_lock( &pipelines_mutex );
+  struct FreeQueuePipeline* pipeline = pipelines[handle - 1];
+  if ( pipeline == nullptr ) {
+    pthread_mutex_unlock( &pipelines_mutex );
+    return -1;
+  }
+  struct FreeQueuePacer* p = &pipeline->producer_pacer;
+  struct FreeQueuePacer* c = &pipeline->consumer_pacer;
+  timing->producer_ticks = std::atomic_load_explicit( &p->ticks, std::memory_order_relaxed );
+  timing->producer_misses = std::atomic_load_explicit( &p->misses, std::memory_order_relaxed );
+  timing->producer_resyncs = std::atomic_load_explicit( &p->resyncs, std::memory_order_relaxed );
+  timing->consumer_ticks = std::atomic_load_explicit( &c->ticks, std::memory_order_relaxed );
+  timing->consumer_misses = std::atomic_load_explicit( &c->misses, std::memory_order_relaxed );
+  timing->consumer_resyncs = std::atomic_load_explicit( &c->resyncs, std::memory_order_relaxed );
+  pthread_mutex_unlock( &pipelines_mutex );
+  return 1;
+}
+
 EMSCRIPTEN_KEEPALIVE 
 int DestroyFreeQueueThreads() {
-  if ( memorydata.instance != nullptr ) {
-    memorydata.busy = 0;
-    pthread_join(tid_producer, 0);
-    pthread_join(tid_consumer, 0);
-    DestroyFreeQueue( memorydata.instance );
-    tid_producer = 0;
-    tid_consumer = 0;
-    memorydata.instance = nullptr;
+  if ( default_pipeline != 0 ) {
+    DestroyFreeQueuePipeline( default_pipeline );
+    default_pipeline = 0;
     return 1;
   }
   return 0;
@@ -175,58 +1011,42 @@ int DestroyFreeQueueThreads() {
 
 EMSCRIPTEN_KEEPALIVE 
 int CreateFreeQueueThreads() {
-  uint32_t channel_count = 2;
-  uint32_t length = 1764;
-  if ( memorydata.instance == nullptr ) {
-    memorydata.busy = 1;
-    memorydata.instance = CreateFreeQueue( length * 500, channel_count );
-    int p = 0;
-    p = pthread_create( &tid_consumer, 0, consumer, &memorydata );
-    if ( p ) {
+  if ( default_pipeline == 0 ) {
+    int handle = CreateFreeQueuePipeline( nullptr );
+    if ( handle < 0 ) {
       return -1;
     }
-    printf( "CreateThreads: consumer thread created...\n" );
-    p = pthread_create( &tid_producer, 0, producer, &memorydata );
-    if ( p ) {
+    if ( StartFreeQueuePipeline( handle ) != 1 ) {
+      DestroyFreeQueuePipeline( handle );
       return -1;
     }
-    printf( "CreateThreads: producer thread created...\n" );
+    default_pipeline = handle;
     return 1;
   }
   return 0;
 }
 
 EMSCRIPTEN_KEEPALIVE 
-struct FreeQueue *GetFreeQueueThreads() {
-  if ( memorydata.instance != nullptr ) {
-    return memorydata.instance;
-  }
-  return nullptr;
+FreeQueue<double> *GetFreeQueueThreads() {
+  return GetFreeQueuePipelineQueue( default_pipeline );
 }
 
 EMSCRIPTEN_KEEPALIVE 
-void PrintQueueInfo(struct FreeQueue *queue) {
+void PrintQueueInfo(void *instance) {
+  FreeQueue<double> *queue = (FreeQueue<double> *)instance;
   if ( queue != nullptr ) {
-    uint32_t current_read = atomic_load(queue->state + READ);
-    uint32_t current_write = atomic_load(queue->state + WRITE);
-    for (uint32_t channel = 0; channel < queue->channel_count; channel++) {
-      printf("channel %d: ", channel);
-      for (uint32_t i = 0; i < queue->buffer_length; i++) {
-        printf("%f ", queue->channel_data[channel][i]);
-      }
-      printf("\n");
+    switch (queue->sample_type) {
+      case FREE_QUEUE_FLOAT64: _printQueueInfo((FreeQueue<double> *)instance); break;
+      case FREE_QUEUE_FLOAT32: _printQueueInfo((FreeQueue<float> *)instance); break;
+      case FREE_QUEUE_INT16: _printQueueInfo((FreeQueue<int16_t> *)instance); break;
+      case FREE_QUEUE_INT32: _printQueueInfo((FreeQueue<int32_t> *)instance); break;
     }
-    printf("----------\n");
-    printf("current_read: %u  | current_write: %u\n", current_read, current_write);
-    printf("available_read: %u  | available_write: %u\n", 
-        _getAvailableRead(queue, current_read, current_write), 
-        _getAvailableWrite(queue, current_read, current_write));
-    printf("----------\n");
   }
 }
 
 EMSCRIPTEN_KEEPALIVE 
-void PrintQueueAddresses(struct FreeQueue *queue) {
+void PrintQueueAddresses(void *instance) {
+  FreeQueue<double> *queue = (FreeQueue<double> *)instance;
   if ( queue != nullptr ) {
     printf("buffer_length: %p   uint: %zu\n", 
         &queue->buffer_length, (size_t)&queue->buffer_length);
@@ -236,14 +1056,20 @@ void PrintQueueAddresses(struct FreeQueue *queue) {
         &queue->state, (size_t)&queue->state);
     printf("channel_data    : %p   uint: %zu\n", 
         &queue->channel_data, (size_t)&queue->channel_data);
+    printf("sample_type : %p   uint: %zu\n", 
+        &queue->sample_type, (size_t)&queue->sample_type);
+    printf("flags       : %p   uint: %zu\n", 
+        &queue->flags, (size_t)&queue->flags);
+    printf("latency     : %p   uint: %zu\n", 
+        &queue->latency, (size_t)&queue->latency);
     for (uint32_t channel = 0; channel < queue->channel_count; channel++) {
         printf("channel_data[%d]    : %p   uint: %zu\n", channel,
             &queue->channel_data[channel], (size_t)&queue->channel_data[channel]);
     }
-    printf("state[0]    : %p   uint: %zu\n", 
-        &queue->state[0], (size_t)&queue->state[0]);
-    printf("state[1]    : %p   uint: %zu\n", 
-        &queue->state[1], (size_t)&queue->state[1]);
+    printf("state[%d]    : %p   uint: %zu\n", READ,
+        &queue->state[READ], (size_t)&queue->state[READ]);
+    printf("state[%d]   : %p   uint: %zu\n", WRITE,
+        &queue->state[WRITE], (size_t)&queue->state[WRITE]);
   }
 }
 
@@ -251,42 +1077,61 @@ void PrintQueueAddresses(struct FreeQueue *queue) {
 }
 #endif
 
+// render one block straight into the ring, no intermediate input buffer
+static bool _renderBlock( FreeQueue<double>* instance, size_t length, unsigned int* seed )
+{
+  struct FreeQueueWindow window;
+  if ( FreeQueueBeginWrite(instance, length, &window) != length ) return false;
+  for (size_t i = 0; i < instance->channel_count; i++) {
+    double* data = instance->channel_data[i];
+    for (size_t j = 0; j < window.first; j++) {
+      data[window.offset + j] = ( i % 2 ) ? -rand_r(seed) : rand_r(seed);
+    }
+    for (size_t j = 0; j < window.second; j++) {
+      data[j] = ( i % 2 ) ? -rand_r(seed) : rand_r(seed);
+    }
+  }
+  FreeQueueCommitWrite(instance, length);
+  return true;
+}
+
 // store data
 void *producer( void *arg ) 
 {
-  struct FreeQueueThread* f = (struct FreeQueueThread*)arg;
-  struct FreeQueue* instance = f->instance;
+  struct FreeQueuePipeline* f = (struct FreeQueuePipeline*)arg;
+  FreeQueue<double>* instance = f->instance;
   uint32_t channel_count = instance->channel_count;
   uint32_t buffer_length = instance->buffer_length;
-  uint32_t length = 1764;
+  uint32_t length = f->config.block_length;
+  // free space that means the fill level is below the high watermark
+  size_t capacity = _capacity(instance);
+  size_t threshold = capacity > f->config.high_watermark 
+      ? capacity - f->config.high_watermark + 1 : 1;
+  if ( threshold < length ) threshold = length;
+  if ( threshold > capacity ) threshold = capacity;
+  unsigned int seed = (unsigned int)(uintptr_t)f;
   printf( "producer: [ buffer length is %d; channel count is %d ]\n", buffer_length, channel_count );
-  while ( f->busy ) {  
-    double** input = (double **)malloc(channel_count * sizeof(double *));
-    for (int i = 0; i < channel_count; i++) {
-      input[i] = (double *)malloc(length * sizeof(double));
-    }
-    uint32_t current_read = atomic_load(instance->state + READ);
-    uint32_t current_write = atomic_load(instance->state + WRITE);
-    while( _getAvailableWrite(instance, current_read, current_write) > ( length * 450 ) && f->busy ) { 
-      for (int i = 0; i < channel_count; i++) {
-        for (int j = 0; j < length; j++) {
-          input[i][j] = ( i % 2 ) ? -rand() : rand();
-        }
-      }
-      current_read = atomic_load(instance->state + READ);
-      current_write = atomic_load(instance->state + WRITE);
-      pthread_mutex_lock( &tasks_mutex );
-      //printf( "producer: [ read is %d; write is %d ]\n", current_read, current_write );
-      //printf( "producer: [ length is %d ]\n", length );
-      ////////////////////////////////////////////////////////////////////////////////////////
-      bool rc = FreeQueuePush(instance, input, length);
-      //printf( "FreeQueuePush: %s\n", ( rc == true ) ? "true" : "false" );
-      ////////////////////////////////////////////////////////////////////////////////////////
-      pthread_mutex_unlock( &tasks_mutex );
-      usleep( 40 * 1000 ); // 40ms 1fps
+  if ( f->decode != nullptr ) {
+    // a decoder runs as far ahead as the ring allows and blocks on it
+    while ( f->busy && f->decode( f->decoder, -1 ) >= 0 ) {
     }
-    for (int i = 0; i < channel_count; i++) free( input[i] );
-    free( input );
+    printf( "producer: exit thread\n" );
+    return 0;
+  }
+  // a clocked consumer starts from a ring primed to the watermark
+  if ( f->config.paced_consumer ) {
+    while ( f->busy && _isWritable(instance, threshold) && _renderBlock(instance, length, &seed) ) {
+    }
+  }
+  FreeQueuePacerInit( &f->producer_pacer, f->config.sample_rate, length );
+  while ( f->busy ) {
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // one block per period; above the watermark the tick is skipped
+    if ( _isWritable(instance, threshold) ) {
+      _renderBlock(instance, length, &seed);
+    }
+    ////////////////////////////////////////////////////////////////////////////////////////
+    FreeQueuePacerWait( &f->producer_pacer );
   }  
   printf( "producer: exit thread\n" );
   return 0;
@@ -295,45 +1140,53 @@ void *producer( void *arg )
 // load data
 void *consumer( void *arg )
 {
-  struct FreeQueueThread* f = (struct FreeQueueThread*)arg;
-  struct FreeQueue* instance = f->instance;
+  struct FreeQueuePipeline* f = (struct FreeQueuePipeline*)arg;
+  FreeQueue<double>* instance = f->instance;
   uint32_t channel_count = instance->channel_count;
   uint32_t buffer_length = instance->buffer_length;
-  uint32_t length = 1764;
+  uint32_t length = f->config.block_length;
   printf( "consumer: [ buffer length is %d; channel count is %d ]\n", buffer_length, channel_count );
-  while ( f->busy ) 
-  {
-    double** output = (double **)malloc(channel_count * sizeof(double *));
-    for (int i = 0; i < channel_count; i++) {
-      output[i] = (double *)malloc(length * sizeof(double));
-      for (int j = 0; j < length; j++) {
-        output[i][j] = 0;
-      }
-    }    
-    uint32_t current_read = atomic_load(instance->state + READ);
-    uint32_t current_write = atomic_load(instance->state + WRITE);
-    while( _getAvailableRead(instance, current_read, current_write) > 0 && f->busy ) {
-      current_read = atomic_load(instance->state + READ);
-      current_write = atomic_load(instance->state + WRITE);
-      pthread_mutex_lock( &tasks_mutex );
-      //printf( "consumer: [ read is %d; write is %d ]\n", current_read, current_write );
+  double** output = (double **)calloc(channel_count, sizeof(double *));
+  bool allocated = output != nullptr;
+  for (uint32_t i = 0; allocated && i < channel_count; i++) {
+    output[i] = (double *)calloc(length, sizeof(double));
+    allocated = output[i] != nullptr;
+  }
+  if ( !allocated ) {
+    if ( output != nullptr ) {
+      for (uint32_t i = 0; i < channel_count; i++) free( output[i] );
+    }
+    free( output );
+    printf( "consumer: out of memory, exit thread\n" );
+    return 0;
+  }
+  if ( f->config.paced_consumer ) {
+    // one block per period, like an audio device
+    FreeQueuePacerInit( &f->consumer_pacer, f->config.sample_rate, length );
+    while( f->busy ) {
       ////////////////////////////////////////////////////////////////////////////////////////
-      bool rc = FreeQueuePull(instance, output, length);
-      //printf( "FreeQueuePull: %s\n", ( rc == true ) ? "true" : "false" );
+      FreeQueuePullSome(instance, output, length);
       ////////////////////////////////////////////////////////////////////////////////////////
-      pthread_mutex_unlock( &tasks_mutex );
-      usleep( 120 * 1000 ); // 120ms 3fps
+      FreeQueuePacerWait( &f->consumer_pacer );
     }
-    for (int i = 0; i < channel_count; i++) free( output[i] );
-    free( output );
-  }  
+  } else {
+    // wake as soon as data lands; returns -1 once the queue is closed
+    while( f->busy && FreeQueueWaitReadable(instance, 1, -1) == 1 ) {
+      ////////////////////////////////////////////////////////////////////////////////////////
+      FreeQueuePullSome(instance, output, length);
+      ////////////////////////////////////////////////////////////////////////////////////////
+    }
+  }
+  for (uint32_t i = 0; i < channel_count; i++) free( output[i] );
+  free( output );
   printf( "consumer: exit thread\n" );
   return 0;
 }
+
+#ifndef FREE_QUEUE_NO_MAIN
 int main( int argc, char* argv[] )
 {
-  memorydata.instance = nullptr;
-  memorydata.busy = 1;
   return CreateFreeQueueThreads();
 }
+#endif
 
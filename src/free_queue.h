@@ -0,0 +1,1950 @@
+/**
+ * FreeQueue core: a lock-free single-producer single-consumer ring of planar
+ * multi-channel audio, header only. free_queue.cpp instantiates it behind the
+ * C ABI that wasm exports and free-queue.js maps; C++ code can include this
+ * file and use FreeQueueRing directly, with the channel count and capacity
+ * fixed at compile time when they are known. Requires C++20 (std::span).
+ */
+#ifndef FREE_QUEUE_H_
+#define FREE_QUEUE_H_
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+#include <atomic>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> 
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#endif
+#ifdef __EMSCRIPTEN__
+#include <emscripten/threading.h>
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Size of a cache line. READ and WRITE are kept this far apart in the shared
+ * state block so the producer and the consumer never store to the same line.
+ */
+#define FREE_QUEUE_CACHE_LINE 64
+
+/**
+ * Number of 32-bit words in the shared state block: the consumer line, the
+ * producer line, a read-mostly control line and one statistics line per side.
+ */
+#define FREE_QUEUE_STATE_LENGTH (5 * FREE_QUEUE_CACHE_LINE / sizeof(uint32_t))
+
+/** Bounds of the adaptive spin phase of FreeQueueWaitReadable/Writable. */
+#define FREE_QUEUE_SPIN_MIN 16
+#define FREE_QUEUE_SPIN_MAX 4096
+
+/**
+ * Storage type of the samples held by a queue. Mirrors
+ * |FreeQueue.SampleTypes| in free-queue.js.
+ * @enum {number}
+ */
+enum FreeQueueSampleType {
+  FREE_QUEUE_FLOAT64 = 0,
+  FREE_QUEUE_FLOAT32 = 1,
+  FREE_QUEUE_INT16 = 2,
+  FREE_QUEUE_INT32 = 3
+};
+
+/**
+ * Creation flags of a queue. Mirrors |FreeQueue.Flags| in free-queue.js.
+ * @enum {number}
+ */
+enum FreeQueueFlags {
+  /**
+   * Power-of-two capacity. READ and WRITE are free-running 64-bit frame
+   * counters and the ring offset is |counter & (buffer_length - 1)|, so no
+   * slot is sacrificed to tell full from empty and the hot path has no
+   * division. The counters double as totals of frames transferred.
+   */
+  FREE_QUEUE_POW2 = 1,
+  /**
+   * Push-to-pull latency instrumentation. Every committed write is stamped
+   * in a side ring and every committed read records how long the blocks it
+   * completed spent in the queue. See FreeQueueLatencyState.
+   */
+  FREE_QUEUE_LATENCY = 2
+};
+
+template <typename T> struct FreeQueueSampleTraits;
+template <> struct FreeQueueSampleTraits<double> { 
+  static const uint32_t type = FREE_QUEUE_FLOAT64; 
+};
+template <> struct FreeQueueSampleTraits<float> { 
+  static const uint32_t type = FREE_QUEUE_FLOAT32; 
+};
+template <> struct FreeQueueSampleTraits<int16_t> { 
+  static const uint32_t type = FREE_QUEUE_INT16; 
+};
+template <> struct FreeQueueSampleTraits<int32_t> { 
+  static const uint32_t type = FREE_QUEUE_INT32; 
+};
+
+/**
+ * A queue storing samples of type T. The field layout does not depend on T,
+ * so JS can read any instantiation through GetFreeQueuePointers and pick the
+ * typed array from |sample_type|.
+ */
+template <typename T>
+struct FreeQueue {
+  size_t buffer_length;
+  size_t channel_count;
+  T **channel_data;
+  std::atomic_uint *state;
+  uint32_t sample_type;
+  uint32_t flags;
+  /** FreeQueueLatencyState block with FREE_QUEUE_LATENCY, else nullptr. */
+  std::atomic_uint *latency;
+  /**
+   * Start of the shared block (FreeQueueHeader) that holds everything
+   * above; the struct itself is a process-local view of it.
+   */
+  uint32_t *header;
+  /** Non-zero if destroying this handle frees the block too. */
+  uint32_t owns_block;
+};
+
+/**
+ * A region of the ring handed out by FreeQueueBeginWrite/FreeQueueBeginRead.
+ * In every channel the frames are |channel_data[c][offset, offset + first)|
+ * followed by |channel_data[c][0, second)|.
+ */
+struct FreeQueueWindow {
+  size_t offset;
+  size_t first;
+  size_t second;
+};
+
+/**
+ * Snapshot of the statistics lines of a queue's state block. Every field is
+ * a 64-bit slot written only by its own side with relaxed atomics, so any
+ * thread (or JS through the shared state block) may sample it at any time.
+ * The fill marks are exact readings taken whenever a side refreshes its
+ * cached copy of the opposite index, i.e. when the queue looks full to the
+ * producer or empty to the consumer.
+ */
+struct FreeQueueStats {
+  uint64_t pushes;
+  uint64_t pulls;
+  uint64_t overruns;
+  uint64_t underruns;
+  uint64_t frames_pushed;
+  uint64_t frames_pulled;
+  uint64_t min_fill;
+  uint64_t max_fill;
+};
+
+/**
+ * An index set for shared state fields. The consumer owns the first cache
+ * line and the producer owns the second one; each side keeps a private copy
+ * of the opposite index on its own line and only reloads the shared one when
+ * the queue looks empty (consumer) or full (producer).
+ * Every slot is 8 bytes wide: a 32-bit index in the default mode, a 64-bit
+ * counter with FREE_QUEUE_POW2.
+ * @enum {number}
+ */
+enum FreeQueueState {
+  /** @type {number} A shared index for reading from the queue. (consumer) */
+  READ = 0,
+  /** @type {number} Last WRITE seen by the consumer. (consumer) */
+  WRITE_CACHED = 2,
+  /** @type {number} A shared index for writing into the queue. (producer) */
+  WRITE = FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} Last READ seen by the producer. (producer) */
+  READ_CACHED = WRITE + 2,
+  /** @type {number} Spin budget of FreeQueueWaitReadable. (consumer) */
+  READ_SPIN = 4,
+  /** @type {number} Spin budget of FreeQueueWaitWritable. (producer) */
+  WRITE_SPIN = WRITE + 4,
+  /** @type {number} Non-zero once FreeQueueClose was called. (control) */
+  CLOSED = 2 * FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} Consumers parked on WRITE. (control) */
+  READ_WAITERS = CLOSED + 2,
+  /** @type {number} Producers parked on READ. (control) */
+  WRITE_WAITERS = CLOSED + 4,
+  /** @type {number} Reads that moved at least one frame. (consumer stats) */
+  STATS_PULLS = 3 * FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} Reads that got fewer frames than asked. (consumer stats) */
+  STATS_UNDERRUNS = STATS_PULLS + 2,
+  /** @type {number} Total frames pulled. (consumer stats) */
+  STATS_FRAMES_PULLED = STATS_PULLS + 4,
+  /** @type {number} Lowest fill level seen by the consumer. (consumer stats) */
+  STATS_MIN_FILL = STATS_PULLS + 6,
+  /** @type {number} Writes that moved at least one frame. (producer stats) */
+  STATS_PUSHES = 4 * FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} Writes that found less room than asked. (producer stats) */
+  STATS_OVERRUNS = STATS_PUSHES + 2,
+  /** @type {number} Total frames pushed. (producer stats) */
+  STATS_FRAMES_PUSHED = STATS_PUSHES + 4,
+  /** @type {number} Highest fill level seen by the producer. (producer stats) */
+  STATS_MAX_FILL = STATS_PUSHES + 6
+};
+
+ /**
+ * Latency histogram: 8 linear buckets below 8 ns, then 8 sub-buckets per
+ * power of two (at most 12.5% relative error) up to 2^40 ns.
+ */
+#define FREE_QUEUE_LATENCY_BUCKETS 304
+
+/** Outstanding push stamps; further pushes go unstamped until reads catch up. */
+#define FREE_QUEUE_LATENCY_STAMPS 256
+
+/**
+ * 32-bit word indices of the latency block of a FREE_QUEUE_LATENCY queue.
+ * All counters are 64-bit slots. Stamps are {frame position, time in ms as
+ * a double} pairs: the position is the total of frames pushed once the
+ * stamped write was committed, the time is _nowMs(). In wasm that is
+ * emscripten_get_now(), i.e. performance.timeOrigin + performance.now() in
+ * pthread builds, which is also the clock of the JS class.
+ */
+enum FreeQueueLatencyState {
+  /** @type {number} Stamps written. (producer) */
+  LATENCY_STAMP_WRITE = 0,
+  /** @type {number} Pushes left unstamped because the ring was full. (producer) */
+  LATENCY_DROPS = 2,
+  /** @type {number} Stamps consumed. (consumer) */
+  LATENCY_STAMP_READ = FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} Residency samples recorded. (consumer) */
+  LATENCY_SAMPLES = LATENCY_STAMP_READ + 2,
+  /** @type {number} Largest residency in ns. (consumer) */
+  LATENCY_MAX = LATENCY_STAMP_READ + 4,
+  /** @type {number} First of FREE_QUEUE_LATENCY_BUCKETS counters. (consumer) */
+  LATENCY_HISTOGRAM = 2 * FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} First of FREE_QUEUE_LATENCY_STAMPS stamps. (producer) */
+  LATENCY_STAMPS = LATENCY_HISTOGRAM + 2 * FREE_QUEUE_LATENCY_BUCKETS
+};
+
+/** Number of 32-bit words in the latency block. */
+#define FREE_QUEUE_LATENCY_LENGTH (LATENCY_STAMPS + 4 * FREE_QUEUE_LATENCY_STAMPS)
+
+/** "FREQ" as a little-endian word; first word of every queue block. */
+#define FREE_QUEUE_MAGIC 0x51455246u
+
+/** Bumped whenever the block layout changes incompatibly. */
+#define FREE_QUEUE_LAYOUT_VERSION 1
+
+/** Number of 32-bit words in the block header (one cache line). */
+#define FREE_QUEUE_HEADER_LENGTH (FREE_QUEUE_CACHE_LINE / sizeof(uint32_t))
+
+/**
+ * Word indices of the header at the start of a queue block. A queue is one
+ * contiguous, cache-line-aligned block: this header, the state block, the
+ * latency block (with FREE_QUEUE_LATENCY) and one line-aligned span per
+ * channel. Offsets are in bytes from the start of the block, so anyone
+ * holding the base address (C) or the SharedArrayBuffer and its offset (JS)
+ * can attach without further pointers.
+ * @enum {number}
+ */
+enum FreeQueueHeader {
+  /** @type {number} FREE_QUEUE_MAGIC. */
+  HEADER_MAGIC = 0,
+  /** @type {number} FREE_QUEUE_LAYOUT_VERSION. */
+  HEADER_VERSION = 1,
+  /** @type {number} Size of the whole block in bytes. */
+  HEADER_BYTES = 2,
+  /** @type {number} Ring length in frames (capacity + 1 without POW2). */
+  HEADER_BUFFER_LENGTH = 3,
+  HEADER_CHANNEL_COUNT = 4,
+  /** @type {number} FreeQueueSampleType. */
+  HEADER_SAMPLE_TYPE = 5,
+  /** @type {number} FreeQueueFlags. */
+  HEADER_FLAGS = 6,
+  /** @type {number} Offset of the FreeQueueState block. */
+  HEADER_STATE_OFFSET = 7,
+  /** @type {number} Offset of the FreeQueueLatencyState block, or 0. */
+  HEADER_LATENCY_OFFSET = 8,
+  /** @type {number} Offset of channel 0. */
+  HEADER_CHANNEL_OFFSET = 9,
+  /** @type {number} Bytes from one channel to the next. */
+  HEADER_CHANNEL_STRIDE = 10
+};
+
+template <typename T>
+uint32_t _getAvailableRead(
+  FreeQueue<T> *queue, 
+  uint32_t read_index, 
+  uint32_t write_index
+) {  
+  if (write_index >= read_index)
+    return write_index - read_index;
+  
+  return write_index + queue->buffer_length - read_index;
+}
+
+template <typename T>
+uint32_t _getAvailableWrite(
+  FreeQueue<T> *queue, 
+  uint32_t read_index, 
+  uint32_t write_index
+) {
+  if (write_index >= read_index)
+    return queue->buffer_length - write_index + read_index - 1;
+  return read_index - write_index - 1;
+}
+
+/** 64-bit view of a state slot, used with FREE_QUEUE_POW2. */
+static inline std::atomic<uint64_t> *_counter(std::atomic_uint *state, int index) {
+  return (std::atomic<uint64_t> *)(state + index);
+}
+
+/** Adds to a statistics slot. Stats have a single writer, so no RMW. */
+static inline void _statAdd(std::atomic_uint *state, int index, uint64_t value) {
+  std::atomic<uint64_t> *slot = _counter(state, index);
+  std::atomic_store_explicit(slot, 
+      std::atomic_load_explicit(slot, std::memory_order_relaxed) + value, 
+      std::memory_order_relaxed);
+}
+
+static inline void _statMin(std::atomic_uint *state, int index, uint64_t value) {
+  std::atomic<uint64_t> *slot = _counter(state, index);
+  if (value < std::atomic_load_explicit(slot, std::memory_order_relaxed)) {
+    std::atomic_store_explicit(slot, value, std::memory_order_relaxed);
+  }
+}
+
+static inline void _statMax(std::atomic_uint *state, int index, uint64_t value) {
+  std::atomic<uint64_t> *slot = _counter(state, index);
+  if (value > std::atomic_load_explicit(slot, std::memory_order_relaxed)) {
+    std::atomic_store_explicit(slot, value, std::memory_order_relaxed);
+  }
+}
+
+/** Monotonic time in milliseconds. */
+static inline double _nowMs() {
+#ifdef __EMSCRIPTEN__
+  return emscripten_get_now();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static inline uint32_t _latencyBucket(uint64_t ns) {
+  if (ns < 8) return (uint32_t)ns;
+  uint32_t exponent = 63 - __builtin_clzll(ns);
+  uint32_t index = (exponent - 2) * 8 + (uint32_t)((ns >> (exponent - 3)) & 7);
+  return index < FREE_QUEUE_LATENCY_BUCKETS ? index : FREE_QUEUE_LATENCY_BUCKETS - 1;
+}
+
+/** Smallest value in ns that falls into bucket |index|. */
+static inline uint64_t _latencyBucketLow(uint32_t index) {
+  if (index < 8) return index;
+  return (uint64_t)(8 + index % 8) << (index / 8 - 1);
+}
+
+/**
+ * Stamps the write that just brought the frames pushed to |position|.
+ * Producer side of FREE_QUEUE_LATENCY.
+ */
+static inline void _latencyStamp(std::atomic_uint *latency, uint64_t position) {
+  std::atomic<uint64_t> *write = _counter(latency, LATENCY_STAMP_WRITE);
+  uint64_t stamp = std::atomic_load_explicit(write, std::memory_order_relaxed);
+  uint64_t read = std::atomic_load_explicit(_counter(latency, LATENCY_STAMP_READ), 
+      std::memory_order_acquire);
+  if (stamp - read >= FREE_QUEUE_LATENCY_STAMPS) {
+    _statAdd(latency, LATENCY_DROPS, 1);
+    return;
+  }
+  int slot = LATENCY_STAMPS + 4 * (int)(stamp % FREE_QUEUE_LATENCY_STAMPS);
+  double now = _nowMs();
+  uint64_t bits;
+  memcpy(&bits, &now, sizeof(bits));
+  std::atomic_store_explicit(_counter(latency, slot), position, std::memory_order_relaxed);
+  std::atomic_store_explicit(_counter(latency, slot + 2), bits, std::memory_order_relaxed);
+  std::atomic_store_explicit(write, stamp + 1, std::memory_order_release);
+}
+
+/**
+ * Records the residency of every stamped write completed by a read that
+ * brought the frames pulled to |position|. Consumer side of
+ * FREE_QUEUE_LATENCY.
+ */
+static inline void _latencyRecord(std::atomic_uint *latency, uint64_t position) {
+  std::atomic<uint64_t> *read = _counter(latency, LATENCY_STAMP_READ);
+  uint64_t stamp = std::atomic_load_explicit(read, std::memory_order_relaxed);
+  uint64_t end = std::atomic_load_explicit(_counter(latency, LATENCY_STAMP_WRITE), 
+      std::memory_order_acquire);
+  double now = 0;
+  for (; stamp < end; stamp++) {
+    int slot = LATENCY_STAMPS + 4 * (int)(stamp % FREE_QUEUE_LATENCY_STAMPS);
+    if (std::atomic_load_explicit(_counter(latency, slot), std::memory_order_relaxed) > position) {
+      break;
+    }
+    uint64_t bits = std::atomic_load_explicit(_counter(latency, slot + 2), 
+        std::memory_order_relaxed);
+    double pushed;
+    memcpy(&pushed, &bits, sizeof(pushed));
+    if (now == 0) now = _nowMs();
+    double ns = (now - pushed) * 1000000.0;
+    uint64_t residency = ns > 0 ? (uint64_t)ns : 0;
+    _statAdd(latency, LATENCY_HISTOGRAM + 2 * _latencyBucket(residency), 1);
+    _statAdd(latency, LATENCY_SAMPLES, 1);
+    _statMax(latency, LATENCY_MAX, residency);
+  }
+  std::atomic_store_explicit(read, stamp, std::memory_order_release);
+}
+
+static inline void _cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Parks the calling thread while |*addr| equals |expected|, for at most
+ * |timeout_ms|. Maps to Atomics.wait in wasm, so JS Atomics.notify on the
+ * same word wakes it. Spurious wakeups are possible.
+ */
+static inline void _futexWait(std::atomic_uint *addr, uint32_t expected, double timeout_ms) {
+#ifdef __EMSCRIPTEN__
+  emscripten_futex_wait((volatile void *)addr, expected, timeout_ms);
+#elif defined(__linux__)
+  struct timespec ts, *tsp = nullptr;
+  if (timeout_ms != INFINITY) {
+    ts.tv_sec = (time_t)(timeout_ms / 1000);
+    ts.tv_nsec = (long)((timeout_ms - ts.tv_sec * 1000.0) * 1000000.0);
+    tsp = &ts;
+  }
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, tsp, nullptr, 0);
+#else
+  if (std::atomic_load_explicit(addr, std::memory_order_relaxed) == expected) {
+    usleep(timeout_ms < 1.0 ? (useconds_t)(timeout_ms * 1000) : 1000);
+  }
+#endif
+}
+
+static inline void _futexWake(std::atomic_uint *addr) {
+#ifdef __EMSCRIPTEN__
+  emscripten_futex_wake((volatile void *)addr, INT_MAX);
+#elif defined(__linux__)
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+/**
+ * Wakes threads parked on |index| if the control line says there are any.
+ * The seq_cst fence pairs with the one in _wait so either the waiter sees
+ * the new index or the notifier sees the waiter.
+ */
+static inline void _notify(std::atomic_uint *state, int index, int waiters) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (std::atomic_load_explicit(state + waiters, std::memory_order_relaxed) != 0) {
+    _futexWake(state + index);
+  }
+}
+
+template <typename T>
+uint64_t _loadIndex(FreeQueue<T> *queue, int index, std::memory_order order) {
+  if (queue->flags & FREE_QUEUE_POW2) {
+    return std::atomic_load_explicit(_counter(queue->state, index), order);
+  }
+  return std::atomic_load_explicit(queue->state + index, order);
+}
+
+template <typename T>
+void _storeIndex(FreeQueue<T> *queue, int index, uint64_t value, std::memory_order order) {
+  if (queue->flags & FREE_QUEUE_POW2) {
+    std::atomic_store_explicit(_counter(queue->state, index), value, order);
+  } else {
+    std::atomic_store_explicit(queue->state + index, (uint32_t)value, order);
+  }
+}
+
+template <typename T>
+size_t _framesReadable(FreeQueue<T> *queue, uint64_t read_index, uint64_t write_index) {
+  if (queue->flags & FREE_QUEUE_POW2) return write_index - read_index;
+  return _getAvailableRead(queue, read_index, write_index);
+}
+
+template <typename T>
+size_t _framesWritable(FreeQueue<T> *queue, uint64_t read_index, uint64_t write_index) {
+  if (queue->flags & FREE_QUEUE_POW2) {
+    return queue->buffer_length - (write_index - read_index);
+  }
+  return _getAvailableWrite(queue, read_index, write_index);
+}
+
+/** Ring offset of an index (a wrapped index or a free-running counter). */
+template <typename T>
+size_t _offset(FreeQueue<T> *queue, uint64_t index) {
+  if (queue->flags & FREE_QUEUE_POW2) return index & (queue->buffer_length - 1);
+  return index;
+}
+
+template <typename T>
+uint64_t _advance(FreeQueue<T> *queue, uint64_t index, size_t length) {
+  uint64_t next = index + length;
+  if (!(queue->flags & FREE_QUEUE_POW2) && next >= queue->buffer_length) {
+    next -= queue->buffer_length;
+  }
+  return next;
+}
+
+template <typename T>
+void _setWindow(FreeQueue<T> *queue, uint64_t index, size_t length, 
+    struct FreeQueueWindow *window) {
+  window->offset = _offset(queue, index);
+  window->first = queue->buffer_length - window->offset;
+  if (window->first > length) window->first = length;
+  window->second = length - window->first;
+}
+
+/** First sample of a caller's channel, given as a pointer or a std::span. */
+template <typename T>
+inline T *_channelData(T *data) { return data; }
+template <typename T, size_t N>
+inline T *_channelData(std::span<T, N> data) { return data.data(); }
+
+/**
+ * Copies between the ring and per-channel caller buffers. |Channels| is the
+ * channel count when it is known at compile time (FreeQueueRing), so the
+ * channel loop unrolls; 0 takes it from |queue->channel_count|.
+ */
+template <size_t Channels = 0, typename T, typename Source>
+void _copyIn(FreeQueue<T> *queue, struct FreeQueueWindow *window, const Source &input) {
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    const T *source = _channelData(input[channel]);
+    memcpy(queue->channel_data[channel] + window->offset, source, 
+        window->first * sizeof(T));
+    memcpy(queue->channel_data[channel], source + window->first, 
+        window->second * sizeof(T));
+  }
+}
+
+template <size_t Channels = 0, typename T, typename Sink>
+void _copyOut(FreeQueue<T> *queue, struct FreeQueueWindow *window, const Sink &output) {
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    T *sink = _channelData(output[channel]);
+    memcpy(sink, queue->channel_data[channel] + window->offset, 
+        window->first * sizeof(T));
+    memcpy(sink + window->first, queue->channel_data[channel], 
+        window->second * sizeof(T));
+  }
+}
+
+/** Number of frames the queue can hold. */
+template <typename T>
+size_t _capacity(FreeQueue<T> *queue) {
+  if (queue->flags & FREE_QUEUE_POW2) return queue->buffer_length;
+  return queue->buffer_length - 1;
+}
+
+inline size_t _alignToLine(size_t bytes) {
+  return (bytes + FREE_QUEUE_CACHE_LINE - 1) & ~(size_t)(FREE_QUEUE_CACHE_LINE - 1);
+}
+
+inline size_t _sampleSize(uint32_t sample_type) {
+  switch (sample_type) {
+    case FREE_QUEUE_FLOAT64: return sizeof(double);
+    case FREE_QUEUE_FLOAT32: return sizeof(float);
+    case FREE_QUEUE_INT16: return sizeof(int16_t);
+    case FREE_QUEUE_INT32: return sizeof(int32_t);
+  }
+  return 0;
+}
+
+/**
+ * Fills |header| (FREE_QUEUE_HEADER_LENGTH words) with the layout of a
+ * queue holding |length| frames.
+ * @return {size_t} Size of the block in bytes, or 0 for a bad sample type
+ *   or a block too large for the header's 32-bit offsets.
+ */
+inline size_t _freeQueueLayout(uint32_t *header, size_t length, size_t channel_count, 
+    uint32_t sample_type, uint32_t flags) {
+  size_t sample_size = _sampleSize(sample_type);
+  if (sample_size == 0 || length >= UINT32_MAX / sample_size) return 0;
+  size_t buffer_length = length + 1;
+  if (flags & FREE_QUEUE_POW2) {
+    buffer_length = 1;
+    while (buffer_length < length) buffer_length <<= 1;
+  }
+  uint64_t channel_bytes = (uint64_t)buffer_length * sample_size;
+  if (channel_bytes > UINT32_MAX - FREE_QUEUE_CACHE_LINE) return 0;
+  size_t state_offset = FREE_QUEUE_HEADER_LENGTH * sizeof(uint32_t);
+  size_t latency_offset = state_offset + FREE_QUEUE_STATE_LENGTH * sizeof(uint32_t);
+  size_t channel_offset = latency_offset;
+  if (flags & FREE_QUEUE_LATENCY) {
+    channel_offset += _alignToLine(FREE_QUEUE_LATENCY_LENGTH * sizeof(uint32_t));
+  } else {
+    latency_offset = 0;
+  }
+  size_t stride = _alignToLine((size_t)channel_bytes);
+  if (channel_count > (UINT32_MAX - channel_offset) / stride) return 0;
+  memset(header, 0, FREE_QUEUE_HEADER_LENGTH * sizeof(uint32_t));
+  header[HEADER_MAGIC] = FREE_QUEUE_MAGIC;
+  header[HEADER_VERSION] = FREE_QUEUE_LAYOUT_VERSION;
+  header[HEADER_BYTES] = (uint32_t)(channel_offset + channel_count * stride);
+  header[HEADER_BUFFER_LENGTH] = (uint32_t)buffer_length;
+  header[HEADER_CHANNEL_COUNT] = (uint32_t)channel_count;
+  header[HEADER_SAMPLE_TYPE] = sample_type;
+  header[HEADER_FLAGS] = flags;
+  header[HEADER_STATE_OFFSET] = (uint32_t)state_offset;
+  header[HEADER_LATENCY_OFFSET] = (uint32_t)latency_offset;
+  header[HEADER_CHANNEL_OFFSET] = (uint32_t)channel_offset;
+  header[HEADER_CHANNEL_STRIDE] = (uint32_t)stride;
+  return channel_offset + channel_count * stride;
+}
+
+/**
+ * Lays out an empty queue in the |bytes| at |base|, which must be aligned
+ * to FREE_QUEUE_CACHE_LINE. The magic is written last, so a concurrent
+ * attach either sees a complete block or none.
+ * @return {size_t} Bytes used, or 0 if the block does not fit.
+ */
+inline size_t _initFreeQueueBlock(void *base, size_t bytes, size_t length, 
+    size_t channel_count, uint32_t sample_type, uint32_t flags) {
+  uint32_t header[FREE_QUEUE_HEADER_LENGTH];
+  size_t needed = _freeQueueLayout(header, length, channel_count, sample_type, flags);
+  if (base == nullptr || needed == 0 || needed > bytes || 
+      ((uintptr_t)base & (FREE_QUEUE_CACHE_LINE - 1)) != 0) {
+    return 0;
+  }
+  memset(base, 0, needed);
+  memcpy((uint32_t *)base + 1, header + 1, (FREE_QUEUE_HEADER_LENGTH - 1) * sizeof(uint32_t));
+  size_t capacity = (flags & FREE_QUEUE_POW2) 
+      ? header[HEADER_BUFFER_LENGTH] : header[HEADER_BUFFER_LENGTH] - 1;
+  std::atomic_uint *state = (std::atomic_uint *)((char *)base + header[HEADER_STATE_OFFSET]);
+  std::atomic_store_explicit(_counter(state, STATS_MIN_FILL), (uint64_t)capacity, 
+      std::memory_order_relaxed);
+  std::atomic_store_explicit((std::atomic_uint *)base + HEADER_MAGIC, FREE_QUEUE_MAGIC, 
+      std::memory_order_release);
+  return needed;
+}
+
+/**
+ * Builds a process-local handle on the queue block at |base|. Only the
+ * header is trusted, so this works on blocks made by another thread, module
+ * or the JS constructor.
+ * @return {FreeQueue<T>*} nullptr if |base| holds no queue of this version
+ *   or the handle cannot be allocated.
+ */
+template <typename T>
+FreeQueue<T> *_attachFreeQueue(void *base) {
+  if (base == nullptr) return nullptr;
+  uint32_t *header = (uint32_t *)base;
+  if (std::atomic_load_explicit((std::atomic_uint *)header + HEADER_MAGIC, 
+          std::memory_order_acquire) != FREE_QUEUE_MAGIC || 
+      header[HEADER_VERSION] != FREE_QUEUE_LAYOUT_VERSION) {
+    return nullptr;
+  }
+  size_t channel_count = header[HEADER_CHANNEL_COUNT];
+  // the channel pointer array lives right behind the handle
+  FreeQueue<T> *queue = (FreeQueue<T> *)malloc(
+      sizeof(FreeQueue<T>) + channel_count * sizeof(T *));
+  if (queue == nullptr) return nullptr;
+  queue->buffer_length = header[HEADER_BUFFER_LENGTH];
+  queue->channel_count = channel_count;
+  queue->sample_type = header[HEADER_SAMPLE_TYPE];
+  queue->flags = header[HEADER_FLAGS];
+  queue->state = (std::atomic_uint *)((char *)base + header[HEADER_STATE_OFFSET]);
+  queue->latency = header[HEADER_LATENCY_OFFSET] 
+      ? (std::atomic_uint *)((char *)base + header[HEADER_LATENCY_OFFSET]) : nullptr;
+  queue->channel_data = (T **)(queue + 1);
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    queue->channel_data[channel] = (T *)((char *)base + header[HEADER_CHANNEL_OFFSET] + 
+        channel * header[HEADER_CHANNEL_STRIDE]);
+  }
+  queue->header = header;
+  queue->owns_block = 0;
+  return queue;
+}
+
+template <typename T>
+FreeQueue<T> *_createFreeQueue(size_t length, size_t channel_count, uint32_t flags) {
+  uint32_t header[FREE_QUEUE_HEADER_LENGTH];
+  size_t bytes = _freeQueueLayout(header, length, channel_count, 
+      FreeQueueSampleTraits<T>::type, flags);
+  if (bytes == 0) return nullptr;
+  void *base = aligned_alloc(FREE_QUEUE_CACHE_LINE, bytes);
+  if (base == nullptr) return nullptr;
+  _initFreeQueueBlock(base, bytes, length, channel_count, FreeQueueSampleTraits<T>::type, flags);
+  FreeQueue<T> *queue = _attachFreeQueue<T>(base);
+  if (queue == nullptr) {
+    free(base);
+    return nullptr;
+  }
+  queue->owns_block = 1;
+  return queue;
+}
+
+/** "REGN" as a little-endian word; first word of a queue region. */
+#define FREE_QUEUE_REGION_MAGIC 0x4e474552u
+
+/** Directory entries of a region; queues past this are not listed. */
+#define FREE_QUEUE_REGION_ENTRIES 16
+
+/**
+ * Word indices of the header of a queue region: a span of shared memory,
+ * e.g. in a WebAssembly.Memory imported by several modules, that queues are
+ * carved from without any module's allocator. The header is one cache line
+ * and the directory of queue offsets is the next one; queue blocks follow.
+ * @enum {number}
+ */
+enum FreeQueueRegionHeader {
+  /** @type {number} FREE_QUEUE_REGION_MAGIC. */
+  REGION_MAGIC = 0,
+  /** @type {number} FREE_QUEUE_LAYOUT_VERSION. */
+  REGION_VERSION = 1,
+  /** @type {number} Size of the region in bytes. */
+  REGION_BYTES = 2,
+  /** @type {number} Bytes handed out so far, including both header lines. */
+  REGION_USED = 3,
+  /** @type {number} Queues allocated. */
+  REGION_COUNT = 4,
+  /** @type {number} Byte offsets of the first FREE_QUEUE_REGION_ENTRIES queues. */
+  REGION_DIRECTORY = FREE_QUEUE_CACHE_LINE / sizeof(uint32_t)
+};
+
+/**
+ * Formats |bytes| of memory at |base| (cache-line aligned) as an empty
+ * region.
+ * @return {bool} False if the span is misaligned or too small.
+ */
+inline bool _initFreeQueueRegion(void *base, size_t bytes) {
+  size_t used = 2 * FREE_QUEUE_CACHE_LINE;
+  if (base == nullptr || bytes < used || bytes > UINT32_MAX || 
+      ((uintptr_t)base & (FREE_QUEUE_CACHE_LINE - 1)) != 0) {
+    return false;
+  }
+  memset(base, 0, used);
+  std::atomic_uint *region = (std::atomic_uint *)base;
+  std::atomic_store_explicit(region + REGION_VERSION, (unsigned int)FREE_QUEUE_LAYOUT_VERSION, 
+      std::memory_order_relaxed);
+  std::atomic_store_explicit(region + REGION_BYTES, (unsigned int)bytes, std::memory_order_relaxed);
+  std::atomic_store_explicit(region + REGION_USED, (unsigned int)used, std::memory_order_relaxed);
+  std::atomic_store_explicit(region + REGION_MAGIC, FREE_QUEUE_REGION_MAGIC, 
+      std::memory_order_release);
+  return true;
+}
+
+inline bool _isFreeQueueRegion(void *base) {
+  std::atomic_uint *region = (std::atomic_uint *)base;
+  return base != nullptr && 
+      std::atomic_load_explicit(region + REGION_MAGIC, std::memory_order_acquire) == 
+          FREE_QUEUE_REGION_MAGIC && 
+      std::atomic_load_explicit(region + REGION_VERSION, std::memory_order_relaxed) == 
+          FREE_QUEUE_LAYOUT_VERSION;
+}
+
+/**
+ * Carves a queue out of a region. Safe to call from several threads or
+ * modules at once: space is claimed with a CAS on REGION_USED and the
+ * directory entry is only published once the block is initialized.
+ * Space is never returned to the region.
+ * @return {size_t} Byte offset of the queue block from |base|, 0 if the
+ *   region is full or invalid.
+ */
+inline size_t _createFreeQueueInRegion(void *base, size_t length, size_t channel_count, 
+    uint32_t sample_type, uint32_t flags) {
+  if (!_isFreeQueueRegion(base)) return 0;
+  std::atomic_uint *region = (std::atomic_uint *)base;
+  uint32_t header[FREE_QUEUE_HEADER_LENGTH];
+  size_t bytes = _alignToLine(_freeQueueLayout(header, length, channel_count, sample_type, flags));
+  if (bytes == 0) return 0;
+  uint32_t limit = std::atomic_load_explicit(region + REGION_BYTES, std::memory_order_relaxed);
+  unsigned int offset = std::atomic_load_explicit(region + REGION_USED, std::memory_order_relaxed);
+  do {
+    if (offset + bytes > limit) return 0;
+  } while (!std::atomic_compare_exchange_weak_explicit(region + REGION_USED, &offset, 
+      (unsigned int)(offset + bytes), std::memory_order_relaxed, std::memory_order_relaxed));
+  _initFreeQueueBlock((char *)base + offset, bytes, length, channel_count, sample_type, flags);
+  unsigned int index = std::atomic_fetch_add(region + REGION_COUNT, 1u);
+  if (index < FREE_QUEUE_REGION_ENTRIES) {
+    std::atomic_store_explicit(region + REGION_DIRECTORY + index, offset, 
+        std::memory_order_release);
+  }
+  return offset;
+}
+
+/**
+ * @return {size_t} Byte offset of the |index|th queue of a region, 0 if it
+ *   does not exist (yet).
+ */
+inline size_t _freeQueueRegionEntry(void *base, uint32_t index) {
+  if (!_isFreeQueueRegion(base) || index >= FREE_QUEUE_REGION_ENTRIES) return 0;
+  return std::atomic_load_explicit((std::atomic_uint *)base + REGION_DIRECTORY + index, 
+      std::memory_order_acquire);
+}
+
+/** Frees the handle, and the block if the handle created it. */
+template <typename T>
+void _destroyFreeQueue(FreeQueue<T> *queue) {
+  if ( queue != nullptr ) {
+    if (queue->owns_block) free(queue->header);
+    free(queue);
+  }
+}
+
+/**
+ * Reserves up to |length| frames of free space for the producer. The cached
+ * READ is only refreshed when it cannot satisfy the request.
+ * @return {size_t} Number of frames reserved; |window| describes them.
+ */
+template <typename T>
+size_t _beginWrite(FreeQueue<T> *queue, size_t length, struct FreeQueueWindow *window) {
+  uint64_t current_write = _loadIndex(queue, WRITE, std::memory_order_relaxed);
+  uint64_t current_read = _loadIndex(queue, READ_CACHED, std::memory_order_relaxed);
+  bool refreshed = false;
+  if (_framesWritable(queue, current_read, current_write) < length) {
+    current_read = _loadIndex(queue, READ, std::memory_order_acquire);
+    _storeIndex(queue, READ_CACHED, current_read, std::memory_order_relaxed);
+    refreshed = true;
+  }
+  size_t available = _framesWritable(queue, current_read, current_write);
+  if (length > available) {
+    length = available;
+    _statAdd(queue->state, STATS_OVERRUNS, 1);
+  }
+  if (refreshed) {
+    _statMax(queue->state, STATS_MAX_FILL, _capacity(queue) - available);
+  }
+  _setWindow(queue, current_write, length, window);
+  return length;
+}
+
+/** Publishes |length| frames written after _beginWrite. */
+template <typename T>
+void _commitWrite(FreeQueue<T> *queue, size_t length) {
+  uint64_t current_write = _loadIndex(queue, WRITE, std::memory_order_relaxed);
+  if (queue->latency != nullptr && length > 0) {
+    // stamp before publishing, so no read can complete an unstamped block
+    _latencyStamp(queue->latency, length + std::atomic_load_explicit(
+        _counter(queue->state, STATS_FRAMES_PUSHED), std::memory_order_relaxed));
+  }
+  _storeIndex(queue, WRITE, _advance(queue, current_write, length), 
+      std::memory_order_release);
+  if (length > 0) {
+    _statAdd(queue->state, STATS_PUSHES, 1);
+    _statAdd(queue->state, STATS_FRAMES_PUSHED, length);
+  }
+  _notify(queue->state, WRITE, READ_WAITERS);
+}
+
+/**
+ * Exposes up to |length| readable frames to the consumer. The cached WRITE
+ * is only refreshed when it cannot satisfy the request.
+ * @return {size_t} Number of frames exposed; |window| describes them.
+ */
+template <typename T>
+size_t _beginRead(FreeQueue<T> *queue, size_t length, struct FreeQueueWindow *window) {
+  uint64_t current_read = _loadIndex(queue, READ, std::memory_order_relaxed);
+  uint64_t current_write = _loadIndex(queue, WRITE_CACHED, std::memory_order_relaxed);
+  if (_framesReadable(queue, current_read, current_write) < length) {
+    current_write = _loadIndex(queue, WRITE, std::memory_order_acquire);
+    _storeIndex(queue, WRITE_CACHED, current_write, std::memory_order_relaxed);
+    _statMin(queue->state, STATS_MIN_FILL, 
+        _framesReadable(queue, current_read, current_write));
+  }
+  size_t available = _framesReadable(queue, current_read, current_write);
+  if (length > available) {
+    length = available;
+    _statAdd(queue->state, STATS_UNDERRUNS, 1);
+  }
+  _setWindow(queue, current_read, length, window);
+  return length;
+}
+
+/** Releases |length| frames consumed after _beginRead. */
+template <typename T>
+void _commitRead(FreeQueue<T> *queue, size_t length) {
+  uint64_t current_read = _loadIndex(queue, READ, std::memory_order_relaxed);
+  _storeIndex(queue, READ, _advance(queue, current_read, length), 
+      std::memory_order_release);
+  if (length > 0) {
+    _statAdd(queue->state, STATS_PULLS, 1);
+    _statAdd(queue->state, STATS_FRAMES_PULLED, length);
+    if (queue->latency != nullptr) {
+      _latencyRecord(queue->latency, std::atomic_load_explicit(
+          _counter(queue->state, STATS_FRAMES_PULLED), std::memory_order_relaxed));
+    }
+  }
+  _notify(queue->state, READ, WRITE_WAITERS);
+}
+
+template <typename T>
+bool _isReadable(FreeQueue<T> *queue, size_t frames) {
+  return _framesReadable(queue, 
+      _loadIndex(queue, READ, std::memory_order_relaxed), 
+      _loadIndex(queue, WRITE, std::memory_order_acquire)) >= frames;
+}
+
+template <typename T>
+bool _isWritable(FreeQueue<T> *queue, size_t frames) {
+  return _framesWritable(queue, 
+      _loadIndex(queue, READ, std::memory_order_acquire), 
+      _loadIndex(queue, WRITE, std::memory_order_relaxed)) >= frames;
+}
+
+/**
+ * Blocks until |ready(queue, frames)| holds, the queue is closed or
+ * |timeout_ms| elapses (negative or INFINITY waits forever). Spins first for
+ * an adaptive budget kept in |spin| (doubled after a spin hit, halved after
+ * a miss), then parks on the low word of the opposite index |index|,
+ * advertising itself in |waiters|.
+ * @return {int} 1 when ready, 0 on timeout, -1 when the queue is closed.
+ */
+template <typename T>
+int _wait(FreeQueue<T> *queue, size_t frames, double timeout_ms, 
+    bool (*ready)(FreeQueue<T> *, size_t), int index, int waiters, int spin) {
+  std::atomic_uint *state = queue->state;
+  double deadline = timeout_ms < 0 ? INFINITY : _nowMs() + timeout_ms;
+  uint32_t budget = std::atomic_load_explicit(state + spin, std::memory_order_relaxed);
+  if (budget < FREE_QUEUE_SPIN_MIN) budget = FREE_QUEUE_SPIN_MIN;
+  for (uint32_t i = 0; i < budget; i++) {
+    if (ready(queue, frames)) {
+      uint32_t next = 2 * budget;
+      std::atomic_store_explicit(state + spin, 
+          next > FREE_QUEUE_SPIN_MAX ? FREE_QUEUE_SPIN_MAX : next, std::memory_order_relaxed);
+      return 1;
+    }
+    if (std::atomic_load_explicit(state + CLOSED, std::memory_order_relaxed)) return -1;
+    _cpuRelax();
+  }
+  std::atomic_store_explicit(state + spin, budget / 2, std::memory_order_relaxed);
+  while (true) {
+    uint32_t observed = std::atomic_load_explicit(state + index, std::memory_order_relaxed);
+    std::atomic_fetch_add_explicit(state + waiters, 1u, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool is_ready = ready(queue, frames);
+    bool is_closed = std::atomic_load_explicit(state + CLOSED, std::memory_order_relaxed) != 0;
+    double remaining = deadline - _nowMs();
+    if (!is_ready && !is_closed && remaining > 0) {
+      _futexWait(state + index, observed, remaining);
+    }
+    std::atomic_fetch_sub_explicit(state + waiters, 1u, std::memory_order_relaxed);
+    if (is_ready || ready(queue, frames)) return 1;
+    if (is_closed || std::atomic_load_explicit(state + CLOSED, std::memory_order_relaxed)) return -1;
+    if (deadline - _nowMs() <= 0) return 0;
+  }
+}
+
+template <size_t Channels = 0, typename T, typename Source>
+bool _freeQueuePush(FreeQueue<T> *queue, const Source &input, size_t block_length) {
+  if ( queue != nullptr ) {
+    struct FreeQueueWindow window;
+    if (_beginWrite(queue, block_length, &window) < block_length) {
+      return false;
+    }
+    _copyIn<Channels>(queue, &window, input);
+    _commitWrite(queue, block_length);
+    return true;
+  }
+  return false;
+}
+
+template <size_t Channels = 0, typename T, typename Sink>
+bool _freeQueuePull(FreeQueue<T> *queue, const Sink &output, size_t block_length) {
+  if ( queue != nullptr ) {
+    struct FreeQueueWindow window;
+    if (_beginRead(queue, block_length, &window) < block_length) {
+      return false;
+    }
+    _copyOut<Channels>(queue, &window, output);
+    _commitRead(queue, block_length);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Pushes as many of |length| frames as fit.
+ * @return {size_t} Number of frames pushed.
+ */
+template <size_t Channels = 0, typename T, typename Source>
+size_t _freeQueuePushSome(FreeQueue<T> *queue, const Source &input, size_t length) {
+  if ( queue != nullptr ) {
+    struct FreeQueueWindow window;
+    size_t frames = _beginWrite(queue, length, &window);
+    if (frames > 0) {
+      _copyIn<Channels>(queue, &window, input);
+      _commitWrite(queue, frames);
+    }
+    return frames;
+  }
+  return 0;
+}
+
+/**
+ * Pulls as many of |length| frames as are available.
+ * @return {size_t} Number of frames pulled.
+ */
+template <size_t Channels = 0, typename T, typename Sink>
+size_t _freeQueuePullSome(FreeQueue<T> *queue, const Sink &output, size_t length) {
+  if ( queue != nullptr ) {
+    struct FreeQueueWindow window;
+    size_t frames = _beginRead(queue, length, &window);
+    if (frames > 0) {
+      _copyOut<Channels>(queue, &window, output);
+      _commitRead(queue, frames);
+    }
+    return frames;
+  }
+  return 0;
+}
+
+/**
+ * Full-scale value of an integer sample type; floating point samples are
+ * nominally in [-1, 1].
+ */
+template <typename T> struct FreeQueueSampleScale;
+template <> struct FreeQueueSampleScale<int16_t> { 
+  static constexpr double value = 32768.0; 
+};
+template <> struct FreeQueueSampleScale<int32_t> { 
+  static constexpr double value = 2147483648.0; 
+};
+
+/**
+ * Converts one sample between storage types: integers are scaled to and
+ * from [-1, 1), float-to-integer rounds to nearest and saturates.
+ */
+template <typename S, typename D>
+inline D _convertSample(S value) {
+  if constexpr (std::is_same<S, D>::value) {
+    return value;
+  } else if constexpr (std::is_floating_point<S>::value && std::is_floating_point<D>::value) {
+    return (D)value;
+  } else if constexpr (std::is_floating_point<D>::value) {
+    return (D)(value * (1.0 / FreeQueueSampleScale<S>::value));
+  } else if constexpr (std::is_floating_point<S>::value) {
+    double scaled = value * FreeQueueSampleScale<D>::value;
+    if (scaled < -FreeQueueSampleScale<D>::value) scaled = -FreeQueueSampleScale<D>::value;
+    if (scaled > FreeQueueSampleScale<D>::value - 1) scaled = FreeQueueSampleScale<D>::value - 1;
+    return (D)lrint(scaled);
+  } else if constexpr (sizeof(S) < sizeof(D)) {
+    return (D)value * (D)65536;
+  } else {
+    return (D)(value >> 16);
+  }
+}
+
+/**
+ * Sample conversion kernels. The generic versions are scalar; the formats
+ * our producers and sinks actually use have wasm simd128 (-msimd128),
+ * AVX2 (-mavx2) or SSE2 bodies that fall back to the scalar loop for the
+ * tail.
+ */
+template <typename S, typename D>
+void _convertSpan(const S *src, D *dst, size_t n) {
+  if constexpr (std::is_same<S, D>::value) {
+    memcpy(dst, src, n * sizeof(D));
+  } else {
+    for (size_t i = 0; i < n; i++) dst[i] = _convertSample<S, D>(src[i]);
+  }
+}
+
+template <>
+inline void _convertSpan<int16_t, float>(const int16_t *src, float *dst, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  const v128_t scale = wasm_f32x4_splat(1.0f / 32768.0f);
+  for (; i + 8 <= n; i += 8) {
+    v128_t v = wasm_v128_load(src + i);
+    wasm_v128_store(dst + i, wasm_f32x4_mul(
+        wasm_f32x4_convert_i32x4(wasm_i32x4_extend_low_i16x8(v)), scale));
+    wasm_v128_store(dst + i + 4, wasm_f32x4_mul(
+        wasm_f32x4_convert_i32x4(wasm_i32x4_extend_high_i16x8(v)), scale));
+  }
+#elif defined(__AVX2__)
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+#elif defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+  }
+#endif
+  for (; i < n; i++) dst[i] = _convertSample<int16_t, float>(src[i]);
+}
+
+#if defined(__wasm_simd128__)
+/** Scales 4 floats to int16 range, saturated and rounded, as int32 lanes. */
+static inline v128_t _toInt16Lanes(v128_t v) {
+  v = wasm_f32x4_mul(v, wasm_f32x4_splat(32768.0f));
+  v = wasm_f32x4_min(wasm_f32x4_max(v, wasm_f32x4_splat(-32768.0f)), wasm_f32x4_splat(32767.0f));
+  return wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_nearest(v));
+}
+#elif defined(__SSE2__)
+static inline __m128i _toInt16Lanes(__m128 v) {
+  v = _mm_mul_ps(v, _mm_set1_ps(32768.0f));
+  v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+  return _mm_cvtps_epi32(v);
+}
+#endif
+
+template <>
+inline void _convertSpan<float, int16_t>(const float *src, int16_t *dst, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  for (; i + 8 <= n; i += 8) {
+    wasm_v128_store(dst + i, wasm_i16x8_narrow_i32x4(
+        _toInt16Lanes(wasm_v128_load(src + i)), _toInt16Lanes(wasm_v128_load(src + i + 4))));
+  }
+#elif defined(__SSE2__)
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(
+        _toInt16Lanes(_mm_loadu_ps(src + i)), _toInt16Lanes(_mm_loadu_ps(src + i + 4))));
+  }
+#endif
+  for (; i < n; i++) dst[i] = _convertSample<float, int16_t>(src[i]);
+}
+
+template <>
+inline void _convertSpan<float, double>(const float *src, double *dst, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  for (; i + 4 <= n; i += 4) {
+    v128_t v = wasm_v128_load(src + i);
+    wasm_v128_store(dst + i, wasm_f64x2_promote_low_f32x4(v));
+    wasm_v128_store(dst + i + 2, wasm_f64x2_promote_low_f32x4(wasm_i64x2_shuffle(v, v, 1, 0)));
+  }
+#elif defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(dst + i, _mm256_cvtps_pd(_mm_loadu_ps(src + i)));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_loadu_ps(src + i);
+    _mm_storeu_pd(dst + i, _mm_cvtps_pd(v));
+    _mm_storeu_pd(dst + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+  }
+#endif
+  for (; i < n; i++) dst[i] = (double)src[i];
+}
+
+template <>
+inline void _convertSpan<double, float>(const double *src, float *dst, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  for (; i + 4 <= n; i += 4) {
+    v128_t low = wasm_f32x4_demote_f64x2_zero(wasm_v128_load(src + i));
+    v128_t high = wasm_f32x4_demote_f64x2_zero(wasm_v128_load(src + i + 2));
+    wasm_v128_store(dst + i, wasm_i64x2_shuffle(low, high, 0, 2));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 low = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+    __m128 high = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+    _mm_storeu_ps(dst + i, _mm_movelh_ps(low, high));
+  }
+#endif
+  for (; i < n; i++) dst[i] = (float)src[i];
+}
+
+/** Splits |n| interleaved stereo frames into two converted channels. */
+template <typename S, typename D>
+void _deinterleave2(const S *src, D *left, D *right, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    left[i] = _convertSample<S, D>(src[2 * i]);
+    right[i] = _convertSample<S, D>(src[2 * i + 1]);
+  }
+}
+
+template <>
+inline void _deinterleave2<int16_t, float>(const int16_t *src, float *left, float *right, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  const v128_t scale = wasm_f32x4_splat(1.0f / 32768.0f);
+  for (; i + 4 <= n; i += 4) {
+    v128_t v = wasm_v128_load(src + 2 * i);
+    v128_t low = wasm_f32x4_convert_i32x4(wasm_i32x4_extend_low_i16x8(v));
+    v128_t high = wasm_f32x4_convert_i32x4(wasm_i32x4_extend_high_i16x8(v));
+    wasm_v128_store(left + i, wasm_f32x4_mul(wasm_i32x4_shuffle(low, high, 0, 2, 4, 6), scale));
+    wasm_v128_store(right + i, wasm_f32x4_mul(wasm_i32x4_shuffle(low, high, 1, 3, 5, 7), scale));
+  }
+#elif defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    __m128 low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+    __m128 high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    _mm_storeu_ps(left + i, _mm_mul_ps(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)), scale));
+    _mm_storeu_ps(right + i, _mm_mul_ps(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1)), scale));
+  }
+#endif
+  for (; i < n; i++) {
+    left[i] = _convertSample<int16_t, float>(src[2 * i]);
+    right[i] = _convertSample<int16_t, float>(src[2 * i + 1]);
+  }
+}
+
+template <>
+inline void _deinterleave2<float, float>(const float *src, float *left, float *right, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  for (; i + 4 <= n; i += 4) {
+    v128_t low = wasm_v128_load(src + 2 * i);
+    v128_t high = wasm_v128_load(src + 2 * i + 4);
+    wasm_v128_store(left + i, wasm_i32x4_shuffle(low, high, 0, 2, 4, 6));
+    wasm_v128_store(right + i, wasm_i32x4_shuffle(low, high, 1, 3, 5, 7));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 low = _mm_loadu_ps(src + 2 * i);
+    __m128 high = _mm_loadu_ps(src + 2 * i + 4);
+    _mm_storeu_ps(left + i, _mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(right + i, _mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1)));
+  }
+#endif
+  for (; i < n; i++) {
+    left[i] = src[2 * i];
+    right[i] = src[2 * i + 1];
+  }
+}
+
+/** Merges two channels into |n| interleaved, converted stereo frames. */
+template <typename S, typename D>
+void _interleave2(const S *left, const S *right, D *dst, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[2 * i] = _convertSample<S, D>(left[i]);
+    dst[2 * i + 1] = _convertSample<S, D>(right[i]);
+  }
+}
+
+template <>
+inline void _interleave2<float, float>(const float *left, const float *right, float *dst, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  for (; i + 4 <= n; i += 4) {
+    v128_t l = wasm_v128_load(left + i);
+    v128_t r = wasm_v128_load(right + i);
+    wasm_v128_store(dst + 2 * i, wasm_i32x4_shuffle(l, r, 0, 4, 1, 5));
+    wasm_v128_store(dst + 2 * i + 4, wasm_i32x4_shuffle(l, r, 2, 6, 3, 7));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 l = _mm_loadu_ps(left + i);
+    __m128 r = _mm_loadu_ps(right + i);
+    _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+    _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[2 * i] = left[i];
+    dst[2 * i + 1] = right[i];
+  }
+}
+
+template <>
+inline void _interleave2<float, int16_t>(const float *left, const float *right, int16_t *dst, size_t n) {
+  size_t i = 0;
+#if defined(__wasm_simd128__)
+  for (; i + 4 <= n; i += 4) {
+    v128_t l = _toInt16Lanes(wasm_v128_load(left + i));
+    v128_t r = _toInt16Lanes(wasm_v128_load(right + i));
+    wasm_v128_store(dst + 2 * i, wasm_i16x8_narrow_i32x4(
+        wasm_i32x4_shuffle(l, r, 0, 4, 1, 5), wasm_i32x4_shuffle(l, r, 2, 6, 3, 7)));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    __m128i l = _toInt16Lanes(_mm_loadu_ps(left + i));
+    __m128i r = _toInt16Lanes(_mm_loadu_ps(right + i));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), 
+        _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r)));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[2 * i] = _convertSample<float, int16_t>(left[i]);
+    dst[2 * i + 1] = _convertSample<float, int16_t>(right[i]);
+  }
+}
+
+/**
+ * Deinterleaves and converts |n| frames into |dst[c] + offset| for every
+ * channel in a single pass over |src|.
+ */
+template <typename S, typename D>
+inline void _deinterleave(const S *src, size_t channel_count, D **dst, size_t offset, size_t n) {
+  if (channel_count == 1) {
+    _convertSpan(src, dst[0] + offset, n);
+  } else if (channel_count == 2) {
+    _deinterleave2(src, dst[0] + offset, dst[1] + offset, n);
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      for (size_t channel = 0; channel < channel_count; channel++) {
+        dst[channel][offset + i] = _convertSample<S, D>(src[i * channel_count + channel]);
+      }
+    }
+  }
+}
+
+template <typename S, typename D>
+inline void _interleave(S **src, size_t offset, size_t channel_count, D *dst, size_t n) {
+  if (channel_count == 1) {
+    _convertSpan(src[0] + offset, dst, n);
+  } else if (channel_count == 2) {
+    _interleave2(src[0] + offset, src[1] + offset, dst, n);
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      for (size_t channel = 0; channel < channel_count; channel++) {
+        dst[i * channel_count + channel] = _convertSample<S, D>(src[channel][offset + i]);
+      }
+    }
+  }
+}
+
+/**
+ * Pushes |length| frames of format S, interleaved or planar (exactly one
+ * of |interleaved| and |planar| is set), converting straight into the
+ * ring's storage type T.
+ */
+template <size_t Channels = 0, typename S, typename T>
+bool _freeQueuePushConverted(FreeQueue<T> *queue, const S *interleaved, 
+    const S *const *planar, size_t length) {
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  struct FreeQueueWindow window;
+  if (_beginWrite(queue, length, &window) < length) {
+    return false;
+  }
+  if (interleaved != nullptr) {
+    _deinterleave(interleaved, channel_count, queue->channel_data, 
+        window.offset, window.first);
+    _deinterleave(interleaved + window.first * channel_count, channel_count, 
+        queue->channel_data, 0, window.second);
+  } else {
+    for (size_t channel = 0; channel < channel_count; channel++) {
+      _convertSpan(planar[channel], queue->channel_data[channel] + window.offset, window.first);
+      _convertSpan(planar[channel] + window.first, queue->channel_data[channel], window.second);
+    }
+  }
+  _commitWrite(queue, length);
+  return true;
+}
+
+/** Counterpart of _freeQueuePushConverted, converting from T to D. */
+template <size_t Channels = 0, typename T, typename D>
+bool _freeQueuePullConverted(FreeQueue<T> *queue, D *interleaved, D *const *planar, 
+    size_t length) {
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  struct FreeQueueWindow window;
+  if (_beginRead(queue, length, &window) < length) {
+    return false;
+  }
+  if (interleaved != nullptr) {
+    _interleave(queue->channel_data, window.offset, channel_count, 
+        interleaved, window.first);
+    _interleave(queue->channel_data, 0, channel_count, 
+        interleaved + window.first * channel_count, window.second);
+  } else {
+    for (size_t channel = 0; channel < channel_count; channel++) {
+      _convertSpan(queue->channel_data[channel] + window.offset, planar[channel], window.first);
+      _convertSpan(queue->channel_data[channel], planar[channel] + window.first, window.second);
+    }
+  }
+  _commitRead(queue, length);
+  return true;
+}
+
+/** Dispatches on the caller's declared |format|. */
+template <typename T>
+bool _freeQueuePushAs(FreeQueue<T> *queue, const void *interleaved, 
+    const void *const *planar, uint32_t format, size_t length) {
+  switch (format) {
+    case FREE_QUEUE_FLOAT64: return _freeQueuePushConverted(queue, 
+        (const double *)interleaved, (const double *const *)planar, length);
+    case FREE_QUEUE_FLOAT32: return _freeQueuePushConverted(queue, 
+        (const float *)interleaved, (const float *const *)planar, length);
+    case FREE_QUEUE_INT16: return _freeQueuePushConverted(queue, 
+        (const int16_t *)interleaved, (const int16_t *const *)planar, length);
+    case FREE_QUEUE_INT32: return _freeQueuePushConverted(queue, 
+        (const int32_t *)interleaved, (const int32_t *const *)planar, length);
+  }
+  return false;
+}
+
+template <typename T>
+bool _freeQueuePullAs(FreeQueue<T> *queue, void *interleaved, void *const *planar, 
+    uint32_t format, size_t length) {
+  switch (format) {
+    case FREE_QUEUE_FLOAT64: return _freeQueuePullConverted(queue, 
+        (double *)interleaved, (double *const *)planar, length);
+    case FREE_QUEUE_FLOAT32: return _freeQueuePullConverted(queue, 
+        (float *)interleaved, (float *const *)planar, length);
+    case FREE_QUEUE_INT16: return _freeQueuePullConverted(queue, 
+        (int16_t *)interleaved, (int16_t *const *)planar, length);
+    case FREE_QUEUE_INT32: return _freeQueuePullConverted(queue, 
+        (int32_t *)interleaved, (int32_t *const *)planar, length);
+  }
+  return false;
+}
+
+/**
+ * Word indices of the shared state block of a FreeQueueMPMC. The two
+ * position counters sit on their own cache lines; after them come one
+ * sequence word and one frame count per slot.
+ * @enum {number}
+ */
+enum FreeQueueMPMCState {
+  /** @type {number} Next position handed to a producer. (producers) */
+  MPMC_ENQUEUE = 0,
+  /** @type {number} Next position handed to a consumer. (consumers) */
+  MPMC_DEQUEUE = FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} First of |slot_count| slot sequence numbers. */
+  MPMC_SEQUENCE = 2 * FREE_QUEUE_CACHE_LINE / sizeof(uint32_t)
+};
+
+/**
+ * A bounded multi-producer/multi-consumer queue of blocks of up to
+ * |block_length| planar frames (D. Vyukov's sequence-numbered ring). Any
+ * number of threads, C or JS, may push and pull concurrently: a side
+ * claims a position with one CAS on its counter, copies the block in or out
+ * of the slot, then releases the slot through its sequence number, so no
+ * lock is ever taken and a stalled thread only holds up its own slot.
+ *
+ * Slot s serves positions p with p % slot_count == s. Its sequence is p
+ * while it waits for the producer of p, p + 1 once that block is published
+ * and p + slot_count once the block was consumed. Positions and sequences
+ * are 32-bit and compared as signed differences, so wrap-around is fine
+ * and JS can use plain Atomics on a Uint32Array.
+ */
+template <typename T>
+struct FreeQueueMPMC {
+  /** Power of two. */
+  size_t slot_count;
+  size_t block_length;
+  size_t channel_count;
+  /** Slot s of channel c is |channel_data[c][s * block_length, ...)|. */
+  T **channel_data;
+  /** FreeQueueMPMCState block: counters, sequences, then frame counts. */
+  std::atomic_uint *state;
+  uint32_t sample_type;
+};
+
+/** Number of 32-bit words in the state block of a FreeQueueMPMC. */
+inline size_t _mpmcStateLength(size_t slot_count) {
+  return MPMC_SEQUENCE + 2 * slot_count;
+}
+
+template <typename T>
+void _destroyFreeQueueMPMC(FreeQueueMPMC<T> *queue) {
+  if ( queue != nullptr ) {
+    if (queue->channel_data != nullptr) {
+      for (size_t channel = 0; channel < queue->channel_count; channel++) {
+        free(queue->channel_data[channel]);
+      }
+    }
+    free(queue->channel_data);
+    free(queue->state);
+    free(queue);
+  }
+}
+
+/** @return {FreeQueueMPMC<T>*} nullptr when an allocation fails. */
+template <typename T>
+FreeQueueMPMC<T> *_createFreeQueueMPMC(size_t slot_count, size_t block_length, 
+    size_t channel_count) {
+  FreeQueueMPMC<T> *queue = (FreeQueueMPMC<T> *)calloc(1, sizeof(FreeQueueMPMC<T>));
+  if (queue == nullptr) return nullptr;
+  queue->slot_count = 2;
+  while (queue->slot_count < slot_count) queue->slot_count <<= 1;
+  queue->block_length = block_length;
+  queue->channel_count = channel_count;
+  queue->sample_type = FreeQueueSampleTraits<T>::type;
+  size_t state_bytes = _mpmcStateLength(queue->slot_count) * sizeof(uint32_t);
+  state_bytes = (state_bytes + FREE_QUEUE_CACHE_LINE - 1) & ~(size_t)(FREE_QUEUE_CACHE_LINE - 1);
+  queue->state = (std::atomic_uint *)aligned_alloc(FREE_QUEUE_CACHE_LINE, state_bytes);
+  queue->channel_data = (T **)calloc(channel_count, sizeof(T *));
+  if (queue->state == nullptr || queue->channel_data == nullptr) {
+    _destroyFreeQueueMPMC(queue);
+    return nullptr;
+  }
+  memset((void *)queue->state, 0, state_bytes);
+  for (size_t slot = 0; slot < queue->slot_count; slot++) {
+    std::atomic_init(queue->state + MPMC_SEQUENCE + slot, (unsigned int)slot);
+  }
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    queue->channel_data[channel] = (T *)calloc(queue->slot_count * block_length, sizeof(T));
+    if (queue->channel_data[channel] == nullptr) {
+      _destroyFreeQueueMPMC(queue);
+      return nullptr;
+    }
+  }
+  return queue;
+}
+
+/**
+ * Claims the next position of |counter| (MPMC_ENQUEUE or MPMC_DEQUEUE)
+ * whose slot sequence is |position + lag|.
+ * @return {bool} False if the queue is full (producers) or empty (consumers).
+ */
+template <typename T>
+bool _mpmcClaim(FreeQueueMPMC<T> *queue, int counter, uint32_t lag, uint32_t *position) {
+  std::atomic_uint *state = queue->state;
+  uint32_t mask = (uint32_t)queue->slot_count - 1;
+  uint32_t claimed = std::atomic_load_explicit(state + counter, std::memory_order_relaxed);
+  for (;;) {
+    uint32_t sequence = std::atomic_load_explicit(
+        state + MPMC_SEQUENCE + (claimed & mask), std::memory_order_acquire);
+    int32_t difference = (int32_t)(sequence - (claimed + lag));
+    if (difference == 0) {
+      // on failure |claimed| is reloaded with the current counter
+      if (std::atomic_compare_exchange_weak_explicit(state + counter, &claimed, claimed + 1, 
+          std::memory_order_relaxed, std::memory_order_relaxed)) {
+        *position = claimed;
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      claimed = std::atomic_load_explicit(state + counter, std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Pushes one block of |frames| (at most |block_length|) frames.
+ * @return {bool} False if every slot is full or the block is too long.
+ */
+template <size_t Channels = 0, typename T, typename Source>
+bool _freeQueueMPMCPush(FreeQueueMPMC<T> *queue, const Source &input, size_t frames) {
+  uint32_t position;
+  if (queue == nullptr || frames > queue->block_length || 
+      !_mpmcClaim(queue, MPMC_ENQUEUE, 0, &position)) {
+    return false;
+  }
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  size_t slot = position & (queue->slot_count - 1);
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    memcpy(queue->channel_data[channel] + slot * queue->block_length, 
+        _channelData(input[channel]), frames * sizeof(T));
+  }
+  uint32_t *lengths = (uint32_t *)(queue->state + MPMC_SEQUENCE + queue->slot_count);
+  lengths[slot] = (uint32_t)frames;
+  std::atomic_store_explicit(queue->state + MPMC_SEQUENCE + slot, position + 1, 
+      std::memory_order_release);
+  return true;
+}
+
+/**
+ * Pulls the oldest published block into |output|, which must have room for
+ * |block_length| frames.
+ * @return {size_t} Frames in the block; 0 if the queue is empty or
+ *   |length| < |block_length|.
+ */
+template <size_t Channels = 0, typename T, typename Sink>
+size_t _freeQueueMPMCPull(FreeQueueMPMC<T> *queue, const Sink &output, size_t length) {
+  uint32_t position;
+  if (queue == nullptr || length < queue->block_length || 
+      !_mpmcClaim(queue, MPMC_DEQUEUE, 1, &position)) {
+    return 0;
+  }
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  size_t slot = position & (queue->slot_count - 1);
+  const uint32_t *lengths = (const uint32_t *)(queue->state + MPMC_SEQUENCE + queue->slot_count);
+  size_t frames = lengths[slot];
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    memcpy(_channelData(output[channel]), 
+        queue->channel_data[channel] + slot * queue->block_length, frames * sizeof(T));
+  }
+  std::atomic_store_explicit(queue->state + MPMC_SEQUENCE + slot, 
+      position + (uint32_t)queue->slot_count, std::memory_order_release);
+  return frames;
+}
+
+/**
+ * What a FreeQueueBroadcast producer does when the slowest reader leaves
+ * no room for a push.
+ * @enum {number}
+ */
+enum FreeQueueBroadcastPolicy {
+  /** The push fails, as with a full FreeQueue. */
+  FREE_QUEUE_BROADCAST_BLOCK = 0,
+  /** Readers in the way are detached and the push goes ahead. */
+  FREE_QUEUE_BROADCAST_DETACH = 1
+};
+
+/** Status word of a broadcast reader line. */
+enum FreeQueueBroadcastReaderStatus {
+  BROADCAST_FREE = 0,
+  BROADCAST_ACTIVE = 1,
+  BROADCAST_DETACHED = 2,
+  /** Transient while FreeQueueBroadcastAttach sets the line up. */
+  BROADCAST_CLAIMED = 3
+};
+
+/**
+ * Word indices of the shared state block of a FreeQueueBroadcast: the
+ * producer line, then one cache line per reader slot.
+ * @enum {number}
+ */
+enum FreeQueueBroadcastState {
+  /** @type {number} Frames published. (producer) */
+  BROADCAST_WRITE = 0,
+  /** @type {number} End of the frames being written; see _broadcastRead. (producer) */
+  BROADCAST_RESERVE = 2,
+  /** @type {number} Readers detached by FREE_QUEUE_BROADCAST_DETACH. (producer) */
+  BROADCAST_DETACHES = 4,
+  /** @type {number} Line of reader 0; reader r is |r| lines further. */
+  BROADCAST_READERS = FREE_QUEUE_CACHE_LINE / sizeof(uint32_t),
+  /** @type {number} Frames consumed, relative to a reader line. (reader) */
+  BROADCAST_CURSOR = 0,
+  /** @type {number} FreeQueueBroadcastReaderStatus, relative to a reader line. */
+  BROADCAST_STATUS = 2
+};
+
+/**
+ * A single-producer/multi-reader queue: one write is seen by every
+ * attached reader, each of which consumes at its own pace through a
+ * private cursor on its own cache line. The producer may only overwrite
+ * frames that all active readers have consumed, so the slowest reader sets
+ * the writable space; with FREE_QUEUE_BROADCAST_DETACH a reader that would
+ * block a push is detached instead, and sees -1 until it rejoins at the
+ * live edge.
+ *
+ * Counters are free-running 32-bit frame positions on a power-of-two ring,
+ * so the whole capacity is usable and differences survive wrap-around.
+ */
+template <typename T>
+struct FreeQueueBroadcast {
+  /** Power of two. */
+  size_t buffer_length;
+  size_t channel_count;
+  T **channel_data;
+  /** FreeQueueBroadcastState block. */
+  std::atomic_uint *state;
+  uint32_t sample_type;
+  uint32_t max_readers;
+  /** FreeQueueBroadcastPolicy. */
+  uint32_t policy;
+};
+
+/** Number of 32-bit words in the state block of a FreeQueueBroadcast. */
+inline size_t _broadcastStateLength(size_t max_readers) {
+  return BROADCAST_READERS * (1 + max_readers);
+}
+
+template <typename T>
+inline std::atomic_uint *_broadcastReader(FreeQueueBroadcast<T> *queue, uint32_t reader) {
+  return queue->state + BROADCAST_READERS * (1 + reader);
+}
+
+template <typename T>
+void _destroyFreeQueueBroadcast(FreeQueueBroadcast<T> *queue) {
+  if ( queue != nullptr ) {
+    if (queue->channel_data != nullptr) {
+      for (size_t channel = 0; channel < queue->channel_count; channel++) {
+        free(queue->channel_data[channel]);
+      }
+    }
+    free(queue->channel_data);
+    free(queue->state);
+    free(queue);
+  }
+}
+
+/** @return {FreeQueueBroadcast<T>*} nullptr when an allocation fails. */
+template <typename T>
+FreeQueueBroadcast<T> *_createFreeQueueBroadcast(size_t length, size_t channel_count, 
+    uint32_t max_readers, uint32_t policy) {
+  FreeQueueBroadcast<T> *queue = 
+      (FreeQueueBroadcast<T> *)calloc(1, sizeof(FreeQueueBroadcast<T>));
+  if (queue == nullptr) return nullptr;
+  queue->buffer_length = 1;
+  while (queue->buffer_length < length) queue->buffer_length <<= 1;
+  queue->channel_count = channel_count;
+  queue->sample_type = FreeQueueSampleTraits<T>::type;
+  queue->max_readers = max_readers;
+  queue->policy = policy;
+  size_t state_bytes = _broadcastStateLength(max_readers) * sizeof(uint32_t);
+  queue->state = (std::atomic_uint *)aligned_alloc(FREE_QUEUE_CACHE_LINE, state_bytes);
+  queue->channel_data = (T **)calloc(channel_count, sizeof(T *));
+  if (queue->state == nullptr || queue->channel_data == nullptr) {
+    _destroyFreeQueueBroadcast(queue);
+    return nullptr;
+  }
+  memset((void *)queue->state, 0, state_bytes);
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    queue->channel_data[channel] = (T *)calloc(queue->buffer_length, sizeof(T));
+    if (queue->channel_data[channel] == nullptr) {
+      _destroyFreeQueueBroadcast(queue);
+      return nullptr;
+    }
+  }
+  return queue;
+}
+
+/**
+ * Fill level seen from the slowest active reader. With |detach_above|
+ * below the capacity, active readers lagging more than it are detached
+ * first and do not count.
+ */
+template <typename T>
+uint32_t _broadcastFill(FreeQueueBroadcast<T> *queue, uint32_t write_index, 
+    uint32_t detach_above) {
+  uint32_t fill = 0;
+  for (uint32_t reader = 0; reader < queue->max_readers; reader++) {
+    std::atomic_uint *line = _broadcastReader(queue, reader);
+    if (std::atomic_load(line + BROADCAST_STATUS) != BROADCAST_ACTIVE) continue;
+    uint32_t lag = write_index - std::atomic_load_explicit(line + BROADCAST_CURSOR, 
+        std::memory_order_acquire);
+    if (lag > detach_above) {
+      unsigned int active = BROADCAST_ACTIVE;
+      if (std::atomic_compare_exchange_strong(line + BROADCAST_STATUS, &active, 
+          (unsigned int)BROADCAST_DETACHED)) {
+        std::atomic_fetch_add_explicit(queue->state + BROADCAST_DETACHES, 1u, 
+            std::memory_order_relaxed);
+        continue;
+      }
+    }
+    if (lag > fill) fill = lag;
+  }
+  return fill;
+}
+
+/**
+ * Writes |length| frames for every reader, or none.
+ * @return {bool} False if a reader is in the way under
+ *   FREE_QUEUE_BROADCAST_BLOCK, or |length| exceeds the capacity.
+ */
+template <size_t Channels = 0, typename T, typename Source>
+bool _freeQueueBroadcastPush(FreeQueueBroadcast<T> *queue, const Source &input, size_t length) {
+  if (queue == nullptr || length > queue->buffer_length) return false;
+  std::atomic_uint *state = queue->state;
+  uint32_t write_index = std::atomic_load_explicit(state + BROADCAST_WRITE, 
+      std::memory_order_relaxed);
+  uint32_t capacity = (uint32_t)queue->buffer_length;
+  uint32_t detach_above = queue->policy == FREE_QUEUE_BROADCAST_DETACH 
+      ? capacity - (uint32_t)length : UINT32_MAX;
+  if (_broadcastFill(queue, write_index, detach_above) + length > capacity) {
+    return false;
+  }
+  // Readers that were lapped by a detach or a racing attach find out by
+  // comparing RESERVE with their cursor once they have copied.
+  std::atomic_store(state + BROADCAST_RESERVE, write_index + (uint32_t)length);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  size_t offset = write_index & (capacity - 1);
+  size_t first = length < capacity - offset ? length : capacity - offset;
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    const T *source = _channelData(input[channel]);
+    memcpy(queue->channel_data[channel] + offset, source, first * sizeof(T));
+    memcpy(queue->channel_data[channel], source + first, (length - first) * sizeof(T));
+  }
+  std::atomic_store_explicit(state + BROADCAST_WRITE, write_index + (uint32_t)length, 
+      std::memory_order_release);
+  return true;
+}
+
+/**
+ * Copies the next |length| frames of |reader| into |output| and advances
+ * its cursor.
+ * @return {int} 1 on success, 0 if fewer frames are available (nothing is
+ *   read), -1 if the reader is not attached or was detached.
+ */
+template <size_t Channels = 0, typename T, typename Sink>
+int _freeQueueBroadcastRead(FreeQueueBroadcast<T> *queue, uint32_t reader, 
+    const Sink &output, size_t length) {
+  if (queue == nullptr || reader >= queue->max_readers) return -1;
+  std::atomic_uint *line = _broadcastReader(queue, reader);
+  if (std::atomic_load(line + BROADCAST_STATUS) != BROADCAST_ACTIVE) return -1;
+  uint32_t cursor = std::atomic_load_explicit(line + BROADCAST_CURSOR, std::memory_order_relaxed);
+  uint32_t write_index = std::atomic_load_explicit(queue->state + BROADCAST_WRITE, 
+      std::memory_order_acquire);
+  if (write_index - cursor < length) return 0;
+  const size_t channel_count = Channels ? Channels : queue->channel_count;
+  uint32_t capacity = (uint32_t)queue->buffer_length;
+  size_t offset = cursor & (capacity - 1);
+  size_t first = length < capacity - offset ? length : capacity - offset;
+  for (size_t channel = 0; channel < channel_count; channel++) {
+    T *sink = _channelData(output[channel]);
+    memcpy(sink, queue->channel_data[channel] + offset, first * sizeof(T));
+    memcpy(sink + first, queue->channel_data[channel], (length - first) * sizeof(T));
+  }
+  // Seqlock-style check: if the producer reserved past cursor + capacity
+  // while we copied, some frames were overwritten.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint32_t reserve = std::atomic_load(queue->state + BROADCAST_RESERVE);
+  if (reserve - cursor > capacity) {
+    unsigned int active = BROADCAST_ACTIVE;
+    std::atomic_compare_exchange_strong(line + BROADCAST_STATUS, &active, 
+        (unsigned int)BROADCAST_DETACHED);
+    return -1;
+  }
+  std::atomic_store_explicit(line + BROADCAST_CURSOR, cursor + (uint32_t)length, 
+      std::memory_order_release);
+  return 1;
+}
+
+/** Moves the just claimed |reader| to the live edge and marks it active. */
+template <typename T>
+void _broadcastJoin(FreeQueueBroadcast<T> *queue, uint32_t reader) {
+  std::atomic_uint *line = _broadcastReader(queue, reader);
+  std::atomic_store(line + BROADCAST_CURSOR, 
+      std::atomic_load(queue->state + BROADCAST_WRITE));
+  std::atomic_store(line + BROADCAST_STATUS, (unsigned int)BROADCAST_ACTIVE);
+}
+
+/**
+ * Moves an attached (active or detached) |reader| back to the live edge and
+ * marks it active. A free or claimed line is left alone, so a stale index
+ * cannot activate a line nobody reads from.
+ * @return {bool} False if the line was not attached.
+ */
+template <typename T>
+bool _broadcastRejoin(FreeQueueBroadcast<T> *queue, uint32_t reader) {
+  std::atomic_uint *line = _broadcastReader(queue, reader);
+  unsigned int status = std::atomic_load(line + BROADCAST_STATUS);
+  do {
+    if (status != BROADCAST_ACTIVE && status != BROADCAST_DETACHED) return false;
+    std::atomic_store(line + BROADCAST_CURSOR, 
+        std::atomic_load(queue->state + BROADCAST_WRITE));
+  } while (!std::atomic_compare_exchange_weak(line + BROADCAST_STATUS, &status, 
+      (unsigned int)BROADCAST_ACTIVE));
+  return true;
+}
+
+/**
+ * Registers a reader that starts at the live edge.
+ * @return {int} Reader index, or -1 if all |max_readers| lines are taken.
+ */
+template <typename T>
+int _broadcastAttach(FreeQueueBroadcast<T> *queue) {
+  for (uint32_t reader = 0; reader < queue->max_readers; reader++) {
+    unsigned int free_status = BROADCAST_FREE;
+    if (std::atomic_compare_exchange_strong(_broadcastReader(queue, reader) + BROADCAST_STATUS, 
+        &free_status, (unsigned int)BROADCAST_CLAIMED)) {
+      _broadcastJoin(queue, reader);
+      return (int)reader;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Owning handle on a FreeQueue<T>. |Channels| and |Capacity| may be fixed
+ * at compile time (0 leaves them to the constructor): a fixed channel count
+ * unrolls the copy loops and takes the stereo SIMD paths of the converting
+ * push/pull without a runtime dispatch, and a fixed power-of-two capacity
+ * turns on FREE_QUEUE_POW2. The ring is the same FreeQueue<T> the C ABI
+ * exports, so get() can be passed to GetFreeQueuePointers for JS.
+ * A constructor argument that contradicts a fixed template argument leaves
+ * the handle empty; every operation on an empty handle fails.
+ */
+template <typename T, size_t Channels = 0, size_t Capacity = 0>
+class FreeQueueRing {
+ public:
+  static constexpr size_t kExtent = Channels ? Channels : std::dynamic_extent;
+  /** One span per channel; every span holds the same number of frames. */
+  using Input = std::span<const std::span<const T>, kExtent>;
+  using Output = std::span<const std::span<T>, kExtent>;
+
+  explicit FreeQueueRing(size_t length = Capacity, size_t channel_count = Channels, 
+      uint32_t flags = 0) 
+      : queue_(nullptr) {
+    if (length == 0 || channel_count == 0) return;
+    if (Capacity && length != Capacity) return;
+    if (Channels && channel_count != Channels) return;
+    if (Capacity && (Capacity & (Capacity - 1)) == 0) flags |= FREE_QUEUE_POW2;
+    queue_ = _createFreeQueue<T>(length, channel_count, flags);
+  }
+  ~FreeQueueRing() { _destroyFreeQueue(queue_); }
+
+  FreeQueueRing(const FreeQueueRing &) = delete;
+  FreeQueueRing &operator=(const FreeQueueRing &) = delete;
+  FreeQueueRing(FreeQueueRing &&other) noexcept : queue_(std::exchange(other.queue_, nullptr)) {}
+  FreeQueueRing &operator=(FreeQueueRing &&other) noexcept {
+    if (this != &other) {
+      _destroyFreeQueue(queue_);
+      queue_ = std::exchange(other.queue_, nullptr);
+    }
+    return *this;
+  }
+
+  explicit operator bool() const { return queue_ != nullptr; }
+  FreeQueue<T> *get() const { return queue_; }
+  /** Gives up ownership; free the queue with DestroyFreeQueue. */
+  FreeQueue<T> *release() { return std::exchange(queue_, nullptr); }
+
+  size_t channelCount() const { 
+    if constexpr (Channels != 0) return Channels;
+    return queue_ ? queue_->channel_count : 0; 
+  }
+  size_t capacity() const { return queue_ ? _capacity(queue_) : 0; }
+
+  /** Pushes every frame of |input| or, if they do not fit, none. */
+  bool push(Input input) {
+    return _matches(input.size()) && 
+        _freeQueuePush<Channels>(queue_, input, _frames(input));
+  }
+  /** Pulls |output[c].size()| frames or, if fewer are available, none. */
+  bool pull(Output output) {
+    return _matches(output.size()) && 
+        _freeQueuePull<Channels>(queue_, output, _frames(output));
+  }
+  /** @return {size_t} Number of frames pushed, as many as fit. */
+  size_t pushSome(Input input) {
+    return _matches(input.size()) ? 
+        _freeQueuePushSome<Channels>(queue_, input, _frames(input)) : 0;
+  }
+  /** @return {size_t} Number of frames pulled, as many as are available. */
+  size_t pullSome(Output output) {
+    return _matches(output.size()) ? 
+        _freeQueuePullSome<Channels>(queue_, output, _frames(output)) : 0;
+  }
+
+  /** Converts and deinterleaves |input| (whole frames of S) into the ring. */
+  template <typename S>
+  bool pushInterleaved(std::span<const S> input) {
+    if (queue_ == nullptr) return false;
+    size_t channel_count = channelCount();
+    if (input.size() % channel_count != 0) return false;
+    return _freeQueuePushConverted<Channels>(queue_, input.data(), 
+        (const S *const *)nullptr, input.size() / channel_count);
+  }
+  /** Fills |output| with interleaved frames converted to D, or fails. */
+  template <typename D>
+  bool pullInterleaved(std::span<D> output) {
+    if (queue_ == nullptr) return false;
+    size_t channel_count = channelCount();
+    if (output.size() % channel_count != 0) return false;
+    return _freeQueuePullConverted<Channels>(queue_, output.data(), 
+        (D *const *)nullptr, output.size() / channel_count);
+  }
+
+ private:
+  bool _matches(size_t channel_count) const {
+    return queue_ != nullptr && channel_count == channelCount();
+  }
+  template <typename Channel>
+  static size_t _frames(std::span<const Channel, kExtent> channels) {
+    size_t frames = channels[0].size();
+    for (size_t channel = 1; channel < channels.size(); channel++) {
+      if (channels[channel].size() < frames) frames = channels[channel].size();
+    }
+    return frames;
+  }
+
+  FreeQueue<T> *queue_;
+};
+
+#endif  // FREE_QUEUE_H_
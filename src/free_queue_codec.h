@@ -0,0 +1,169 @@
+/**
+ * Shared plumbing of the decoder producers (free_queue_flac.cpp, ...). Each
+ * decoder writes straight into the channel buffers of a queue it was
+ * created for and blocks on the queue itself when the ring is full, so it
+ * can be driven from any thread or plugged into a pipeline with
+ * SetFreeQueuePipelineSource. Decoders are optional: build their sources
+ * and link their libraries through CODEC_SOURCES/CODEC_LIBS (see build.sh).
+ *
+ * Every decoder exports the same three calls:
+ *   Create<Codec>Decoder(instance, ...)  decoder or nullptr
+ *   FreeQueue<Codec>Decode(decoder, timeout_ms)
+ *     frames written, 0 if nothing fit before |timeout_ms| (negative waits
+ *     forever), -1 at the end of the stream, on a decoder error or once the
+ *     queue is closed
+ *   Destroy<Codec>Decoder(decoder)
+ */
+#ifndef FREE_QUEUE_CODEC_H_
+#define FREE_QUEUE_CODEC_H_
+
+#ifndef __EMSCRIPTEN__
+/** Native builds export every entry point anyway. */
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+#include "free_queue.h"
+#include <stdio.h>
+
+/** Format of the decoded stream, filled in by Get<Codec>DecoderInfo. */
+struct FreeQueueStreamInfo {
+  uint32_t sample_rate;
+  uint32_t channel_count;
+  /** Bits per sample of the source, 0 for lossy codecs. */
+  uint32_t bits_per_sample;
+  /** Length in frames, 0 when unknown. */
+  uint64_t total_frames;
+};
+
+/** Read position in an encoded stream held in memory. */
+struct FreeQueueMemoryStream {
+  const uint8_t *data;
+  size_t bytes;
+  size_t position;
+};
+
+/** Copies up to |bytes| from |stream|. @return {size_t} Bytes copied. */
+inline size_t _memoryStreamRead(struct FreeQueueMemoryStream *stream, void *buffer,
+    size_t bytes) {
+  size_t left = stream->bytes - stream->position;
+  if (bytes > left) bytes = left;
+  memcpy(buffer, stream->data + stream->position, bytes);
+  stream->position += bytes;
+  return bytes;
+}
+
+/**
+ * Moves the read position like fseek (|whence| is SEEK_SET, SEEK_CUR or
+ * SEEK_END). @return {int} 0 on success, -1 if outside the stream.
+ */
+inline int _memoryStreamSeek(struct FreeQueueMemoryStream *stream, int64_t offset, int whence) {
+  int64_t base = whence == SEEK_CUR ? (int64_t)stream->position 
+      : whence == SEEK_END ? (int64_t)stream->bytes : 0;
+  if (base + offset < 0 || base + offset > (int64_t)stream->bytes) return -1;
+  stream->position = (size_t)(base + offset);
+  return 0;
+}
+
+/**
+ * Reads the next packet of a length-prefixed packet stream: a 32-bit
+ * little-endian length, then the packet; a length of 0 marks a lost
+ * packet. |packet| points into the stream.
+ * @return {int} 1 with |packet| and |bytes| set, 0 for a lost packet, -1
+ *   at the end of the stream or on a truncated packet.
+ */
+inline int _memoryStreamPacket(struct FreeQueueMemoryStream *stream, const uint8_t **packet,
+    size_t *bytes) {
+  if (stream->bytes - stream->position < 4) return -1;
+  const uint8_t *prefix = stream->data + stream->position;
+  size_t length = prefix[0] | prefix[1] << 8 | prefix[2] << 16 | (uint32_t)prefix[3] << 24;
+  if (length > stream->bytes - stream->position - 4) return -1;
+  stream->position += 4 + length;
+  *packet = prefix + 4;
+  *bytes = length;
+  return length > 0 ? 1 : 0;
+}
+
+/**
+ * @return {size_t} Frames the producer may still add before the fill level
+ *   reaches |watermark|.
+ */
+template <typename T>
+size_t _roomBelow(FreeQueue<T> *queue, size_t watermark) {
+  size_t fill = _capacity(queue) - _framesWritable(queue, 
+      _loadIndex(queue, READ, std::memory_order_acquire), 
+      _loadIndex(queue, WRITE, std::memory_order_relaxed));
+  return fill < watermark ? watermark - fill : 0;
+}
+
+/**
+ * Blocks the producer until |frames| frames are writable, like
+ * FreeQueueWaitWritable, but gives up on a closed queue even if there is
+ * room, so a decoder stops as soon as its pipeline does.
+ * @return {int} 1 when writable, 0 after |timeout_ms|, -1 once closed.
+ */
+template <typename T>
+int _waitWritable(FreeQueue<T> *queue, size_t frames, double timeout_ms) {
+  if (std::atomic_load_explicit(queue->state + CLOSED, std::memory_order_relaxed)) return -1;
+  if (_isWritable(queue, frames)) return 1;
+  return _wait(queue, frames, timeout_ms, _isWritable<T>, READ, WRITE_WAITERS, WRITE_SPIN);
+}
+
+/**
+ * Converts |n| integer samples of |bits| significant bits (right-justified,
+ * as FLAC delivers them) into storage type T.
+ */
+template <typename T>
+void _convertFixed(const int32_t *src, T *dst, size_t n, uint32_t bits) {
+  if constexpr (std::is_floating_point<T>::value) {
+    const T scale = (T)(1.0 / (double)(1u << (bits - 1)));
+    for (size_t i = 0; i < n; i++) dst[i] = (T)src[i] * scale;
+  } else {
+    const int shift = (int)(sizeof(T) * 8) - (int)bits;
+    if (shift >= 0) {
+      for (size_t i = 0; i < n; i++) dst[i] = (T)((uint32_t)src[i] << shift);
+    } else {
+      for (size_t i = 0; i < n; i++) dst[i] = (T)(src[i] >> -shift);
+    }
+  }
+}
+
+/**
+ * Pushes |length| interleaved frames of |channels| channels, converting
+ * from S. Ring channel c takes source channel c % channels, so a mono
+ * stream fills every channel of the queue.
+ * @return {bool} False, writing nothing, when |length| frames do not fit.
+ */
+template <typename S, typename T>
+bool _pushMapped(FreeQueue<T> *queue, const S *interleaved, uint32_t channels, size_t length) {
+  if (channels == queue->channel_count) {
+    return _freeQueuePushConverted(queue, interleaved, (const S *const *)nullptr, length);
+  }
+  struct FreeQueueWindow window;
+  if (_beginWrite(queue, length, &window) < length) return false;
+  for (size_t i = 0; i < length; i++) {
+    size_t offset = i < window.first ? window.offset + i : i - window.first;
+    for (size_t channel = 0; channel < queue->channel_count; channel++) {
+      queue->channel_data[channel][offset] = 
+          _convertSample<S, T>(interleaved[i * channels + channel % channels]);
+    }
+  }
+  _commitWrite(queue, length);
+  return true;
+}
+
+/** _pushMapped for a queue of any sample type. */
+template <typename S>
+bool _pushInterleaved(void *instance, const S *interleaved, uint32_t channels, size_t length) {
+  switch (((FreeQueue<double> *)instance)->sample_type) {
+    case FREE_QUEUE_FLOAT64: 
+      return _pushMapped(((FreeQueue<double> *)instance), interleaved, channels, length);
+    case FREE_QUEUE_FLOAT32: 
+      return _pushMapped(((FreeQueue<float> *)instance), interleaved, channels, length);
+    case FREE_QUEUE_INT16: 
+      return _pushMapped(((FreeQueue<int16_t> *)instance), interleaved, channels, length);
+    case FREE_QUEUE_INT32: 
+      return _pushMapped(((FreeQueue<int32_t> *)instance), interleaved, channels, length);
+  }
+  return false;
+}
+
+#endif  // FREE_QUEUE_CODEC_H_
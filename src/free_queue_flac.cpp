@@ -0,0 +1,209 @@
+/**
+ * FLAC producer: decodes a FLAC stream held in memory frame by frame and
+ * writes every frame straight into the channel buffers of a queue, with no
+ * intermediate buffer. Link with -lFLAC.
+ */
+#include "free_queue_codec.h"
+#include <FLAC/stream_decoder.h>
+
+struct FreeQueueFlacDecoder {
+  FreeQueue<double> *queue;
+  FLAC__StreamDecoder *decoder;
+  struct FreeQueueMemoryStream stream;
+  struct FreeQueueStreamInfo info;
+  /** Room a frame may need: STREAMINFO's max_blocksize, capped by the ring. */
+  size_t frame_room;
+  /** Frames written by the write callback during the current decode call. */
+  size_t written;
+};
+
+static FLAC__StreamDecoderReadStatus _flacRead(const FLAC__StreamDecoder *,
+    FLAC__byte buffer[], size_t *bytes, void *client_data) {
+  struct FreeQueueFlacDecoder *d = (struct FreeQueueFlacDecoder *)client_data;
+  *bytes = _memoryStreamRead(&d->stream, buffer, *bytes);
+  return *bytes ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE
+      : FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+}
+
+static FLAC__StreamDecoderSeekStatus _flacSeek(const FLAC__StreamDecoder *,
+    FLAC__uint64 absolute_byte_offset, void *client_data) {
+  struct FreeQueueFlacDecoder *d = (struct FreeQueueFlacDecoder *)client_data;
+  if (absolute_byte_offset > d->stream.bytes) return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+  d->stream.position = (size_t)absolute_byte_offset;
+  return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamDecoderTellStatus _flacTell(const FLAC__StreamDecoder *,
+    FLAC__uint64 *absolute_byte_offset, void *client_data) {
+  *absolute_byte_offset = ((struct FreeQueueFlacDecoder *)client_data)->stream.position;
+  return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+static FLAC__StreamDecoderLengthStatus _flacLength(const FLAC__StreamDecoder *,
+    FLAC__uint64 *stream_length, void *client_data) {
+  *stream_length = ((struct FreeQueueFlacDecoder *)client_data)->stream.bytes;
+  return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+static FLAC__bool _flacEof(const FLAC__StreamDecoder *, void *client_data) {
+  struct FreeQueueFlacDecoder *d = (struct FreeQueueFlacDecoder *)client_data;
+  return d->stream.position >= d->stream.bytes;
+}
+
+/**
+ * Converts one decoded frame into the ring. Ring channel c takes source
+ * channel c % channels, so mono fills every channel of a stereo ring.
+ */
+template <typename T>
+static bool _flacWriteFrame(FreeQueue<T> *queue, const FLAC__Frame *frame,
+    const FLAC__int32 *const buffer[]) {
+  size_t length = frame->header.blocksize;
+  uint32_t channels = frame->header.channels;
+  uint32_t bits = frame->header.bits_per_sample;
+  struct FreeQueueWindow window;
+  if (_beginWrite(queue, length, &window) < length) return false;
+  for (size_t channel = 0; channel < queue->channel_count; channel++) {
+    const int32_t *source = buffer[channel % channels];
+    _convertFixed(source, queue->channel_data[channel] + window.offset, window.first, bits);
+    _convertFixed(source + window.first, queue->channel_data[channel], window.second, bits);
+  }
+  _commitWrite(queue, length);
+  return true;
+}
+
+static FLAC__StreamDecoderWriteStatus _flacWrite(const FLAC__StreamDecoder *,
+    const FLAC__Frame *frame, const FLAC__int32 *const buffer[], void *client_data) {
+  struct FreeQueueFlacDecoder *d = (struct FreeQueueFlacDecoder *)client_data;
+  void *instance = d->queue;
+  bool written = false;
+  switch (d->queue->sample_type) {
+    case FREE_QUEUE_FLOAT64:
+      written = _flacWriteFrame((FreeQueue<double> *)instance, frame, buffer); break;
+    case FREE_QUEUE_FLOAT32:
+      written = _flacWriteFrame((FreeQueue<float> *)instance, frame, buffer); break;
+    case FREE_QUEUE_INT16:
+      written = _flacWriteFrame((FreeQueue<int16_t> *)instance, frame, buffer); break;
+    case FREE_QUEUE_INT32:
+      written = _flacWriteFrame((FreeQueue<int32_t> *)instance, frame, buffer); break;
+  }
+  if (!written) return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  d->written += frame->header.blocksize;
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void _flacMetadata(const FLAC__StreamDecoder *,
+    const FLAC__StreamMetadata *metadata, void *client_data) {
+  struct FreeQueueFlacDecoder *d = (struct FreeQueueFlacDecoder *)client_data;
+  if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+    const FLAC__StreamMetadata_StreamInfo *info = &metadata->data.stream_info;
+    d->info.sample_rate = info->sample_rate;
+    d->info.channel_count = info->channels;
+    d->info.bits_per_sample = info->bits_per_sample;
+    d->info.total_frames = info->total_samples;
+    if (info->max_blocksize != 0) d->frame_room = info->max_blocksize;
+  }
+}
+
+/** Lost sync and bad frames are skipped; the decoder resynchronizes itself. */
+static void _flacError(const FLAC__StreamDecoder *, FLAC__StreamDecoderErrorStatus, void *) {
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void DestroyFreeQueueFlacDecoder( void* decoder )
+{
+  struct FreeQueueFlacDecoder* d = (struct FreeQueueFlacDecoder*)decoder;
+  if ( d != nullptr ) {
+    if ( d->decoder != nullptr ) {
+      FLAC__stream_decoder_finish( d->decoder );
+      FLAC__stream_decoder_delete( d->decoder );
+    }
+    free( d );
+  }
+}
+
+/**
+ * Creates a decoder writing into the queue |instance| (any sample type)
+ * and reads the stream's metadata. |data| must outlive the decoder.
+ * @return {void*} Decoder, or nullptr when |data| is not FLAC or a frame
+ *   of the stream could exceed the ring's capacity.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueFlacDecoder( void* instance, const void* data, size_t bytes )
+{
+  if ( instance == nullptr || data == nullptr ) return nullptr;
+  struct FreeQueueFlacDecoder* d =
+      (struct FreeQueueFlacDecoder*)calloc( 1, sizeof(struct FreeQueueFlacDecoder) );
+  if ( d == nullptr ) return nullptr;
+  d->queue = (FreeQueue<double>*)instance;
+  d->stream.data = (const uint8_t*)data;
+  d->stream.bytes = bytes;
+  d->frame_room = FLAC__MAX_BLOCK_SIZE;
+  d->decoder = FLAC__stream_decoder_new();
+  if ( d->decoder == nullptr ||
+      FLAC__stream_decoder_init_stream( d->decoder, _flacRead, _flacSeek, _flacTell,
+          _flacLength, _flacEof, _flacWrite, _flacMetadata, _flacError, d ) !=
+          FLAC__STREAM_DECODER_INIT_STATUS_OK ||
+      !FLAC__stream_decoder_process_until_end_of_metadata( d->decoder ) ||
+      d->info.channel_count == 0 ) {
+    DestroyFreeQueueFlacDecoder( d );
+    return nullptr;
+  }
+  size_t capacity = _capacity( d->queue );
+  if ( d->frame_room > capacity ) {
+    // without STREAMINFO's bound any frame up to FLAC__MAX_BLOCK_SIZE may come
+    if ( d->frame_room != FLAC__MAX_BLOCK_SIZE ) {
+      DestroyFreeQueueFlacDecoder( d );
+      return nullptr;
+    }
+    d->frame_room = capacity;
+  }
+  return d;
+}
+
+/**
+ * Decodes frames into the queue for as long as a whole frame fits, waiting
+ * up to |timeout_ms| (negative waits forever) for room for the first one.
+ * @return {int} Frames written, 0 if no frame fit in time, -1 at the end
+ *   of the stream, on a decoder error or once the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueFlacDecode( void* decoder, double timeout_ms )
+{
+  struct FreeQueueFlacDecoder* d = (struct FreeQueueFlacDecoder*)decoder;
+  if ( d == nullptr ) return -1;
+  d->written = 0;
+  int ready = _waitWritable( d->queue, d->frame_room, timeout_ms );
+  if ( ready <= 0 ) return ready;
+  do {
+    if ( FLAC__stream_decoder_get_state( d->decoder ) == FLAC__STREAM_DECODER_END_OF_STREAM ||
+        !FLAC__stream_decoder_process_single( d->decoder ) ) {
+      break;
+    }
+  } while ( _isWritable( d->queue, d->frame_room ) );
+  if ( d->written == 0 &&
+      FLAC__stream_decoder_get_state( d->decoder ) >= FLAC__STREAM_DECODER_END_OF_STREAM ) {
+    return -1;
+  }
+  return (int)d->written;
+}
+
+/**
+ * Copies the stream format from STREAMINFO into |info|.
+ * @return {int} 1 on success, -1 for a bad decoder.
+ */
+EMSCRIPTEN_KEEPALIVE
+int GetFreeQueueFlacDecoderInfo( void* decoder, struct FreeQueueStreamInfo* info )
+{
+  struct FreeQueueFlacDecoder* d = (struct FreeQueueFlacDecoder*)decoder;
+  if ( d == nullptr || info == nullptr ) return -1;
+  *info = d->info;
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
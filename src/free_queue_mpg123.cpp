@@ -0,0 +1,253 @@
+/**
+ * MP3 producer on mpg123's feed API: compressed bytes arrive in chunks of
+ * any size through FreeQueueMpg123Feed (from JS, a socket or a file) and
+ * each MPEG frame is decoded with mpg123_decode_frame and written to the
+ * queue right away, so playback can start after the first frame instead of
+ * after the whole file. mpg123 is asked for the encoding closest to the
+ * queue's sample type. Link with -lmpg123.
+ */
+#include "free_queue_codec.h"
+#include <pthread.h>
+#include <mpg123.h>
+
+/** Most frames one MPEG audio frame decodes to (Layer II/III). */
+#define FREE_QUEUE_MPG123_FRAME 1152
+
+/** Slice in which a decoder waiting for input checks for a closed queue. */
+#define FREE_QUEUE_MPG123_POLL_MS 10
+
+struct FreeQueueMpg123Decoder {
+  FreeQueue<double> *queue;
+  mpg123_handle *handle;
+  /** Serializes feeding and decoding, which may run on different threads. */
+  pthread_mutex_t mutex;
+  /** Bumped by every feed; decoders short of input wait on it. */
+  std::atomic_uint fed;
+  struct FreeQueueStreamInfo info;
+  int encoding;
+  /** No more input will come: running dry ends the stream. */
+  bool finished;
+  bool ended;
+};
+
+static int _mpg123Encoding(uint32_t sample_type) {
+  switch (sample_type) {
+    case FREE_QUEUE_INT16: return MPG123_ENC_SIGNED_16;
+    case FREE_QUEUE_INT32: return MPG123_ENC_SIGNED_32;
+  }
+  return MPG123_ENC_FLOAT_32;
+}
+
+/** Accepts every standard rate and channel count in |encoding| only. */
+static bool _mpg123SetFormat(mpg123_handle *handle, int encoding) {
+  const long *rates;
+  size_t count;
+  mpg123_rates(&rates, &count);
+  mpg123_format_none(handle);
+  for (size_t i = 0; i < count; i++) {
+    if (mpg123_format(handle, rates[i], MPG123_MONO | MPG123_STEREO, encoding) != MPG123_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool _mpg123Push(struct FreeQueueMpg123Decoder *d, const uint8_t *audio, size_t bytes) {
+  uint32_t channels = d->info.channel_count;
+  size_t frames = bytes / (mpg123_encsize(d->encoding) * channels);
+  if (frames == 0) return true;
+  switch (d->encoding) {
+    case MPG123_ENC_SIGNED_16:
+      return _pushInterleaved(d->queue, (const int16_t *)audio, channels, frames);
+    case MPG123_ENC_SIGNED_32:
+      return _pushInterleaved(d->queue, (const int32_t *)audio, channels, frames);
+  }
+  return _pushInterleaved(d->queue, (const float *)audio, channels, frames);
+}
+
+/**
+ * Waits until more input is fed, the input is finished or the queue is
+ * closed, for up to |timeout_ms| (negative waits forever). Called with
+ * the mutex held; releases it while waiting.
+ * @return {bool} False after the timeout or once the queue is closed.
+ */
+static bool _mpg123WaitInput(struct FreeQueueMpg123Decoder *d, uint32_t observed,
+    double timeout_ms) {
+  double deadline = timeout_ms < 0 ? INFINITY : _nowMs() + timeout_ms;
+  pthread_mutex_unlock(&d->mutex);
+  bool fed = false;
+  while (!std::atomic_load_explicit(d->queue->state + CLOSED, std::memory_order_relaxed)) {
+    if (std::atomic_load(&d->fed) != observed) {
+      fed = true;
+      break;
+    }
+    double remaining = deadline - _nowMs();
+    if (remaining <= 0) break;
+    _futexWait(&d->fed, observed,
+        remaining < FREE_QUEUE_MPG123_POLL_MS ? remaining : FREE_QUEUE_MPG123_POLL_MS);
+  }
+  pthread_mutex_lock(&d->mutex);
+  return fed;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void DestroyFreeQueueMpg123Decoder( void* decoder )
+{
+  struct FreeQueueMpg123Decoder* d = (struct FreeQueueMpg123Decoder*)decoder;
+  if ( d != nullptr ) {
+    if ( d->handle != nullptr ) {
+      mpg123_close( d->handle );
+      mpg123_delete( d->handle );
+    }
+    pthread_mutex_destroy( &d->mutex );
+    free( d );
+  }
+}
+
+/**
+ * Creates a feed-mode decoder writing into the queue |instance| (any
+ * sample type). Input comes later through FreeQueueMpg123Feed.
+ * @return {void*} Decoder, or nullptr when the ring cannot hold an MPEG
+ *   frame, allocation fails or libmpg123 fails to start.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueMpg123Decoder( void* instance )
+{
+  if ( instance == nullptr ||
+      _capacity( (FreeQueue<double>*)instance ) < FREE_QUEUE_MPG123_FRAME ) {
+    return nullptr;
+  }
+  // a no-op since libmpg123 1.27, required before
+  static int initialized = mpg123_init();
+  if ( initialized != MPG123_OK ) return nullptr;
+  struct FreeQueueMpg123Decoder* d =
+      (struct FreeQueueMpg123Decoder*)calloc( 1, sizeof(struct FreeQueueMpg123Decoder) );
+  if ( d == nullptr ) return nullptr;
+  d->queue = (FreeQueue<double>*)instance;
+  pthread_mutex_init( &d->mutex, nullptr );
+  std::atomic_init( &d->fed, 0u );
+  d->encoding = _mpg123Encoding( d->queue->sample_type );
+  int error = MPG123_OK;
+  d->handle = mpg123_new( nullptr, &error );
+  if ( d->handle == nullptr ) {
+    DestroyFreeQueueMpg123Decoder( d );
+    return nullptr;
+  }
+  mpg123_param( d->handle, MPG123_ADD_FLAGS, MPG123_QUIET, 0 );
+  // fixed-point builds of libmpg123 have no float output
+  if ( !_mpg123SetFormat( d->handle, d->encoding ) ) {
+    d->encoding = MPG123_ENC_SIGNED_16;
+    if ( !_mpg123SetFormat( d->handle, d->encoding ) ) {
+      DestroyFreeQueueMpg123Decoder( d );
+      return nullptr;
+    }
+  }
+  if ( mpg123_open_feed( d->handle ) != MPG123_OK ) {
+    DestroyFreeQueueMpg123Decoder( d );
+    return nullptr;
+  }
+  return d;
+}
+
+/**
+ * Hands |bytes| of MP3 data to the decoder (copied), waking a decode call
+ * waiting for input. |bytes| 0 marks the end of the input. Safe to call
+ * from another thread than FreeQueueMpg123Decode.
+ * @return {int} 1 on success, -1 on error.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueMpg123Feed( void* decoder, const void* data, size_t bytes )
+{
+  struct FreeQueueMpg123Decoder* d = (struct FreeQueueMpg123Decoder*)decoder;
+  if ( d == nullptr ) return -1;
+  pthread_mutex_lock( &d->mutex );
+  int result = MPG123_OK;
+  if ( bytes == 0 ) {
+    d->finished = true;
+  } else {
+    result = mpg123_feed( d->handle, (const unsigned char*)data, bytes );
+  }
+  pthread_mutex_unlock( &d->mutex );
+  std::atomic_fetch_add( &d->fed, 1u );
+  _futexWake( &d->fed );
+  return result == MPG123_OK ? 1 : -1;
+}
+
+/**
+ * Decodes frames into the queue while another frame fits. Waits up to
+ * |timeout_ms| (negative waits forever) for room for the first frame,
+ * and again for input when the fed data runs out before anything was
+ * written.
+ * @return {int} Frames written, 0 if there was no room or no input in
+ *   time, -1 at the end of the input, on a decoder error or once the queue
+ *   is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueMpg123Decode( void* decoder, double timeout_ms )
+{
+  struct FreeQueueMpg123Decoder* d = (struct FreeQueueMpg123Decoder*)decoder;
+  if ( d == nullptr || d->ended ) return -1;
+  int ready = _waitWritable( d->queue, FREE_QUEUE_MPG123_FRAME, timeout_ms );
+  if ( ready <= 0 ) return ready;
+  int written = 0;
+  pthread_mutex_lock( &d->mutex );
+  while ( true ) {
+    uint32_t observed = std::atomic_load( &d->fed );
+    off_t number;
+    unsigned char* audio;
+    size_t bytes;
+    int result = mpg123_decode_frame( d->handle, &number, &audio, &bytes );
+    if ( result == MPG123_NEW_FORMAT ) {
+      long rate;
+      int channels;
+      mpg123_getformat( d->handle, &rate, &channels, &d->encoding );
+      d->info.sample_rate = (uint32_t)rate;
+      d->info.channel_count = (uint32_t)channels;
+      continue;
+    }
+    if ( result == MPG123_NEED_MORE ) {
+      if ( d->finished ) {
+        d->ended = true;
+        break;
+      }
+      if ( written > 0 || !_mpg123WaitInput( d, observed, timeout_ms ) ) break;
+      continue;
+    }
+    if ( result != MPG123_OK || !_mpg123Push( d, audio, bytes ) ) {
+      d->ended = true;
+      break;
+    }
+    written += (int)( bytes / ( mpg123_encsize( d->encoding ) * d->info.channel_count ) );
+    if ( !_isWritable( d->queue, FREE_QUEUE_MPG123_FRAME ) ) break;
+  }
+  pthread_mutex_unlock( &d->mutex );
+  if ( written == 0 && std::atomic_load_explicit( d->queue->state + CLOSED,
+      std::memory_order_relaxed ) ) {
+    return -1;
+  }
+  return written == 0 && d->ended ? -1 : written;
+}
+
+/**
+ * Copies the format of the stream, known once the first frame has been
+ * decoded (zeros before), into |info|.
+ * @return {int} 1 on success, -1 for a bad decoder.
+ */
+EMSCRIPTEN_KEEPALIVE
+int GetFreeQueueMpg123DecoderInfo( void* decoder, struct FreeQueueStreamInfo* info )
+{
+  struct FreeQueueMpg123Decoder* d = (struct FreeQueueMpg123Decoder*)decoder;
+  if ( d == nullptr || info == nullptr ) return -1;
+  pthread_mutex_lock( &d->mutex );
+  *info = d->info;
+  pthread_mutex_unlock( &d->mutex );
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
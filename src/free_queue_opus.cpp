@@ -0,0 +1,424 @@
+/**
+ * Opus producer for low-latency streams. Packets come from an Ogg Opus
+ * stream in memory, from a length-prefixed packet stream in memory, or one
+ * by one from the caller (live); each is decoded with opus_decode_float or,
+ * for more than two channels, opus_multistream_decode_float and written to
+ * the queue at once, so the ring holds no more than the caller lets it.
+ * Missing packets are rebuilt from the next packet's in-band FEC where
+ * possible and concealed (PLC) otherwise, so a loss never turns into an
+ * underrun. Link with -lopus (and -logg for Ogg input).
+ */
+#include "free_queue_codec.h"
+#include <ogg/ogg.h>
+#include <opus/opus_multistream.h>
+
+/** Longest Opus packet, 120 ms at 48 kHz, in frames. */
+#define FREE_QUEUE_OPUS_MAX_FRAMES 5760
+
+/** Bytes handed to the Ogg sync layer per read. */
+#define FREE_QUEUE_OPUS_OGG_CHUNK 4096
+
+struct FreeQueueOpusDecoder {
+  FreeQueue<double> *queue;
+  /** Exactly one of the two is set. */
+  OpusDecoder *decoder;
+  OpusMSDecoder *multistream;
+  struct FreeQueueStreamInfo info;
+  /** Interleaved scratch of FREE_QUEUE_OPUS_MAX_FRAMES frames. */
+  float *pcm;
+  /** Duration of the last packet: the size of concealed frames. */
+  int last_frames;
+  /** Decoded frames still to drop (Ogg Opus pre-skip). */
+  uint32_t skip;
+  /** Packets concealed by FreeQueueOpusConceal since the last packet. */
+  uint32_t concealed;
+  /** Packet source for FreeQueueOpusDecode, if any. */
+  struct FreeQueueMemoryStream input;
+  bool ogg;
+  ogg_sync_state sync;
+  ogg_stream_state stream;
+  bool stream_ready;
+  /** Next packet, read from |input| but not decoded for lack of room. */
+  const uint8_t *packet;
+  size_t packet_bytes;
+  uint32_t lost;
+  bool pending;
+  bool ended;
+};
+
+/** Opus decodes at 8, 12, 16, 24 or 48 kHz only. */
+static bool _isOpusRate(uint32_t sample_rate) {
+  return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 ||
+      sample_rate == 24000 || sample_rate == 48000;
+}
+
+/** Runs the decoder; |packet| nullptr conceals |frame_size| frames. */
+static int _opusRun(struct FreeQueueOpusDecoder *d, const uint8_t *packet, size_t bytes,
+    int frame_size, int fec) {
+  if (d->multistream != nullptr) {
+    return opus_multistream_decode_float(d->multistream, packet, (opus_int32)bytes, d->pcm,
+        frame_size, fec);
+  }
+  return opus_decode_float(d->decoder, packet, (opus_int32)bytes, d->pcm, frame_size, fec);
+}
+
+/** Writes |frames| decoded frames, minus what remains of the pre-skip. */
+static bool _opusWrite(struct FreeQueueOpusDecoder *d, int frames) {
+  uint32_t drop = d->skip < (uint32_t)frames ? d->skip : (uint32_t)frames;
+  d->skip -= drop;
+  return _pushInterleaved(d->queue, d->pcm + drop * d->info.channel_count,
+      d->info.channel_count, frames - drop);
+}
+
+/** Frames a packet decodes to; an unreadable one is concealed instead. */
+static int _opusPacketFrames(struct FreeQueueOpusDecoder *d, const uint8_t *packet,
+    size_t bytes) {
+  int frames = packet != nullptr
+      ? opus_packet_get_nb_samples(packet, (opus_int32)bytes, d->info.sample_rate) : -1;
+  return frames > 0 ? frames : d->last_frames;
+}
+
+/**
+ * Plans the next step toward decoding |packet| after |*lost| missing
+ * packets. When concealing them all and decoding |packet| fits in the
+ * ring, that is the step and |*whole| is set. Otherwise the step conceals
+ * only the excess, as much of it as fits, and leaves |packet| (and the
+ * loss its FEC data covers) for a later step, so a long gap is caught up
+ * rather than cut short. |*lost| is set to the packets the step conceals.
+ * @return {size_t} Frames the step writes.
+ */
+static size_t _opusStepFrames(struct FreeQueueOpusDecoder *d, const uint8_t *packet,
+    size_t bytes, uint32_t *lost, bool *whole) {
+  size_t capacity = _capacity(d->queue);
+  size_t frames = packet != nullptr ? _opusPacketFrames(d, packet, bytes) : 0;
+  size_t fit = (capacity - frames) / d->last_frames;
+  *whole = *lost <= fit;
+  if (*whole) return frames + *lost * d->last_frames;
+  size_t excess = *lost - fit;
+  if (excess > capacity / d->last_frames) excess = capacity / d->last_frames;
+  *lost = (uint32_t)excess;
+  return excess * d->last_frames;
+}
+
+/**
+ * Decodes |packet| after |lost| missing packets: the last of those is
+ * rebuilt from |packet|'s FEC data, the others are concealed. The room
+ * reported by _opusStepFrames must be writable.
+ * @return {int} Frames written, -1 on a decoder error.
+ */
+static int _opusStep(struct FreeQueueOpusDecoder *d, const uint8_t *packet, size_t bytes,
+    uint32_t lost) {
+  int written = 0;
+  for (uint32_t i = 0; i < lost; i++) {
+    bool fec = packet != nullptr && i + 1 == lost;
+    int frames = _opusRun(d, fec ? packet : nullptr, fec ? bytes : 0, d->last_frames, fec);
+    if (frames < 0 || !_opusWrite(d, frames)) return -1;
+    written += frames;
+  }
+  if (packet != nullptr) {
+    int frames = _opusRun(d, packet, bytes, FREE_QUEUE_OPUS_MAX_FRAMES, 0);
+    if (frames < 0) {
+      frames = _opusRun(d, nullptr, 0, d->last_frames, 0);
+    } else {
+      d->last_frames = frames;
+    }
+    if (frames < 0 || !_opusWrite(d, frames)) return -1;
+    written += frames;
+  }
+  return written;
+}
+
+/**
+ * Next packet of the Ogg stream.
+ * @return {int} 1 with |packet| set, -1 after a gap, 0 at the end of data.
+ */
+static int _oggOpusPacket(struct FreeQueueOpusDecoder *d, ogg_packet *packet) {
+  ogg_page page;
+  while (true) {
+    if (d->stream_ready) {
+      int result = ogg_stream_packetout(&d->stream, packet);
+      if (result != 0) return result;
+    }
+    if (ogg_sync_pageout(&d->sync, &page) == 1) {
+      if (!d->stream_ready) {
+        ogg_stream_init(&d->stream, ogg_page_serialno(&page));
+        d->stream_ready = true;
+      }
+      // pages of other logical streams are rejected by serial number
+      ogg_stream_pagein(&d->stream, &page);
+      continue;
+    }
+    char *buffer = ogg_sync_buffer(&d->sync, FREE_QUEUE_OPUS_OGG_CHUNK);
+    size_t bytes = _memoryStreamRead(&d->input, buffer, FREE_QUEUE_OPUS_OGG_CHUNK);
+    if (bytes == 0) return 0;
+    ogg_sync_wrote(&d->sync, (long)bytes);
+  }
+}
+
+/**
+ * Reads the next packet of the input into |d->packet|, counting the
+ * packets lost on the way in |d->lost|.
+ * @return {bool} False at the end of the input.
+ */
+static bool _opusNextPacket(struct FreeQueueOpusDecoder *d) {
+  while (true) {
+    if (d->ogg) {
+      ogg_packet packet;
+      int result = _oggOpusPacket(d, &packet);
+      if (result == 0) return false;
+      if (result < 0) {
+        d->lost++;
+        continue;
+      }
+      d->packet = packet.packet;
+      d->packet_bytes = (size_t)packet.bytes;
+      return true;
+    }
+    int result = _memoryStreamPacket(&d->input, &d->packet, &d->packet_bytes);
+    if (result < 0) return false;
+    if (result == 0) {
+      d->lost++;
+      continue;
+    }
+    return true;
+  }
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void DestroyFreeQueueOpusDecoder( void* decoder )
+{
+  struct FreeQueueOpusDecoder* d = (struct FreeQueueOpusDecoder*)decoder;
+  if ( d != nullptr ) {
+    if ( d->decoder != nullptr ) opus_decoder_destroy( d->decoder );
+    if ( d->multistream != nullptr ) opus_multistream_decoder_destroy( d->multistream );
+    if ( d->ogg ) {
+      if ( d->stream_ready ) ogg_stream_clear( &d->stream );
+      ogg_sync_clear( &d->sync );
+    }
+    free( d->pcm );
+    free( d );
+  }
+}
+
+/**
+ * Creates a decoder writing into the queue |instance| (any sample type)
+ * at |sample_rate|, one of 8000, 12000, 16000, 24000 or 48000. |mapping|
+ * nullptr selects a plain decoder of 1 or 2 channels, otherwise
+ * a multistream decoder of |stream_count| streams, |coupled_count| of them
+ * stereo (see opus_multistream_decoder_create). |data| optionally holds a
+ * length-prefixed packet stream for FreeQueueOpusDecode: each packet
+ * follows its length as a 32-bit little-endian integer, and a length of 0
+ * marks a lost packet. It must outlive the decoder. Live packets go to
+ * FreeQueueOpusDecodePacket instead.
+ * @return {void*} Decoder, or nullptr on bad parameters, when allocation
+ *   fails or when the ring cannot hold a 120 ms packet.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueOpusDecoder( void* instance, uint32_t sample_rate, uint32_t channel_count,
+    uint32_t stream_count, uint32_t coupled_count, const uint8_t* mapping,
+    const void* data, size_t bytes )
+{
+  if ( instance == nullptr || channel_count == 0 || !_isOpusRate( sample_rate ) ||
+      _capacity( (FreeQueue<double>*)instance ) < FREE_QUEUE_OPUS_MAX_FRAMES ) {
+    return nullptr;
+  }
+  struct FreeQueueOpusDecoder* d =
+      (struct FreeQueueOpusDecoder*)calloc( 1, sizeof(struct FreeQueueOpusDecoder) );
+  if ( d == nullptr ) return nullptr;
+  d->queue = (FreeQueue<double>*)instance;
+  d->info.sample_rate = sample_rate;
+  d->info.channel_count = channel_count;
+  d->input.data = (const uint8_t*)data;
+  d->input.bytes = data != nullptr ? bytes : 0;
+  // 20 ms until the first packet says otherwise
+  d->last_frames = sample_rate / 50;
+  int error = OPUS_OK;
+  if ( mapping == nullptr ) {
+    d->decoder = opus_decoder_create( sample_rate, channel_count, &error );
+  } else {
+    d->multistream = opus_multistream_decoder_create( sample_rate, channel_count,
+        stream_count, coupled_count, mapping, &error );
+  }
+  d->pcm = (float*)malloc( FREE_QUEUE_OPUS_MAX_FRAMES * channel_count * sizeof(float) );
+  if ( error != OPUS_OK || ( d->decoder == nullptr && d->multistream == nullptr ) ||
+      d->pcm == nullptr ) {
+    DestroyFreeQueueOpusDecoder( d );
+    return nullptr;
+  }
+  return d;
+}
+
+/**
+ * Creates a decoder for an Ogg Opus stream (RFC 7845) in memory, decoding
+ * at 48 kHz with the header's channel mapping, output gain and pre-skip.
+ * Only the first logical stream is played. |data| must outlive the decoder.
+ * @return {void*} Decoder, or nullptr when |data| is not Ogg Opus or the
+ *   ring cannot hold a 120 ms packet.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueOggOpusDecoder( void* instance, const void* data, size_t bytes )
+{
+  if ( instance == nullptr || data == nullptr ) return nullptr;
+  struct FreeQueueOpusDecoder head;
+  memset( &head, 0, sizeof(head) );
+  head.ogg = true;
+  head.input.data = (const uint8_t*)data;
+  head.input.bytes = bytes;
+  ogg_sync_init( &head.sync );
+  ogg_packet packet;
+  struct FreeQueueOpusDecoder* d = nullptr;
+  if ( _oggOpusPacket( &head, &packet ) == 1 && packet.bytes >= 19 &&
+      memcmp( packet.packet, "OpusHead", 8 ) == 0 ) {
+    const uint8_t* p = packet.packet;
+    uint32_t channel_count = p[9];
+    uint32_t pre_skip = p[10] | p[11] << 8;
+    int16_t gain = (int16_t)( p[16] | p[17] << 8 );
+    if ( p[18] == 0 ) {
+      d = (struct FreeQueueOpusDecoder*)CreateFreeQueueOpusDecoder( instance, 48000,
+          channel_count, 1, channel_count - 1, nullptr, nullptr, 0 );
+      if ( d != nullptr ) opus_decoder_ctl( d->decoder, OPUS_SET_GAIN( gain ) );
+    } else if ( packet.bytes >= 21 + (long)channel_count ) {
+      d = (struct FreeQueueOpusDecoder*)CreateFreeQueueOpusDecoder( instance, 48000,
+          channel_count, p[19], p[20], p + 21, nullptr, 0 );
+      if ( d != nullptr ) opus_multistream_decoder_ctl( d->multistream, OPUS_SET_GAIN( gain ) );
+    }
+    if ( d != nullptr ) d->skip = pre_skip;
+  }
+  if ( d == nullptr ) {
+    if ( head.stream_ready ) ogg_stream_clear( &head.stream );
+    ogg_sync_clear( &head.sync );
+    return nullptr;
+  }
+  // the sync and stream states hold no pointers to themselves
+  d->ogg = true;
+  d->input = head.input;
+  d->sync = head.sync;
+  d->stream = head.stream;
+  d->stream_ready = head.stream_ready;
+  // OpusTags
+  if ( _oggOpusPacket( d, &packet ) != 1 ) d->ended = true;
+  return d;
+}
+
+/**
+ * Decodes packets from the decoder's input while the next one fits in the
+ * ring, waiting up to |timeout_ms| (negative waits forever) for room for
+ * the first. Gaps in the input are filled from FEC data or concealed.
+ * @return {int} Frames written, 0 if no packet fit in time, -1 at the end
+ *   of the input, on a decoder error or once the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueOpusDecode( void* decoder, double timeout_ms )
+{
+  struct FreeQueueOpusDecoder* d = (struct FreeQueueOpusDecoder*)decoder;
+  if ( d == nullptr || d->ended ) return -1;
+  int written = 0;
+  bool waited = false;
+  while ( true ) {
+    if ( !d->pending ) {
+      if ( !_opusNextPacket( d ) ) {
+        d->ended = true;
+        break;
+      }
+      d->pending = true;
+    }
+    uint32_t lost = d->lost;
+    bool whole;
+    size_t frames = _opusStepFrames( d, d->packet, d->packet_bytes, &lost, &whole );
+    if ( !waited ) {
+      int ready = _waitWritable( d->queue, frames, timeout_ms );
+      if ( ready <= 0 ) return ready;
+      waited = true;
+    } else if ( !_isWritable( d->queue, frames ) ) {
+      break;
+    }
+    int result = _opusStep( d, whole ? d->packet : nullptr, d->packet_bytes, lost );
+    d->lost -= lost;
+    if ( whole ) d->pending = false;
+    if ( result < 0 ) {
+      d->ended = true;
+      break;
+    }
+    written += result;
+  }
+  return written == 0 && d->ended ? -1 : written;
+}
+
+/**
+ * Decodes one live packet, first filling in |lost| packets missing before
+ * it (the last from its FEC data, the others by concealment, less any
+ * FreeQueueOpusConceal already covered). |packet| nullptr reports losses
+ * alone. A gap longer than the ring is concealed in steps, each waiting up
+ * to |timeout_ms| for room. When a wait times out, what was concealed so
+ * far counts against |lost| when the call is repeated.
+ * @return {int} Frames written, 0 if there was no room in time, -1 on a
+ *   decoder error or once the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueOpusDecodePacket( void* decoder, const void* packet, size_t bytes, uint32_t lost,
+    double timeout_ms )
+{
+  struct FreeQueueOpusDecoder* d = (struct FreeQueueOpusDecoder*)decoder;
+  if ( d == nullptr ) return -1;
+  const uint8_t* data = bytes > 0 ? (const uint8_t*)packet : nullptr;
+  lost = lost > d->concealed ? lost - d->concealed : 0;
+  int written = 0;
+  while ( true ) {
+    uint32_t step = lost;
+    bool whole;
+    size_t frames = _opusStepFrames( d, data, bytes, &step, &whole );
+    int ready = _waitWritable( d->queue, frames, timeout_ms );
+    if ( ready <= 0 ) return ready;
+    int result = _opusStep( d, whole ? data : nullptr, bytes, step );
+    if ( result < 0 ) return -1;
+    written += result;
+    if ( whole ) break;
+    d->concealed += step;
+    lost -= step;
+  }
+  d->concealed = 0;
+  return written;
+}
+
+/**
+ * Conceals packets, one packet duration at a time, while the queue holds
+ * fewer than |min_fill| frames, so a late packet does not starve the
+ * consumer. Call it from the consumer's clock; never blocks. Concealed
+ * packets count against the |lost| of the next FreeQueueOpusDecodePacket.
+ * @return {int} Frames written, -1 on a decoder error.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueOpusConceal( void* decoder, size_t min_fill )
+{
+  struct FreeQueueOpusDecoder* d = (struct FreeQueueOpusDecoder*)decoder;
+  if ( d == nullptr ) return -1;
+  int written = 0;
+  while ( _roomBelow( d->queue, min_fill ) > 0 && _isWritable( d->queue, d->last_frames ) ) {
+    int result = _opusStep( d, nullptr, 0, 1 );
+    if ( result < 0 ) return -1;
+    d->concealed++;
+    written += result;
+  }
+  return written;
+}
+
+/**
+ * Copies the output format into |info|.
+ * @return {int} 1 on success, -1 for a bad decoder.
+ */
+EMSCRIPTEN_KEEPALIVE
+int GetFreeQueueOpusDecoderInfo( void* decoder, struct FreeQueueStreamInfo* info )
+{
+  struct FreeQueueOpusDecoder* d = (struct FreeQueueOpusDecoder*)decoder;
+  if ( d == nullptr || info == nullptr ) return -1;
+  *info = d->info;
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
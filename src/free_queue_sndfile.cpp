@@ -0,0 +1,236 @@
+/**
+ * Generic file producer on libsndfile: any format it reads (WAV, AIFF,
+ * FLAC, Ogg, ...) is opened with sf_open_virtual over a buffer in memory
+ * or a memory-mapped file, read with the sf_readf_* variant that yields
+ * the queue's own sample type, and deinterleaved into the ring in large
+ * chunks as free space allows. Link with -lsndfile.
+ */
+#include "free_queue_codec.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sndfile.h>
+
+/** Most frames read per sf_readf_* call. */
+#define FREE_QUEUE_SNDFILE_CHUNK 8192
+
+struct FreeQueueSndfileDecoder {
+  FreeQueue<double> *queue;
+  SNDFILE *file;
+  struct FreeQueueMemoryStream stream;
+  struct FreeQueueStreamInfo info;
+  /** Interleaved scratch of |chunk| frames in the queue's sample type. */
+  void *scratch;
+  /** Frames read at once: FREE_QUEUE_SNDFILE_CHUNK, capped by the ring. */
+  size_t chunk;
+  /** Mapping to unmap on destroy, when the decoder mapped a file itself. */
+  void *mapping;
+  size_t mapping_bytes;
+  bool ended;
+};
+
+static sf_count_t _sndfileLength(void *user_data) {
+  return ((struct FreeQueueMemoryStream *)user_data)->bytes;
+}
+
+static sf_count_t _sndfileSeek(sf_count_t offset, int whence, void *user_data) {
+  struct FreeQueueMemoryStream *stream = (struct FreeQueueMemoryStream *)user_data;
+  if (_memoryStreamSeek(stream, offset, whence) != 0) return -1;
+  return stream->position;
+}
+
+static sf_count_t _sndfileRead(void *ptr, sf_count_t count, void *user_data) {
+  return _memoryStreamRead((struct FreeQueueMemoryStream *)user_data, ptr, (size_t)count);
+}
+
+static sf_count_t _sndfileWrite(const void *, sf_count_t, void *) {
+  return 0;
+}
+
+static sf_count_t _sndfileTell(void *user_data) {
+  return ((struct FreeQueueMemoryStream *)user_data)->position;
+}
+
+static sf_count_t _sndfileReadf(SNDFILE *file, double *data, sf_count_t frames) {
+  return sf_readf_double(file, data, frames);
+}
+static sf_count_t _sndfileReadf(SNDFILE *file, float *data, sf_count_t frames) {
+  return sf_readf_float(file, data, frames);
+}
+static sf_count_t _sndfileReadf(SNDFILE *file, int16_t *data, sf_count_t frames) {
+  return sf_readf_short(file, data, frames);
+}
+static sf_count_t _sndfileReadf(SNDFILE *file, int32_t *data, sf_count_t frames) {
+  return sf_readf_int(file, data, frames);
+}
+
+/**
+ * Reads up to |length| frames and deinterleaves them into the ring, which
+ * must have room for them.
+ * @return {sf_count_t} Frames written, 0 at the end of the file.
+ */
+template <typename T>
+static sf_count_t _sndfileReadInto(FreeQueue<T> *queue, struct FreeQueueSndfileDecoder *d,
+    size_t length) {
+  T *scratch = (T *)d->scratch;
+  sf_count_t frames = _sndfileReadf(d->file, scratch, (sf_count_t)length);
+  if (frames > 0 && !_pushMapped(queue, scratch, d->info.channel_count, (size_t)frames)) {
+    return 0;
+  }
+  return frames > 0 ? frames : 0;
+}
+
+static sf_count_t _sndfileReadChunk(struct FreeQueueSndfileDecoder *d, size_t length) {
+  void *instance = d->queue;
+  switch (d->queue->sample_type) {
+    case FREE_QUEUE_FLOAT64: return _sndfileReadInto((FreeQueue<double> *)instance, d, length);
+    case FREE_QUEUE_FLOAT32: return _sndfileReadInto((FreeQueue<float> *)instance, d, length);
+    case FREE_QUEUE_INT16: return _sndfileReadInto((FreeQueue<int16_t> *)instance, d, length);
+    case FREE_QUEUE_INT32: return _sndfileReadInto((FreeQueue<int32_t> *)instance, d, length);
+  }
+  return 0;
+}
+
+/** Bits of the PCM subtypes, 0 for compressed and float data. */
+static uint32_t _sndfileBits(int format) {
+  switch (format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_S8:
+    case SF_FORMAT_PCM_U8: return 8;
+    case SF_FORMAT_PCM_16: return 16;
+    case SF_FORMAT_PCM_24: return 24;
+    case SF_FORMAT_PCM_32: return 32;
+  }
+  return 0;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void DestroyFreeQueueSndfileDecoder( void* decoder )
+{
+  struct FreeQueueSndfileDecoder* d = (struct FreeQueueSndfileDecoder*)decoder;
+  if ( d != nullptr ) {
+    if ( d->file != nullptr ) sf_close( d->file );
+    if ( d->mapping != nullptr ) munmap( d->mapping, d->mapping_bytes );
+    free( d->scratch );
+    free( d );
+  }
+}
+
+/**
+ * Creates a decoder for a sound file of any format libsndfile reads, held
+ * in |data|, writing into the queue |instance| (any sample type). |data|
+ * must outlive the decoder.
+ * @return {void*} Decoder, or nullptr when libsndfile cannot read |data|
+ *   or allocation fails.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueSndfileDecoder( void* instance, const void* data, size_t bytes )
+{
+  if ( instance == nullptr || data == nullptr ) return nullptr;
+  struct FreeQueueSndfileDecoder* d =
+      (struct FreeQueueSndfileDecoder*)calloc( 1, sizeof(struct FreeQueueSndfileDecoder) );
+  if ( d == nullptr ) return nullptr;
+  d->queue = (FreeQueue<double>*)instance;
+  d->stream.data = (const uint8_t*)data;
+  d->stream.bytes = bytes;
+  static SF_VIRTUAL_IO io = { _sndfileLength, _sndfileSeek, _sndfileRead, _sndfileWrite,
+      _sndfileTell };
+  SF_INFO info;
+  memset( &info, 0, sizeof(info) );
+  d->file = sf_open_virtual( &io, SFM_READ, &info, &d->stream );
+  if ( d->file == nullptr || info.channels <= 0 ) {
+    DestroyFreeQueueSndfileDecoder( d );
+    return nullptr;
+  }
+  // without this, float data read as integers is truncated to 0 or +-1
+  sf_command( d->file, SFC_SET_SCALE_FLOAT_INT_READ, nullptr, SF_TRUE );
+  d->info.sample_rate = (uint32_t)info.samplerate;
+  d->info.channel_count = (uint32_t)info.channels;
+  d->info.bits_per_sample = _sndfileBits( info.format );
+  d->info.total_frames = info.frames > 0 ? (uint64_t)info.frames : 0;
+  size_t capacity = _capacity( d->queue );
+  d->chunk = capacity < FREE_QUEUE_SNDFILE_CHUNK ? capacity : FREE_QUEUE_SNDFILE_CHUNK;
+  d->scratch = malloc( d->chunk * info.channels * _sampleSize( d->queue->sample_type ) );
+  if ( d->scratch == nullptr ) {
+    DestroyFreeQueueSndfileDecoder( d );
+    return nullptr;
+  }
+  return d;
+}
+
+/**
+ * CreateFreeQueueSndfileDecoder over the file at |path|, mapped into
+ * memory rather than read up front.
+ * @return {void*} Decoder, or nullptr when the file cannot be mapped or
+ *   read.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueSndfileFileDecoder( void* instance, const char* path )
+{
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) return nullptr;
+  struct stat st;
+  void* mapping = MAP_FAILED;
+  if ( fstat( fd, &st ) == 0 && st.st_size > 0 ) {
+    mapping = mmap( nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  }
+  // the mapping stays valid after the descriptor is closed
+  close( fd );
+  if ( mapping == MAP_FAILED ) return nullptr;
+  madvise( mapping, (size_t)st.st_size, MADV_SEQUENTIAL );
+  struct FreeQueueSndfileDecoder* d = (struct FreeQueueSndfileDecoder*)
+      CreateFreeQueueSndfileDecoder( instance, mapping, (size_t)st.st_size );
+  if ( d == nullptr ) {
+    munmap( mapping, (size_t)st.st_size );
+    return nullptr;
+  }
+  d->mapping = mapping;
+  d->mapping_bytes = (size_t)st.st_size;
+  return d;
+}
+
+/**
+ * Reads chunks of up to 8192 frames into the queue while a whole chunk
+ * fits, waiting up to |timeout_ms| (negative waits forever) for room for
+ * the first.
+ * @return {int} Frames written, 0 if there was no room in time, -1 at the
+ *   end of the file, on a read error or once the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueSndfileDecode( void* decoder, double timeout_ms )
+{
+  struct FreeQueueSndfileDecoder* d = (struct FreeQueueSndfileDecoder*)decoder;
+  if ( d == nullptr || d->ended ) return -1;
+  int ready = _waitWritable( d->queue, d->chunk, timeout_ms );
+  if ( ready <= 0 ) return ready;
+  int written = 0;
+  do {
+    sf_count_t frames = _sndfileReadChunk( d, d->chunk );
+    if ( frames == 0 ) {
+      d->ended = true;
+      break;
+    }
+    written += (int)frames;
+  } while ( _isWritable( d->queue, d->chunk ) );
+  return written == 0 && d->ended ? -1 : written;
+}
+
+/**
+ * Copies the file's format into |info|.
+ * @return {int} 1 on success, -1 for a bad decoder.
+ */
+EMSCRIPTEN_KEEPALIVE
+int GetFreeQueueSndfileDecoderInfo( void* decoder, struct FreeQueueStreamInfo* info )
+{
+  struct FreeQueueSndfileDecoder* d = (struct FreeQueueSndfileDecoder*)decoder;
+  if ( d == nullptr || info == nullptr ) return -1;
+  *info = d->info;
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
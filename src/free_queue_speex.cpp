@@ -0,0 +1,287 @@
+/**
+ * Speex voice producer: narrowband, wideband or ultra-wideband packets,
+ * each holding one or more 20 ms frames, come from a length-prefixed
+ * packet stream in memory or one by one from the caller (live). Frames
+ * are decoded to int16 with speex_decode_int (and speex_decode_stereo_int
+ * for intensity stereo) and written to the queue one at a time. Lost
+ * packets are concealed by decoding without bits, so a loss never turns
+ * into a gap. Link with -lspeex.
+ */
+#include "free_queue_codec.h"
+#include <speex/speex.h>
+#include <speex/speex_callbacks.h>
+#include <speex/speex_stereo.h>
+
+struct FreeQueueSpeexDecoder {
+  FreeQueue<double> *queue;
+  void *state;
+  SpeexBits bits;
+  /** Set for stereo streams. */
+  SpeexStereoState *stereo;
+  SpeexCallback callback;
+  struct FreeQueueStreamInfo info;
+  /** Frames per Speex frame: 160, 320 or 640 (20 ms). */
+  int frame_size;
+  uint32_t frames_per_packet;
+  /** Interleaved scratch of one Speex frame. */
+  int16_t *pcm;
+  /** Packets concealed by FreeQueueSpeexConceal since the last packet. */
+  uint32_t concealed;
+  /** Packet source for FreeQueueSpeexDecode, if any. */
+  struct FreeQueueMemoryStream input;
+  /** Next packet, read from |input| but not decoded for lack of room. */
+  const uint8_t *packet;
+  size_t packet_bytes;
+  uint32_t lost;
+  bool pending;
+  bool ended;
+};
+
+/**
+ * Decodes one Speex frame from |bits|, or conceals one for nullptr, and
+ * writes it to the queue.
+ * @return {int} 0 on success, -1 at the end of the packet, -2 on a corrupt
+ *   frame, -3 once the queue is closed.
+ */
+static int _speexFrame(struct FreeQueueSpeexDecoder *d, SpeexBits *bits) {
+  int result = speex_decode_int(d->state, bits, d->pcm);
+  if (result < 0) return result;
+  if (d->stereo != nullptr) speex_decode_stereo_int(d->pcm, d->frame_size, d->stereo);
+  return _pushInterleaved(d->queue, d->pcm, d->info.channel_count, d->frame_size) ? 0 : -3;
+}
+
+/**
+ * Limits |lost| so that concealing it and decoding a packet, if
+ * |has_packet|, fits in the ring. @return {size_t} Frames the whole step
+ * writes.
+ */
+static size_t _speexStepFrames(struct FreeQueueSpeexDecoder *d, bool has_packet,
+    uint32_t *lost) {
+  size_t packet_frames = (size_t)d->frame_size * d->frames_per_packet;
+  size_t frames = has_packet ? packet_frames : 0;
+  size_t spare = _capacity(d->queue) - frames;
+  if (*lost > spare / packet_frames) *lost = (uint32_t)(spare / packet_frames);
+  return frames + *lost * packet_frames;
+}
+
+/**
+ * Conceals |lost| packets, then decodes |packet|. Frames of |packet| that
+ * fail to decode or follow a terminator are concealed too, so every packet
+ * lasts the same. The room reported by _speexStepFrames must be writable.
+ * @return {int} Frames written, -1 once the queue is closed.
+ */
+static int _speexStep(struct FreeQueueSpeexDecoder *d, const uint8_t *packet, size_t bytes,
+    uint32_t lost) {
+  int written = 0;
+  for (uint32_t i = 0; i < lost * d->frames_per_packet; i++) {
+    if (_speexFrame(d, nullptr) == -3) return -1;
+    written += d->frame_size;
+  }
+  if (packet == nullptr) return written;
+  speex_bits_read_from(&d->bits, (const char *)packet, (int)bytes);
+  bool corrupt = false;
+  for (uint32_t i = 0; i < d->frames_per_packet; i++) {
+    int result = corrupt ? _speexFrame(d, nullptr) : _speexFrame(d, &d->bits);
+    // a terminator ends the packet early; the rest is concealed like a
+    // corrupt frame
+    if (result == -1 || result == -2) {
+      corrupt = true;
+      result = _speexFrame(d, nullptr);
+    } else if (result == 0 && speex_bits_remaining(&d->bits) < 0) {
+      corrupt = true;
+    }
+    if (result == -3) return -1;
+    written += d->frame_size;
+  }
+  return written;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void DestroyFreeQueueSpeexDecoder( void* decoder )
+{
+  struct FreeQueueSpeexDecoder* d = (struct FreeQueueSpeexDecoder*)decoder;
+  if ( d != nullptr ) {
+    if ( d->state != nullptr ) {
+      speex_decoder_destroy( d->state );
+      speex_bits_destroy( &d->bits );
+    }
+    if ( d->stereo != nullptr ) speex_stereo_state_destroy( d->stereo );
+    free( d->pcm );
+    free( d );
+  }
+}
+
+/**
+ * Creates a decoder writing into the queue |instance| (any sample type).
+ * |mode| is SPEEX_MODEID_NB, SPEEX_MODEID_WB or SPEEX_MODEID_UWB, and
+ * |channel_count| 1, or 2 for intensity stereo. Each packet holds
+ * |frames_per_packet| frames of 20 ms (0 means 1). |data| optionally holds
+ * a length-prefixed packet stream for FreeQueueSpeexDecode: each packet
+ * follows its length as a 32-bit little-endian integer, and a length of 0
+ * marks a lost packet. It must outlive the decoder. Live packets go to
+ * FreeQueueSpeexDecodePacket instead.
+ * @return {void*} Decoder, or nullptr on bad parameters, when allocation
+ *   fails or when the ring cannot hold a packet.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueSpeexDecoder( void* instance, int mode, uint32_t channel_count,
+    uint32_t frames_per_packet, const void* data, size_t bytes )
+{
+  if ( instance == nullptr || mode < 0 || mode >= SPEEX_NB_MODES ||
+      channel_count == 0 || channel_count > 2 ) {
+    return nullptr;
+  }
+  struct FreeQueueSpeexDecoder* d =
+      (struct FreeQueueSpeexDecoder*)calloc( 1, sizeof(struct FreeQueueSpeexDecoder) );
+  if ( d == nullptr ) return nullptr;
+  d->queue = (FreeQueue<double>*)instance;
+  d->frames_per_packet = frames_per_packet > 0 ? frames_per_packet : 1;
+  d->info.channel_count = channel_count;
+  d->input.data = (const uint8_t*)data;
+  d->input.bytes = data != nullptr ? bytes : 0;
+  d->state = speex_decoder_init( speex_lib_get_mode( mode ) );
+  if ( d->state == nullptr ) {
+    DestroyFreeQueueSpeexDecoder( d );
+    return nullptr;
+  }
+  speex_bits_init( &d->bits );
+  int sample_rate = 0;
+  speex_decoder_ctl( d->state, SPEEX_GET_FRAME_SIZE, &d->frame_size );
+  speex_decoder_ctl( d->state, SPEEX_GET_SAMPLING_RATE, &sample_rate );
+  d->info.sample_rate = (uint32_t)sample_rate;
+  if ( channel_count == 2 ) {
+    d->stereo = speex_stereo_state_init();
+    if ( d->stereo == nullptr ) {
+      DestroyFreeQueueSpeexDecoder( d );
+      return nullptr;
+    }
+    d->callback.callback_id = SPEEX_INBAND_STEREO;
+    d->callback.func = speex_std_stereo_request_handler;
+    d->callback.data = d->stereo;
+    speex_decoder_ctl( d->state, SPEEX_SET_HANDLER, &d->callback );
+  }
+  if ( d->frame_size <= 0 ||
+      _capacity( d->queue ) < (size_t)d->frame_size * d->frames_per_packet ) {
+    DestroyFreeQueueSpeexDecoder( d );
+    return nullptr;
+  }
+  // speex_decode_stereo_int expands the mono frame in place
+  d->pcm = (int16_t*)malloc( d->frame_size * channel_count * sizeof(int16_t) );
+  if ( d->pcm == nullptr ) {
+    DestroyFreeQueueSpeexDecoder( d );
+    return nullptr;
+  }
+  return d;
+}
+
+/**
+ * Decodes packets from the decoder's input while the next one fits in the
+ * ring, waiting up to |timeout_ms| (negative waits forever) for room for
+ * the first. Lost packets are concealed.
+ * @return {int} Frames written, 0 if no packet fit in time, -1 at the end
+ *   of the input or once the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueSpeexDecode( void* decoder, double timeout_ms )
+{
+  struct FreeQueueSpeexDecoder* d = (struct FreeQueueSpeexDecoder*)decoder;
+  if ( d == nullptr || d->ended ) return -1;
+  int written = 0;
+  bool waited = false;
+  while ( true ) {
+    if ( !d->pending ) {
+      int result;
+      while ( ( result = _memoryStreamPacket( &d->input, &d->packet, &d->packet_bytes ) ) == 0 ) {
+        d->lost++;
+      }
+      if ( result < 0 ) {
+        d->ended = true;
+        break;
+      }
+      d->pending = true;
+    }
+    size_t frames = _speexStepFrames( d, true, &d->lost );
+    if ( !waited ) {
+      int ready = _waitWritable( d->queue, frames, timeout_ms );
+      if ( ready <= 0 ) return ready;
+      waited = true;
+    } else if ( !_isWritable( d->queue, frames ) ) {
+      break;
+    }
+    int result = _speexStep( d, d->packet, d->packet_bytes, d->lost );
+    d->pending = false;
+    d->lost = 0;
+    if ( result < 0 ) {
+      d->ended = true;
+      break;
+    }
+    written += result;
+  }
+  return written == 0 && d->ended ? -1 : written;
+}
+
+/**
+ * Decodes one live packet, first concealing |lost| packets missing before
+ * it, less any FreeQueueSpeexConceal already covered. |packet| nullptr
+ * reports losses alone. Waits up to |timeout_ms| for room.
+ * @return {int} Frames written, 0 if there was no room in time, -1 once
+ *   the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueSpeexDecodePacket( void* decoder, const void* packet, size_t bytes,
+    uint32_t lost, double timeout_ms )
+{
+  struct FreeQueueSpeexDecoder* d = (struct FreeQueueSpeexDecoder*)decoder;
+  if ( d == nullptr ) return -1;
+  const uint8_t* data = bytes > 0 ? (const uint8_t*)packet : nullptr;
+  lost = lost > d->concealed ? lost - d->concealed : 0;
+  size_t frames = _speexStepFrames( d, data != nullptr, &lost );
+  int ready = _waitWritable( d->queue, frames, timeout_ms );
+  if ( ready <= 0 ) return ready;
+  d->concealed = 0;
+  return _speexStep( d, data, bytes, lost );
+}
+
+/**
+ * Conceals packets, one packet duration at a time, while the queue holds
+ * fewer than |min_fill| frames, so a late packet does not starve the
+ * consumer. Call it from the consumer's clock; never blocks. Concealed
+ * packets count against the |lost| of the next FreeQueueSpeexDecodePacket.
+ * @return {int} Frames written, -1 once the queue is closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueSpeexConceal( void* decoder, size_t min_fill )
+{
+  struct FreeQueueSpeexDecoder* d = (struct FreeQueueSpeexDecoder*)decoder;
+  if ( d == nullptr ) return -1;
+  int written = 0;
+  size_t packet_frames = (size_t)d->frame_size * d->frames_per_packet;
+  while ( _roomBelow( d->queue, min_fill ) > 0 && _isWritable( d->queue, packet_frames ) ) {
+    int result = _speexStep( d, nullptr, 0, 1 );
+    if ( result < 0 ) return -1;
+    d->concealed++;
+    written += result;
+  }
+  return written;
+}
+
+/**
+ * Copies the output format into |info|.
+ * @return {int} 1 on success, -1 for a bad decoder.
+ */
+EMSCRIPTEN_KEEPALIVE
+int GetFreeQueueSpeexDecoderInfo( void* decoder, struct FreeQueueStreamInfo* info )
+{
+  struct FreeQueueSpeexDecoder* d = (struct FreeQueueSpeexDecoder*)decoder;
+  if ( d == nullptr || info == nullptr ) return -1;
+  *info = d->info;
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,172 @@
+/**
+ * Ogg Vorbis producer: decodes a stream held in memory with vorbisfile's
+ * ov_read_float, asking for exactly the frames reserved by a write window
+ * so each decoded packet is converted once, from libvorbis' own planar
+ * buffers into the ring. Link with -lvorbisfile -lvorbis -logg.
+ */
+#include "free_queue_codec.h"
+#include <vorbis/vorbisfile.h>
+
+/** Most frames reserved per ov_read_float call. */
+#define FREE_QUEUE_VORBIS_CHUNK 4096
+
+struct FreeQueueVorbisDecoder {
+  FreeQueue<double> *queue;
+  OggVorbis_File file;
+  struct FreeQueueMemoryStream stream;
+  struct FreeQueueStreamInfo info;
+  /** Fill level in frames at which decoding pauses. */
+  size_t high_watermark;
+  bool opened;
+  bool ended;
+};
+
+static size_t _vorbisRead(void *ptr, size_t size, size_t nmemb, void *datasource) {
+  if (size == 0) return 0;
+  return _memoryStreamRead((struct FreeQueueMemoryStream *)datasource, ptr, size * nmemb) / size;
+}
+
+static int _vorbisSeek(void *datasource, ogg_int64_t offset, int whence) {
+  return _memoryStreamSeek((struct FreeQueueMemoryStream *)datasource, offset, whence);
+}
+
+static long _vorbisTell(void *datasource) {
+  return (long)((struct FreeQueueMemoryStream *)datasource)->position;
+}
+
+/**
+ * Reserves up to |length| frames, decodes into them and publishes what
+ * was decoded. Ring channel c takes channel c % channels of the link.
+ * @return {long} Frames written, 0 at the end of the stream, OV_HOLE after
+ *   a gap in the data, or another negative OV_ error.
+ */
+template <typename T>
+static long _vorbisDecodeInto(FreeQueue<T> *queue, OggVorbis_File *file, size_t length) {
+  struct FreeQueueWindow window;
+  size_t reserved = _beginWrite(queue, length, &window);
+  if (reserved == 0) return 0;
+  float **pcm;
+  int link;
+  long frames = ov_read_float(file, &pcm, (int)reserved, &link);
+  if (frames <= 0) return frames;
+  size_t first = (size_t)frames < window.first ? (size_t)frames : window.first;
+  int channels = ov_info(file, link)->channels;
+  for (size_t channel = 0; channel < queue->channel_count; channel++) {
+    const float *source = pcm[channel % channels];
+    _convertSpan(source, queue->channel_data[channel] + window.offset, first);
+    _convertSpan(source + first, queue->channel_data[channel], frames - first);
+  }
+  _commitWrite(queue, frames);
+  return frames;
+}
+
+static long _vorbisDecodeChunk(struct FreeQueueVorbisDecoder *d, size_t length) {
+  void *instance = d->queue;
+  switch (d->queue->sample_type) {
+    case FREE_QUEUE_FLOAT64:
+      return _vorbisDecodeInto((FreeQueue<double> *)instance, &d->file, length);
+    case FREE_QUEUE_FLOAT32:
+      return _vorbisDecodeInto((FreeQueue<float> *)instance, &d->file, length);
+    case FREE_QUEUE_INT16:
+      return _vorbisDecodeInto((FreeQueue<int16_t> *)instance, &d->file, length);
+    case FREE_QUEUE_INT32:
+      return _vorbisDecodeInto((FreeQueue<int32_t> *)instance, &d->file, length);
+  }
+  return OV_EINVAL;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void DestroyFreeQueueVorbisDecoder( void* decoder )
+{
+  struct FreeQueueVorbisDecoder* d = (struct FreeQueueVorbisDecoder*)decoder;
+  if ( d != nullptr ) {
+    if ( d->opened ) ov_clear( &d->file );
+    free( d );
+  }
+}
+
+/**
+ * Creates a decoder writing into the queue |instance| (any sample type).
+ * Decoding pauses once the queue holds |high_watermark| frames (0 decodes
+ * until the ring is full). |data| must outlive the decoder.
+ * @return {void*} Decoder, or nullptr when |data| is not Ogg Vorbis or
+ *   allocation fails.
+ */
+EMSCRIPTEN_KEEPALIVE
+void *CreateFreeQueueVorbisDecoder( void* instance, const void* data, size_t bytes,
+    size_t high_watermark )
+{
+  if ( instance == nullptr || data == nullptr ) return nullptr;
+  struct FreeQueueVorbisDecoder* d =
+      (struct FreeQueueVorbisDecoder*)calloc( 1, sizeof(struct FreeQueueVorbisDecoder) );
+  if ( d == nullptr ) return nullptr;
+  d->queue = (FreeQueue<double>*)instance;
+  d->stream.data = (const uint8_t*)data;
+  d->stream.bytes = bytes;
+  size_t capacity = _capacity( d->queue );
+  d->high_watermark = high_watermark == 0 || high_watermark > capacity ? capacity : high_watermark;
+  ov_callbacks callbacks = { _vorbisRead, _vorbisSeek, nullptr, _vorbisTell };
+  if ( ov_open_callbacks( &d->stream, &d->file, nullptr, 0, callbacks ) != 0 ) {
+    free( d );
+    return nullptr;
+  }
+  d->opened = true;
+  vorbis_info* info = ov_info( &d->file, -1 );
+  d->info.sample_rate = (uint32_t)info->rate;
+  d->info.channel_count = (uint32_t)info->channels;
+  ogg_int64_t total = ov_pcm_total( &d->file, -1 );
+  d->info.total_frames = total > 0 ? (uint64_t)total : 0;
+  return d;
+}
+
+/**
+ * Decodes into the queue until it holds |high_watermark| frames, waiting
+ * up to |timeout_ms| (negative waits forever) for the level to drop below
+ * the watermark first. Gaps in the stream are skipped.
+ * @return {int} Frames written, 0 if the level stayed at the watermark,
+ *   -1 at the end of the stream, on a decoder error or once the queue is
+ *   closed.
+ */
+EMSCRIPTEN_KEEPALIVE
+int FreeQueueVorbisDecode( void* decoder, double timeout_ms )
+{
+  struct FreeQueueVorbisDecoder* d = (struct FreeQueueVorbisDecoder*)decoder;
+  if ( d == nullptr || d->ended ) return -1;
+  size_t threshold = _capacity( d->queue ) - d->high_watermark + 1;
+  int ready = _waitWritable( d->queue, threshold, timeout_ms );
+  if ( ready <= 0 ) return ready;
+  long written = 0;
+  size_t room;
+  while ( ( room = _roomBelow( d->queue, d->high_watermark ) ) > 0 ) {
+    long frames = _vorbisDecodeChunk( d,
+        room < FREE_QUEUE_VORBIS_CHUNK ? room : FREE_QUEUE_VORBIS_CHUNK );
+    if ( frames == OV_HOLE ) continue;
+    if ( frames <= 0 ) {
+      d->ended = true;
+      break;
+    }
+    written += frames;
+  }
+  return written == 0 && d->ended ? -1 : (int)written;
+}
+
+/**
+ * Copies the format of the first link into |info|.
+ * @return {int} 1 on success, -1 for a bad decoder.
+ */
+EMSCRIPTEN_KEEPALIVE
+int GetFreeQueueVorbisDecoderInfo( void* decoder, struct FreeQueueStreamInfo* info )
+{
+  struct FreeQueueVorbisDecoder* d = (struct FreeQueueVorbisDecoder*)decoder;
+  if ( d == nullptr || info == nullptr ) return -1;
+  *info = d->info;
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif